@@ -1,5 +1,8 @@
 #pragma once
 
+#include <algorithm>
+#include <cfloat>
+
 #include "Core.h"
 
 /* Axis Aligned Bounding Box class */
@@ -11,6 +14,12 @@ struct AABB
 	AABB() : Min(0.0), Max(0.0) {}
 	AABB(const Vector3 InMin, const Vector3 InMax) : Min(InMin), Max(InMax) {}
 
+	/* Inverted box which becomes valid after the first Expand call */
+	static AABB Empty()
+	{
+		return AABB(Vector3(DBL_MAX), Vector3(-DBL_MAX));
+	}
+
 	Vector3 GetExtent() const
 	{
 		return ((Max - Min) / 2.0).Abs();
@@ -27,6 +36,32 @@ struct AABB
 		Max = Center + Extent;
 	}
 
+	/* Grow the box to include Other */
+	void Expand(const AABB& Other)
+	{
+		Min = { std::min(Min.X, Other.Min.X), std::min(Min.Y, Other.Min.Y), std::min(Min.Z, Other.Min.Z) };
+		Max = { std::max(Max.X, Other.Max.X), std::max(Max.Y, Other.Max.Y), std::max(Max.Z, Other.Max.Z) };
+	}
+
+	/* Grow the box to include Point */
+	void Expand(const Vector3& Point)
+	{
+		Min = { std::min(Min.X, Point.X), std::min(Min.Y, Point.Y), std::min(Min.Z, Point.Z) };
+		Max = { std::max(Max.X, Point.X), std::max(Max.Y, Point.Y), std::max(Max.Z, Point.Z) };
+	}
+
+	/* Shrink the box to its overlap with Other, the result is invalid if they don't overlap */
+	void Clip(const AABB& Other)
+	{
+		Min = { std::max(Min.X, Other.Min.X), std::max(Min.Y, Other.Min.Y), std::max(Min.Z, Other.Min.Z) };
+		Max = { std::min(Max.X, Other.Max.X), std::min(Max.Y, Other.Max.Y), std::min(Max.Z, Other.Max.Z) };
+	}
+
+	bool IsValid() const
+	{
+		return Min.X <= Max.X && Min.Y <= Max.Y && Min.Z <= Max.Z;
+	}
+
 	double Area() const
 	{
 		const double SideX = Max.X - Min.X;
@@ -36,20 +71,33 @@ struct AABB
 		return 2.0 * (SideX * SideY + SideY * SideZ + SideZ * SideX);
 	}
 
-	bool Intersects(const RRay Ray) const
+	bool Intersects(const RRay& Ray) const
+	{
+		double Distance;
+		return Intersects(Ray, Distance);
+	}
+
+	/* 
+	 * Slab test against the part of the ray inside [TMin, TMax] with the ray's cached inverse direction.
+	 * Also returns the distance at which the ray enters the box, clamped to TMin.
+	 */
+	bool Intersects(const RRay& Ray, double& OutDistance) const
 	{
-		const Vector3 LocalRayOrigin = Ray.Origin - GetPosition();
-		const Vector3 m = Vector3(1.0) / Ray.Direction;
-		const Vector3 n = m * LocalRayOrigin;
-		const Vector3 k = m.Abs() * GetExtent();
-		const Vector3 t1 = -n - k;
-		const Vector3 t2 = -n + k;
+		const Vector3* Bounds[2] = { &Min, &Max };
 
-		const double tN = t1.GetMax(); //Near point distance
-		const double tF = t2.GetMin(); //Far point distance
+		const double NearX = (Bounds[Ray.Sign[0]]->X - Ray.Origin.X) * Ray.InvDirection.X;
+		const double FarX = (Bounds[1 - Ray.Sign[0]]->X - Ray.Origin.X) * Ray.InvDirection.X;
+		const double NearY = (Bounds[Ray.Sign[1]]->Y - Ray.Origin.Y) * Ray.InvDirection.Y;
+		const double FarY = (Bounds[1 - Ray.Sign[1]]->Y - Ray.Origin.Y) * Ray.InvDirection.Y;
+		const double NearZ = (Bounds[Ray.Sign[2]]->Z - Ray.Origin.Z) * Ray.InvDirection.Z;
+		const double FarZ = (Bounds[1 - Ray.Sign[2]]->Z - Ray.Origin.Z) * Ray.InvDirection.Z;
 
-		if (tN > tF || tF < 0.0) return false;
+		// std::max/min return their first argument when the second is NaN, so 0 * inf on a slab plane is ignored
+		const double Near = std::max(std::max(std::max(Ray.TMin, NearX), NearY), NearZ);
+		const double Far = std::min(std::min(std::min(Ray.TMax, FarX), FarY), FarZ);
+		if (Near > Far) return false;
 
+		OutDistance = Near;
 		return true;
 	}
 };
\ No newline at end of file
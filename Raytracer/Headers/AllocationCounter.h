@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+
+
+/* 
+ * Set to 1 to replace the global operator new with one that counts calls per thread, for benchmarking only
+ * since it adds to every allocation of the program. The counters stay at 0 otherwise.
+ */
+#ifndef COUNT_HEAP_ALLOCATIONS
+#define COUNT_HEAP_ALLOCATIONS 0
+#endif
+
+
+namespace AllocationCounter
+{
+	/* Calls to the global operator new made by the calling thread so far */
+	uint64_t GetThreadAllocations();
+};
+
+/* Heap allocations the calling thread made since the scope was created */
+struct AllocationScope
+{
+	const uint64_t StartAllocations = AllocationCounter::GetThreadAllocations();
+
+	uint64_t GetAllocations() const { return AllocationCounter::GetThreadAllocations() - StartAllocations; }
+};
@@ -1,271 +1,578 @@
 #pragma once
 
 #include <vector>
-#include <stack>
+#include <algorithm>
+#include <atomic>
 
 #include "Core.h"
 #include "AABB.h"
 #include "OObject.h"
 #include "Scene.h"
-
-struct BVHNodeBase
+#include "BVHStats.h"
+#include "TraversalStack.h"
+
+/* 
+ * Node of the flattened BVH, all nodes are stored in one contiguous array in depth-first order.
+ * Children of an inner node are always adjacent, Offset points to the first of them.
+ * For leaves Offset points to the first primitive in LinearBVH::Primitives.
+ */
+struct LinearBVHNode
 {
 	AABB Box;
-	virtual bool IsLeaf() const = 0;
+	uint32_t Offset = 0;
+	uint32_t PrimitiveCount = 0;
+
+	bool IsLeaf() const { return PrimitiveCount > 0; }
 };
 
-struct BVHNode final : public BVHNodeBase
+/* Pointer-free BVH used for traversal, built by CreateBVH */
+struct LinearBVH
 {
-	UniquePtr<BVHNodeBase> Left;
-	UniquePtr<BVHNodeBase> Right;
+	std::vector<LinearBVHNode> Nodes;
 
-	virtual bool IsLeaf() const { return false; }
-};
+	/* Primitives ordered so that every leaf references a contiguous range */
+	std::vector<SharedPtr<RPrimitive>> Primitives;
 
-struct BVHLeaf final : public BVHNodeBase
-{
-	std::vector<SharedPtr<RPrimitive>> Objects;
+	/* 
+	 * Index of every entry of Primitives in the list the BVH was built from, BVHs over indexed geometry keep only these.
+	 * Empty once that geometry is stored in leaf order and leaf offsets index it directly.
+	 */
+	std::vector<uint32_t> PrimitiveIndices;
 
-	virtual bool IsLeaf() const { return true; }
+	/* SAH cost right after the build, refits compare against it to detect a degraded tree */
+	double BuildCost = 0.0;
 };
 
-/* Helper struct for BVH constructing which contains primitive and its cached AABB */
-struct BoxPrimitive
+/* A refit tree whose SAH cost grew past this factor of BuildCost is rebuilt from scratch */
+constexpr double BVH_REFIT_MAX_DEGRADATION = 1.5;
+
+/* Number of centroid bins evaluated per axis by the SAH split search */
+constexpr uint32_t BVH_SAH_BINS = 32;
+
+/* Leaves are always created for ranges smaller than this */
+constexpr uint32_t BVH_MIN_SPLIT_PRIMITIVES = 4;
+
+/* Ranges smaller than this are split off the top levels as independent subtree tasks */
+constexpr uint32_t BVH_TASK_PRIMITIVES = 4096;
+
+/* Top-level ranges of at least this size compute their bounds and bins on all threads */
+constexpr uint32_t BVH_PARALLEL_BINNING_PRIMITIVES = 65536;
+
+/* Parallel binning always uses the same chunks, so its result doesn't depend on the number of threads */
+constexpr int32_t BVH_BINNING_CHUNKS = 64;
+
+/* Primitive bounds and centroid cached for the duration of the BVH build */
+struct BVHBuildPrimitive
 {
 	AABB Box;
-	const SharedPtr<RPrimitive> Primitive;
+	Vector3 Centroid;
+};
 
-	BoxPrimitive(const AABB& InBox, const SharedPtr<RPrimitive> InPrimitive) : Box(InBox), Primitive(InPrimitive) {}
+/* Bin of the SAH split search, accumulates primitives whose centroids fall into it */
+struct BVHBin
+{
+	AABB Box = AABB::Empty();
+	uint32_t Count = 0;
 };
 
+/* Bins of a range of primitives along all three axes */
+struct BVHBinGrid
+{
+	BVHBin Bins[3][BVH_SAH_BINS];
 
-/* Compare components in two vectors and assign values based on Compare Function to AssignTo vector */
-template<typename CompareFunc>
-inline void AssignVector(Vector3& AssignTo, const Vector3& CompareTo, CompareFunc Func)
+	void Merge(const BVHBinGrid& Other)
+	{
+		for (uint8_t Axis = 0; Axis < 3; Axis++)
+		{
+			for (uint32_t i = 0; i < BVH_SAH_BINS; i++)
+			{
+				Bins[Axis][i].Box.Expand(Other.Bins[Axis][i].Box);
+				Bins[Axis][i].Count += Other.Bins[Axis][i].Count;
+			}
+		}
+	}
+};
+
+/* Best split found for a range of primitives, Axis is -1 if no split is better than a leaf */
+struct BVHSplit
 {
-	AssignTo.X = Func(CompareTo.X, AssignTo.X) ? CompareTo.X : AssignTo.X;
-	AssignTo.Y = Func(CompareTo.Y, AssignTo.Y) ? CompareTo.Y : AssignTo.Y;
-	AssignTo.Z = Func(CompareTo.Z, AssignTo.Z) ? CompareTo.Z : AssignTo.Z;
-}
- 
-/* Get minimal AABB to include all AABB in BoxList */
-inline void GetObjectsAABB(Vector3& Min, Vector3& Max, const std::vector<BoxPrimitive>& BoxList)
+	int32_t Axis = -1;
+	uint32_t Bin = 0;
+	double Cost = DBL_MAX;
+};
+
+/* Maps centroid coordinates along one axis of the centroid bounds to bin indices */
+struct BVHBinMapping
 {
-	Max = { -DBL_MAX, -DBL_MAX, -DBL_MAX };
-	Min = {  DBL_MAX,  DBL_MAX,  DBL_MAX };
+	uint8_t Axis;
+	double Min;
+	double Scale;
 
-	for (auto& Box : BoxList) 
-	{		
-		AssignVector(Min, Box.Box.Min, std::less<double>());
-		AssignVector(Max, Box.Box.Max, std::greater<double>());
+	BVHBinMapping(const AABB& CentroidBox, const uint8_t InAxis) : Axis(InAxis), Min(CentroidBox.Min[InAxis]), Scale(0.0)
+	{
+		// Are the centroids all "packed" on the axis's plane? We can't split them then
+		const double Extent = CentroidBox.Max[InAxis] - CentroidBox.Min[InAxis];
+		if (Extent >= 1e-4) Scale = BVH_SAH_BINS / Extent;
 	}
-}
 
+	bool IsValid() const { return Scale > 0.0; }
 
-inline UniquePtr<BVHNodeBase> Recurse(std::vector<BoxPrimitive>& BoxList, uint16_t Depth = 0)
-{
-	if (BoxList.size() < 4) {
-		auto Leaf = MakeUnique<BVHLeaf>();
-		for (auto& Box : BoxList)
-			Leaf->Objects.push_back(Box.Primitive);
-		return Leaf;
+	uint32_t GetBin(const Vector3& Centroid) const
+	{
+		const double Value = Axis == 0 ? Centroid.X : (Axis == 1 ? Centroid.Y : Centroid.Z);
+		return std::min(static_cast<uint32_t>((Value - Min) * Scale), BVH_SAH_BINS - 1);
 	}
+};
 
-	// Start by finding the working list's bounding box
-	Vector3 Min, Max;
-	GetObjectsAABB(Min, Max, BoxList);
+/* Range of primitives whose subtree is built independently after the top levels are done */
+struct BVHBuildTask
+{
+	uint32_t Start;
+	uint32_t End;
+	uint32_t NodeIndex;
+};
+
+/* State shared by all threads of one BVH build */
+struct BVHBuildState
+{
+	const std::vector<BVHBuildPrimitive>& Primitives;
+
+	/* Primitive indices, every subtree partitions only its own range */
+	std::vector<uint32_t>& Indices;
 
-	// The current box has a cost of (No of triangles)*surfaceArea
-	double MinCost = BoxList.size() * AABB(Min, Max).Area();
-	double BestSplit = DBL_MAX; // will indicate no split with better cost found (below)
-	int32_t BestAxis = -1;
+	/* Preallocated node storage, sibling pairs are claimed through NodeCount */
+	std::vector<LinearBVHNode>& Nodes;
+	std::atomic<uint32_t> NodeCount;
 
-	// Try all different axis
-	for (uint8_t Axis = 0; Axis < 3; Axis++) 
+	BVHBuildState(const std::vector<BVHBuildPrimitive>& InPrimitives, std::vector<uint32_t>& InIndices, std::vector<LinearBVHNode>& InNodes)
+		: Primitives(InPrimitives), Indices(InIndices), Nodes(InNodes), NodeCount(1) {}
+};
+
+/* 
+ * Call Func(Chunk, ChunkStart, ChunkEnd) for BVH_BINNING_CHUNKS even chunks of [Start, End) on all threads.
+ * Callers merge per-chunk results in chunk order to keep the build deterministic.
+ */
+template<typename ChunkFunc>
+inline void ParallelForChunks(const uint32_t Start, const uint32_t End, ChunkFunc Func)
+{
+	const uint64_t Count = End - Start;
+
+	#pragma omp parallel for schedule(static)
+	for (int32_t Chunk = 0; Chunk < BVH_BINNING_CHUNKS; Chunk++)
 	{
-		// we will try dividing the triangles based on the current axis,
-		// and we will try split values from "start" to "stop", one "step" at a time.
-		double Start, Stop, Step;
+		const uint32_t ChunkStart = Start + static_cast<uint32_t>(Count * Chunk / BVH_BINNING_CHUNKS);
+		const uint32_t ChunkEnd = Start + static_cast<uint32_t>(Count * (Chunk + 1) / BVH_BINNING_CHUNKS);
+		Func(Chunk, ChunkStart, ChunkEnd);
+	}
+}
 
-		if (Axis == 0) 
+/* Bounds of the primitives and of their centroids in Indices[Start, End) */
+inline void GetRangeBounds(const BVHBuildState& State, const uint32_t Start, const uint32_t End, const bool bParallel, AABB& OutBox, AABB& OutCentroidBox)
+{
+	auto BoundChunk = [&State](const uint32_t ChunkStart, const uint32_t ChunkEnd, AABB& Box, AABB& CentroidBox)
+	{
+		for (uint32_t i = ChunkStart; i < ChunkEnd; i++)
 		{
-			Start = Min.X;
-			Stop = Max.X;
+			Box.Expand(State.Primitives[State.Indices[i]].Box);
+			CentroidBox.Expand(State.Primitives[State.Indices[i]].Centroid);
 		}
-		else if (Axis == 1) 
+	};
+
+	OutBox = AABB::Empty();
+	OutCentroidBox = AABB::Empty();
+
+	if (!bParallel)
+	{
+		BoundChunk(Start, End, OutBox, OutCentroidBox);
+		return;
+	}
+
+	std::vector<AABB> Boxes(BVH_BINNING_CHUNKS, AABB::Empty());
+	std::vector<AABB> CentroidBoxes(BVH_BINNING_CHUNKS, AABB::Empty());
+	ParallelForChunks(Start, End, [&](const int32_t Chunk, const uint32_t ChunkStart, const uint32_t ChunkEnd)
 		{
-			Start = Min.Y;
-			Stop = Max.Y;
-		}
-		else 
+			BoundChunk(ChunkStart, ChunkEnd, Boxes[Chunk], CentroidBoxes[Chunk]);
+		});
+
+	for (int32_t Chunk = 0; Chunk < BVH_BINNING_CHUNKS; Chunk++)
+	{
+		OutBox.Expand(Boxes[Chunk]);
+		OutCentroidBox.Expand(CentroidBoxes[Chunk]);
+	}
+}
+
+/* Sort Indices[Start, End) into the bins of every splittable axis */
+inline void BinPrimitives(const BVHBuildState& State, const uint32_t Start, const uint32_t End, const BVHBinMapping (&Mappings)[3], const bool bParallel, BVHBinGrid& OutGrid)
+{
+	auto BinChunk = [&State, &Mappings](const uint32_t ChunkStart, const uint32_t ChunkEnd, BVHBinGrid& Grid)
+	{
+		for (uint8_t Axis = 0; Axis < 3; Axis++)
 		{
-			Start = Min.Z;
-			Stop = Max.Z;
-		}
+			if (!Mappings[Axis].IsValid()) continue;
 
-		// In that axis, do the bounding boxes in the work queue "span" across?
-		// Or are they all already "packed" on the axis's plane?
-		if (std::abs(Stop - Start) < 1e-4)
-			// No, we must move to a different axis!
-			continue;
+			for (uint32_t i = ChunkStart; i < ChunkEnd; i++)
+			{
+				const BVHBuildPrimitive& Primitive = State.Primitives[State.Indices[i]];
+				BVHBin& Bin = Grid.Bins[Axis][Mappings[Axis].GetBin(Primitive.Centroid)];
+				Bin.Box.Expand(Primitive.Box);
+				Bin.Count++;
+			}
+		}
+	};
 
-		// Try splitting at a uniform sampling that gets smaller the deeper we go:
-		// size of "sampling grid": 1024 (depth 0), 512 (depth 1), etc
-		Step = (Stop - Start) / (1024.0 / (Depth + 1.0));
+	if (!bParallel)
+	{
+		BinChunk(Start, End, OutGrid);
+		return;
+	}
 
-		for (double TestSplit = Start + Step; TestSplit < Stop - Step; TestSplit += Step)
+	std::vector<BVHBinGrid> Grids(BVH_BINNING_CHUNKS);
+	ParallelForChunks(Start, End, [&](const int32_t Chunk, const uint32_t ChunkStart, const uint32_t ChunkEnd)
 		{
-			// The left and right bounding box
-			Vector3 LeftMin(DBL_MAX, DBL_MAX, FLT_MAX), LeftMax(-DBL_MAX, -DBL_MAX, -DBL_MAX);
-			Vector3 RightMin(DBL_MAX, DBL_MAX, FLT_MAX), RightMax(-DBL_MAX, -DBL_MAX, -DBL_MAX);
+			BinChunk(ChunkStart, ChunkEnd, Grids[Chunk]);
+		});
 
-			// The number of primitives in the left and right bboxes
-			uint32_t CountLeft = 0, CountRight = 0;
+	for (const BVHBinGrid& Grid : Grids)
+	{
+		OutGrid.Merge(Grid);
+	}
+}
 
-			// For each test split, allocate primitives based on their bounding boxes centers
-			for (auto& Box : BoxList) 
-			{
-				double Value;
-				if (Axis == 0) Value = Box.Box.GetPosition().X;
-				else if (Axis == 1) Value = Box.Box.GetPosition().Y;
-				else Value = Box.Box.GetPosition().Z;
+/* 
+ * Find the cheapest split of Indices[Start, End) with the Surface Area Heuristic.
+ * Centroids are sorted into bins and every bin boundary is evaluated with a prefix/suffix sweep.
+ */
+inline BVHSplit FindBestSplit(const BVHBuildState& State, const uint32_t Start, const uint32_t End, 
+	const BVHBinMapping (&Mappings)[3], const double LeafCost, const bool bParallel)
+{
+	BVHSplit Best;
+	Best.Cost = LeafCost;
 
-				if (Value < TestSplit) 
-				{
-					AssignVector(LeftMin, Box.Box.Min, std::less<double>());
-					AssignVector(LeftMax, Box.Box.Max, std::greater<double>());
-					CountLeft++;
-				}
-				else 
-				{
-					AssignVector(RightMin, Box.Box.Min, std::less<double>());
-					AssignVector(RightMax, Box.Box.Max, std::greater<double>());
-					CountRight++;
-				}
-			}
+	// Only a few KB, so it lives on the stack like the SBVH bins instead of being allocated for every node
+	BVHBinGrid Grid;
+	BinPrimitives(State, Start, End, Mappings, bParallel, Grid);
+
+	for (uint8_t Axis = 0; Axis < 3; Axis++)
+	{
+		if (!Mappings[Axis].IsValid()) continue;
+
+		const BVHBin* Bins = Grid.Bins[Axis];
+
+		// Sweep from the right to get the cost of every right side
+		double RightCost[BVH_SAH_BINS];
+		uint32_t RightCount[BVH_SAH_BINS];
+		AABB RightBox = AABB::Empty();
+		uint32_t Count = 0;
+		for (uint32_t i = BVH_SAH_BINS - 1; i > 0; i--)
+		{
+			if (Bins[i].Count > 0) RightBox.Expand(Bins[i].Box);
+			Count += Bins[i].Count;
+			RightCount[i] = Count;
+			RightCost[i] = Count > 0 ? RightBox.Area() * Count : 0.0;
+		}
 
-			// Now use the Surface Area Heuristic to see if this split has a better "cost"
-			//
-			// First, check for stupid partitionings
-			if (CountLeft <= 1 || CountRight <= 1) continue;
+		// Sweep from the left and combine both sides for the split after bin i
+		AABB LeftBox = AABB::Empty();
+		Count = 0;
+		for (uint32_t i = 0; i < BVH_SAH_BINS - 1; i++)
+		{
+			if (Bins[i].Count > 0) LeftBox.Expand(Bins[i].Box);
+			Count += Bins[i].Count;
 
-			// It's a real partitioning, calculate the surface areas
-			double TotalCost = AABB(LeftMin, LeftMax).Area() * CountLeft + AABB(RightMin, RightMax).Area() * CountRight;
+			// Skip stupid partitionings
+			if (Count <= 1 || RightCount[i + 1] <= 1) continue;
 
-			if (TotalCost < MinCost) 
+			const double TotalCost = LeftBox.Area() * Count + RightCost[i + 1];
+			if (TotalCost < Best.Cost)
 			{
-				MinCost = TotalCost;
-				BestSplit = TestSplit;
-				BestAxis = Axis;
+				Best.Cost = TotalCost;
+				Best.Axis = Axis;
+				Best.Bin = i;
 			}
 		}
 	}
 
+	return Best;
+}
+
+/* 
+ * Build the subtree for Indices[Start, End) into the node at NodeIndex, indices are partitioned in place.
+ * With OutTasks set this builds the top levels only and defers every range smaller than BVH_TASK_PRIMITIVES.
+ */
+inline void BuildBVHRecursive(BVHBuildState& State, const uint32_t Start, const uint32_t End, const uint32_t NodeIndex, std::vector<BVHBuildTask>* OutTasks)
+{
+	const uint32_t Count = End - Start;
+
+	if (OutTasks && Count < BVH_TASK_PRIMITIVES)
+	{
+		OutTasks->push_back({ Start, End, NodeIndex });
+		return;
+	}
+
+	const bool bParallel = OutTasks && Count >= BVH_PARALLEL_BINNING_PRIMITIVES;
+
+	AABB Box, CentroidBox;
+	GetRangeBounds(State, Start, End, bParallel, Box, CentroidBox);
+	State.Nodes[NodeIndex].Box = Box;
+
+	const BVHBinMapping Mappings[3] = { { CentroidBox, 0 }, { CentroidBox, 1 }, { CentroidBox, 2 } };
+
+	// The current box has a cost of (No of primitives)*surfaceArea
+	BVHSplit Split;
+	if (Count >= BVH_MIN_SPLIT_PRIMITIVES)
+	{
+		Split = FindBestSplit(State, Start, End, Mappings, Count * Box.Area(), bParallel);
+	}
+
 	// We found no split to improve the cost, create a BVH leaf
-	if (BestAxis == -1) {
-		auto Leaf = MakeUnique<BVHLeaf>();
-		for (auto& Box : BoxList)
-			Leaf->Objects.push_back(Box.Primitive);
-		return Leaf;
+	if (Split.Axis == -1)
+	{
+		State.Nodes[NodeIndex].Offset = Start;
+		State.Nodes[NodeIndex].PrimitiveCount = Count;
+		return;
 	}
 
-	// Create a BVH inner node, split with the optimal value we found above
-	std::vector<BoxPrimitive> LeftBoxes, RightBoxes;
-	Vector3 LeftMin(DBL_MAX, DBL_MAX, DBL_MAX), LeftMax(-DBL_MAX, -DBL_MAX, -DBL_MAX);
-	Vector3 RightMin(DBL_MAX, DBL_MAX, DBL_MAX), RightMax(-DBL_MAX, -DBL_MAX, -DBL_MAX);
+	const BVHBinMapping& Mapping = Mappings[Split.Axis];
+	const auto MiddleIt = std::partition(State.Indices.begin() + Start, State.Indices.begin() + End,
+		[&](const uint32_t Index) 
+		{ 
+			return Mapping.GetBin(State.Primitives[Index].Centroid) <= Split.Bin; 
+		});
+	const uint32_t Middle = static_cast<uint32_t>(MiddleIt - State.Indices.begin());
 
-	for (auto& Box: BoxList) 
-	{		
-		double Value;
-		if (BestAxis == 0) Value = Box.Box.GetPosition().X;
-		else if (BestAxis == 1) Value = Box.Box.GetPosition().Y;
-		else Value = Box.Box.GetPosition().Z;
+	const uint32_t ChildIndex = State.NodeCount.fetch_add(2);
+	State.Nodes[NodeIndex].Offset = ChildIndex;
 
-		if (Value < BestSplit) 
-		{
-			LeftBoxes.push_back(Box);
-			AssignVector(LeftMin, Box.Box.Min, std::less<double>());
-			AssignVector(LeftMax, Box.Box.Max, std::greater<double>());
-		}
-		else 
+	BuildBVHRecursive(State, Start, Middle, ChildIndex, OutTasks);
+	BuildBVHRecursive(State, Middle, End, ChildIndex + 1, OutTasks);
+}
+
+/* Copy the subtree at SourceIndex to OutNodes[DestIndex], laying out sibling pairs in depth-first order */
+inline void CopyDepthFirst(const std::vector<LinearBVHNode>& Nodes, const uint32_t SourceIndex, const uint32_t DestIndex, std::vector<LinearBVHNode>& OutNodes)
+{
+	OutNodes[DestIndex] = Nodes[SourceIndex];
+	if (Nodes[SourceIndex].IsLeaf()) return;
+
+	const uint32_t ChildIndex = static_cast<uint32_t>(OutNodes.size());
+	OutNodes[DestIndex].Offset = ChildIndex;
+	OutNodes.resize(OutNodes.size() + 2);
+
+	CopyDepthFirst(Nodes, Nodes[SourceIndex].Offset, ChildIndex, OutNodes);
+	CopyDepthFirst(Nodes, Nodes[SourceIndex].Offset + 1, ChildIndex + 1, OutNodes);
+}
+
+/* 
+ * Merge sibling leaves whose primitive ranges are adjacent into their parent while the merged leaf has at most
+ * MaxPrimitives, bottom up so merged leaves can merge again. Used when leaves are tested a fixed number of primitives
+ * at a time and smaller leaves would waste part of the test. The removed nodes are compacted away depth-first.
+ */
+inline void CollapseBVHLeaves(LinearBVH& BVH, const uint32_t MaxPrimitives)
+{
+	if (BVH.Nodes.empty()) return;
+
+	uint32_t Collapsed = 0;
+	for (size_t i = BVH.Nodes.size(); i-- > 0;)
+	{
+		LinearBVHNode& Node = BVH.Nodes[i];
+		if (Node.IsLeaf()) continue;
+
+		const LinearBVHNode& Left = BVH.Nodes[Node.Offset];
+		const LinearBVHNode& Right = BVH.Nodes[Node.Offset + 1];
+		if (!Left.IsLeaf() || !Right.IsLeaf()) continue;
+		if (Left.Offset + Left.PrimitiveCount != Right.Offset || Left.PrimitiveCount + Right.PrimitiveCount > MaxPrimitives) continue;
+
+		Node.PrimitiveCount = Left.PrimitiveCount + Right.PrimitiveCount;
+		Node.Offset = Left.Offset;
+		Collapsed++;
+	}
+
+	if (Collapsed == 0) return;
+
+	std::vector<LinearBVHNode> Nodes;
+	Nodes.reserve(BVH.Nodes.size() - 2 * Collapsed);
+	Nodes.resize(1);
+	CopyDepthFirst(BVH.Nodes, 0, 0, Nodes);
+	BVH.Nodes = std::move(Nodes);
+}
+
+/* Children always follow their parent in a depth-first array, so one reverse pass computes all inner bounds */
+inline void ComputeInnerBounds(std::vector<LinearBVHNode>& Nodes)
+{
+	for (size_t i = Nodes.size(); i-- > 0;)
+	{
+		if (Nodes[i].IsLeaf()) continue;
+
+		Nodes[i].Box = Nodes[Nodes[i].Offset].Box;
+		Nodes[i].Box.Expand(Nodes[Nodes[i].Offset + 1].Box);
+	}
+}
+
+/* 
+ * Surface Area Heuristic cost of the tree relative to its root, inner nodes cost one traversal step
+ * and leaves one intersection test per primitive.
+ */
+inline double ComputeSAHCost(const LinearBVH& BVH)
+{
+	if (BVH.Nodes.empty() || BVH.Nodes[0].Box.Area() <= 0.0) return 0.0;
+
+	// Summed per chunk and then in chunk order, so the cost does not depend on the thread count
+	double ChunkCosts[BVH_BINNING_CHUNKS] = {};
+	ParallelForChunks(0, static_cast<uint32_t>(BVH.Nodes.size()), [&](const int32_t Chunk, const uint32_t ChunkStart, const uint32_t ChunkEnd)
+	{
+		for (uint32_t i = ChunkStart; i < ChunkEnd; i++)
 		{
-			RightBoxes.push_back(Box);
-			AssignVector(RightMin, Box.Box.Min, std::less<double>());
-			AssignVector(RightMax, Box.Box.Max, std::greater<double>());
+			const LinearBVHNode& Node = BVH.Nodes[i];
+			ChunkCosts[Chunk] += Node.Box.Area() * (Node.IsLeaf() ? Node.PrimitiveCount : 1.0);
 		}
-	}
+	});
 
-	auto Inner = MakeUnique<BVHNode>();
-	Inner->Left = Recurse(LeftBoxes, Depth + 1);
-	Inner->Left->Box = AABB(LeftMin, LeftMax);
-	Inner->Right = Recurse(RightBoxes, Depth + 1);
-	Inner->Right->Box = AABB(RightMin, RightMax);
+	double Cost = 0.0;
+	for (const double ChunkCost : ChunkCosts) Cost += ChunkCost;
 
-	return Inner;
+	return Cost / BVH.Nodes[0].Box.Area();
 }
 
-inline UniquePtr<BVHNodeBase> CreateBVH(const RScene* Scene)
+/* Cache bounds and centroids of the primitives and fill Indices with the identity order */
+inline void GatherBuildPrimitives(const std::vector<SharedPtr<RPrimitive>>& Primitives, std::vector<BVHBuildPrimitive>& OutBuildPrimitives, std::vector<uint32_t>& OutIndices)
 {
-	std::vector<BoxPrimitive> BoxPrimitiveList;
+	const int32_t PrimitiveCount = static_cast<int32_t>(Primitives.size());
+	OutBuildPrimitives.resize(PrimitiveCount);
+	OutIndices.resize(PrimitiveCount);
 
-	Vector3 Max(-DBL_MAX, -DBL_MAX, -DBL_MAX);
-	Vector3 Min( DBL_MAX,  DBL_MAX,  DBL_MAX);
+	#pragma omp parallel for
+	for (int32_t i = 0; i < PrimitiveCount; i++)
+	{
+		OutBuildPrimitives[i].Box = Primitives[i]->GetBoundingBox();
+		OutBuildPrimitives[i].Centroid = OutBuildPrimitives[i].Box.GetPosition();
+		OutIndices[i] = i;
+	}
+}
 
-	for (auto Primitive : Scene->GetPrimitives()) 
+/* Move the built nodes into the final BVH in depth-first order and store primitives in leaf order */
+inline void FinishBVH(const BVHBuildState& State, const std::vector<SharedPtr<RPrimitive>>& Primitives, LinearBVH& OutBVH)
+{
+	OutBVH.Nodes.reserve(State.NodeCount);
+	OutBVH.Nodes.resize(1);
+	CopyDepthFirst(State.Nodes, 0, 0, OutBVH.Nodes);
+
+	/* Store primitives in leaf order so that every leaf references a contiguous range */
+	OutBVH.Primitives.reserve(Primitives.size());
+	for (const uint32_t Index : State.Indices)
 	{
-		AABB Box = Primitive->GetBoundingBox();
+		OutBVH.Primitives.push_back(Primitives[Index]);
+	}
+	OutBVH.PrimitiveIndices = State.Indices;
+}
+
+/* 
+ * Build the BVH over a list of primitives, either the whole scene or the triangles of one mesh.
+ * The top levels are split on the calling thread with parallel binning, then the remaining subtrees are built
+ * on all threads. Since subtrees claim node slots in whatever order the threads reach them, the result is 
+ * reordered depth-first at the end, so the tree is the same for any number of threads.
+ */
+inline UniquePtr<LinearBVH> CreateBVH(const std::vector<SharedPtr<RPrimitive>>& Primitives)
+{
+	auto BVH = MakeUnique<LinearBVH>();
+
+	if (Primitives.empty()) return BVH;
+
+	const uint32_t PrimitiveCount = static_cast<uint32_t>(Primitives.size());
+	std::vector<BVHBuildPrimitive> BuildPrimitives;
+	std::vector<uint32_t> Indices;
+	GatherBuildPrimitives(Primitives, BuildPrimitives, Indices);
+
+	// A binary tree with at least one primitive per leaf never has more nodes than this
+	std::vector<LinearBVHNode> Nodes(2 * PrimitiveCount - 1);
+	BVHBuildState State(BuildPrimitives, Indices, Nodes);
 
-		AssignVector(Min, Box.Min, std::less<double>());
-		AssignVector(Max, Box.Max, std::greater<double>());
+	std::vector<BVHBuildTask> Tasks;
+	BuildBVHRecursive(State, 0, PrimitiveCount, 0, &Tasks);
 
-		BoxPrimitive B(Box, Primitive);
-		BoxPrimitiveList.push_back(B);
+	// Start with the largest subtrees to balance the load
+	std::sort(Tasks.begin(), Tasks.end(), [](const BVHBuildTask& A, const BVHBuildTask& B) { return A.End - A.Start > B.End - B.Start; });
+
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (int32_t i = 0; i < static_cast<int32_t>(Tasks.size()); i++)
+	{
+		BuildBVHRecursive(State, Tasks[i].Start, Tasks[i].End, Tasks[i].NodeIndex, nullptr);
 	}
 
-	auto Root = Recurse(BoxPrimitiveList);
-	Root->Box.Max = Max;
-	Root->Box.Min = Min;
+	FinishBVH(State, Primitives, *BVH);
+	BVH->BuildCost = ComputeSAHCost(*BVH);
 
-	return Root;
+	return BVH;
 }
 
-inline bool BVHTraverse(const UniquePtr<BVHNodeBase>& Node, const RRay& Ray, RHit& OutHit)
+/* Node waiting on the traversal stack together with the distance at which the ray enters its box */
+struct BVHStackEntry
+{
+	uint32_t NodeIndex;
+	double Distance;
+};
+
+/* 
+ * Closest hit traversal of the subtree under Root. Children are visited nearest first, TMax of the traversed ray shrinks
+ * to the closest hit found so far, so farther nodes fail the slab test and are skipped with their whole subtree.
+ * PrimitiveList tests the leaves, a leaf being the range [First, First + Count) of its references, see ScenePrimitiveList.
+ */
+template<typename PrimitiveList>
+inline bool BVHTraverse(const LinearBVH& BVH, const PrimitiveList& Primitives, const RRay& Ray, RPrimitiveHit& OutHit, const uint32_t Root = 0)
 {
-	std::stack<const UniquePtr<BVHNodeBase>*> Stack;
+	if (BVH.Nodes.empty()) return false;
 
-	Stack.push(&Node);
+	BVHTraversalStack<BVHStackEntry> Stack;
+	BVHTraversalScope Stats;
+
+	RRay ClippedRay = Ray;
+	double RootDistance;
+	if (!BVH.Nodes[Root].Box.Intersects(ClippedRay, RootDistance)) return false;
+	Stack.Push({ Root, RootDistance });
 
-	double MinDist = INFINITY;
 	bool bHit = false;
 
-	while (!Stack.empty())
+	while (!Stack.IsEmpty())
 	{
-		auto Current = std::move(Stack.top());
-		Stack.pop();
+		const BVHStackEntry Entry = Stack.Pop();
+
+		// A closer hit was found since this node was pushed
+		if (Entry.Distance > ClippedRay.TMax) continue;
+
+		const LinearBVHNode& Current = BVH.Nodes[Entry.NodeIndex];
+		Stats.NodeVisits++;
 
-		if (!Current->get()->IsLeaf())
+		if (!Current.IsLeaf())
 		{
-			const auto NodeInner = dynamic_cast<const BVHNode*>(Current->get());
-			if (NodeInner->Box.Intersects(Ray))
+			double LeftDistance, RightDistance;
+			const bool bHitLeft = BVH.Nodes[Current.Offset].Box.Intersects(ClippedRay, LeftDistance);
+			const bool bHitRight = BVH.Nodes[Current.Offset + 1].Box.Intersects(ClippedRay, RightDistance);
+
+			if (bHitLeft && bHitRight)
+			{
+				// Push the farther child first so the nearer one is processed next
+				if (LeftDistance <= RightDistance)
+				{
+					Stack.Push({ Current.Offset + 1, RightDistance });
+					Stack.Push({ Current.Offset, LeftDistance });
+				}
+				else
+				{
+					Stack.Push({ Current.Offset, LeftDistance });
+					Stack.Push({ Current.Offset + 1, RightDistance });
+				}
+			}
+			else if (bHitLeft)
+			{
+				Stack.Push({ Current.Offset, LeftDistance });
+			}
+			else if (bHitRight)
 			{
-				Stack.push(&NodeInner->Left);
-				Stack.push(&NodeInner->Right);
+				Stack.Push({ Current.Offset + 1, RightDistance });
 			}
 		}
 		else
 		{
-			const auto Leaf = dynamic_cast<const BVHLeaf*>(Current->get());
-
-			for (auto& Primitive : Leaf->Objects)
-			{			
-				RHit TempHit;
-				if (Primitive->Intersects(Ray, TempHit) && TempHit.Depth < MinDist)
-				{
-					OutHit = TempHit;
-					bHit = true;
-					MinDist = TempHit.Depth;					
-				}
-			}
+			Stats.PrimitiveTests += Current.PrimitiveCount;
+			if (Primitives.IntersectsLeaf(Current.Offset, Current.PrimitiveCount, ClippedRay, OutHit)) bHit = true;
 		}
 	}
 
@@ -273,22 +580,92 @@ inline bool BVHTraverse(const UniquePtr<BVHNodeBase>& Node, const RRay& Ray, RHi
 }
 
 
-inline uint32_t CountPrimitives(const UniquePtr<BVHNodeBase>& Node)
+/* 
+ * Any hit traversal for shadow rays. Returns true as soon as a primitive is hit closer than MaxDistance,
+ * no hit record is built.
+ */
+template<typename PrimitiveList>
+inline bool BVHOccluded(const LinearBVH& BVH, const PrimitiveList& Primitives, const RRay& Ray, const double MaxDistance)
 {
-	if (Node->IsLeaf()) return dynamic_cast<const BVHLeaf*>(Node.get())->Objects.size();
-	else
+	if (BVH.Nodes.empty()) return false;
+
+	BVHTraversalStack<uint32_t> Stack;
+	BVHTraversalScope Stats;
+
+	RRay ClippedRay = Ray;
+	ClippedRay.TMax = std::min(Ray.TMax, MaxDistance);
+
+	Stack.Push(0);
+
+	while (!Stack.IsEmpty())
 	{
-		auto NodeInner = dynamic_cast<const BVHNode*>(Node.get());
-		return CountPrimitives(NodeInner->Left) + CountPrimitives(NodeInner->Right);
+		const LinearBVHNode& Current = BVH.Nodes[Stack.Pop()];
+
+		double Distance;
+		if (!Current.Box.Intersects(ClippedRay, Distance) || Distance >= ClippedRay.TMax) continue;
+		Stats.NodeVisits++;
+
+		if (!Current.IsLeaf())
+		{
+			Stack.Push(Current.Offset + 1);
+			Stack.Push(Current.Offset);
+		}
+		else
+		{
+			Stats.PrimitiveTests += Current.PrimitiveCount;
+			if (Primitives.OccludesLeaf(Current.Offset, Current.PrimitiveCount, ClippedRay, ClippedRay.TMax)) return true;
+		}
 	}
+
+	return false;
 }
 
-inline uint32_t CountLeaves(const UniquePtr<BVHNodeBase>& Node)
+/* Primitive references of all leaves, primitives referenced by several leaves count once for each */
+inline uint32_t CountPrimitives(const LinearBVH& BVH)
+{
+	uint32_t Count = 0;
+	for (const LinearBVHNode& Node : BVH.Nodes)
+	{
+		if (Node.IsLeaf()) Count += Node.PrimitiveCount;
+	}
+	return Count;
+}
+
+inline uint32_t CountLeaves(const LinearBVH& BVH)
+{
+	return static_cast<uint32_t>(std::count_if(BVH.Nodes.begin(), BVH.Nodes.end(), 
+		[](const LinearBVHNode& Node) { return Node.IsLeaf(); }));
+}
+/* 
+ * Update the bounds of a BVH whose primitives moved, keeping its topology.
+ * Leaves are recomputed on all threads, inner nodes are only touched if some leaf changed.
+ * Returns the number of changed leaves.
+ */
+inline uint32_t RefitBVH(LinearBVH& BVH)
 {
-	if (Node->IsLeaf()) return 1;
-	else
+	const int32_t NodeCount = static_cast<int32_t>(BVH.Nodes.size());
+	int32_t ChangedLeaves = 0;
+
+	#pragma omp parallel for reduction(+ : ChangedLeaves)
+	for (int32_t i = 0; i < NodeCount; i++)
 	{
-		auto NodeInner = dynamic_cast<const BVHNode*>(Node.get());
-		return CountLeaves(NodeInner->Left) + CountLeaves(NodeInner->Right);
+		LinearBVHNode& Node = BVH.Nodes[i];
+		if (!Node.IsLeaf()) continue;
+
+		AABB Box = AABB::Empty();
+		for (uint32_t j = Node.Offset; j < Node.Offset + Node.PrimitiveCount; j++)
+		{
+			Box.Expand(BVH.Primitives[j]->GetBoundingBox());
+		}
+
+		if (Box.Min != Node.Box.Min || Box.Max != Node.Box.Max)
+		{
+			Node.Box = Box;
+			ChangedLeaves++;
+		}
 	}
-}
\ No newline at end of file
+
+	if (ChangedLeaves > 0) ComputeInnerBounds(BVH.Nodes);
+
+	return static_cast<uint32_t>(ChangedLeaves);
+}
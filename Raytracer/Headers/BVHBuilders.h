@@ -0,0 +1,21 @@
+#pragma once
+
+#include <vector>
+
+#include "Core.h"
+#include "BVH.h"
+#include "LBVH.h"
+#include "SBVH.h"
+#include "Scene.h"
+
+/* Build a BVH over the primitives with the selected algorithm */
+inline UniquePtr<LinearBVH> CreateBVH(const std::vector<SharedPtr<RPrimitive>>& Primitives, const BVHBuilder Builder)
+{
+	switch (Builder)
+	{
+	case BVHBuilder::Morton: return CreateLBVH(Primitives, false);
+	case BVHBuilder::MortonTreelet: return CreateLBVH(Primitives, true);
+	case BVHBuilder::SpatialSAH: return CreateSBVH(Primitives);
+	default: return CreateBVH(Primitives);
+	}
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Core.h"
+
+
+struct LinearBVH;
+enum class BVHBuilder : uint8_t;
+
+
+/* Read-only memory mapping of a whole file, Data is null if the file couldn't be mapped */
+class RMappedFile
+{
+	const void* MappedData = nullptr;
+	size_t MappedSize = 0;
+
+public:
+	RMappedFile(const std::string& Path);
+	~RMappedFile();
+
+	RMappedFile(const RMappedFile&) = delete;
+	RMappedFile& operator=(const RMappedFile&) = delete;
+
+	const uint8_t* Data() const { return static_cast<const uint8_t*>(MappedData); }
+	size_t Size() const { return MappedSize; }
+};
+
+/*
+ * Binary cache of built BVHs, so meshes that were loaded before skip the build.
+ * A cache file stores the nodes and the primitive order and is identified by a key over the geometry and the build settings.
+ */
+namespace BVHCache
+{
+	/* FNV-1a offset basis, starting value for HashBytes */
+	constexpr uint64_t HASH_SEED = 14695981039346656037ull;
+
+	/* 64 bit FNV-1a, continues from Hash */
+	uint64_t HashBytes(uint64_t Hash, const void* Data, const size_t Size);
+
+	/* Key of a BVH built with Builder over geometry with GeometryHash, changes with any setting affecting the result */
+	uint64_t MakeKey(const uint64_t GeometryHash, const BVHBuilder Builder);
+
+	std::string GetPath(const std::string& Directory, const uint64_t Key);
+
+	/* The cache stores the nodes and LinearBVH::PrimitiveIndices, the leaf order as indices into the list the BVH was built from */
+	bool Save(const std::string& Path, const uint64_t Key, const LinearBVH& BVH);
+
+	/* 
+	 * Returns null if the file is missing, has another key or doesn't fit a list of PrimitiveCount primitives.
+	 * Only PrimitiveIndices is filled, LinearBVH::Primitives stays empty.
+	 */
+	UniquePtr<LinearBVH> Load(const std::string& Path, const uint64_t Key, const uint32_t PrimitiveCount);
+};
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <vector>
+#include <queue>
+#include <algorithm>
+
+#include "Core.h"
+#include "BVH.h"
+#include "Scene.h"
+
+/*
+ * Node orders keep the guarantees of the depth-first layout: siblings stay adjacent and children follow their parent.
+ * They are computed over "units", the root node alone or a sibling pair, named by the index of their first node.
+ */
+
+/* Bytes of one treelet, nodes of a treelet are visited together so it should match a page or a few cache lines */
+constexpr uint32_t BVH_TREELET_BYTES = 4096;
+
+/* Nodes of a unit, 1 for the root and 2 for sibling pairs */
+inline uint32_t GetBVHUnitSize(const uint32_t Unit)
+{
+	return Unit == 0 ? 1 : 2;
+}
+
+/* Units holding the children of the nodes in Unit */
+template<typename Func>
+inline void ForEachBVHChildUnit(const LinearBVH& BVH, const uint32_t Unit, Func Callback)
+{
+	for (uint32_t i = Unit; i < Unit + GetBVHUnitSize(Unit); i++)
+	{
+		if (!BVH.Nodes[i].IsLeaf()) Callback(BVH.Nodes[i].Offset);
+	}
+}
+
+inline void OrderDepthFirst(const LinearBVH& BVH, const uint32_t Unit, std::vector<uint32_t>& OutOrder)
+{
+	OutOrder.push_back(Unit);
+	ForEachBVHChildUnit(BVH, Unit, [&](const uint32_t Child) { OrderDepthFirst(BVH, Child, OutOrder); });
+}
+
+/*
+ * Units are packed into treelets of BVH_TREELET_BYTES, each grown from its root by always taking the unit with
+ * the largest surface area, which is the one rays are most likely to enter. Units left over on the border of
+ * a treelet start new treelets, which are emitted depth-first so neighbouring subtrees stay close.
+ */
+inline void OrderTreelets(const LinearBVH& BVH, std::vector<uint32_t>& OutOrder)
+{
+	const uint32_t TreeletUnits = std::max(BVH_TREELET_BYTES / static_cast<uint32_t>(2 * sizeof(LinearBVHNode)), 1u);
+
+	auto GetArea = [&BVH](const uint32_t Unit)
+	{
+		double Area = 0.0;
+		for (uint32_t i = Unit; i < Unit + GetBVHUnitSize(Unit); i++) Area += BVH.Nodes[i].Box.Area();
+		return Area;
+	};
+
+	using AreaUnit = std::pair<double, uint32_t>;
+	std::vector<uint32_t> TreeletRoots = { 0 };
+	while (!TreeletRoots.empty())
+	{
+		const uint32_t Root = TreeletRoots.back();
+		TreeletRoots.pop_back();
+
+		std::priority_queue<AreaUnit> Border;
+		Border.push({ GetArea(Root), Root });
+		for (uint32_t Count = 0; Count < TreeletUnits && !Border.empty(); Count++)
+		{
+			const uint32_t Unit = Border.top().second;
+			Border.pop();
+			OutOrder.push_back(Unit);
+			ForEachBVHChildUnit(BVH, Unit, [&](const uint32_t Child) { Border.push({ GetArea(Child), Child }); });
+		}
+
+		// Push the border in reverse so the largest one is laid out right after this treelet
+		std::vector<AreaUnit> Remaining;
+		for (; !Border.empty(); Border.pop()) Remaining.push_back(Border.top());
+		for (auto It = Remaining.rbegin(); It != Remaining.rend(); ++It) TreeletRoots.push_back(It->second);
+	}
+}
+
+/*
+ * van Emde Boas layout of the Levels top levels below Unit: the upper half of the levels is laid out first,
+ * then every subtree hanging below it. Units one level below the laid out part are appended to OutBorder.
+ */
+inline void OrderVanEmdeBoas(const LinearBVH& BVH, const uint32_t Unit, const uint32_t Levels, std::vector<uint32_t>& OutOrder, std::vector<uint32_t>& OutBorder)
+{
+	if (Levels == 1)
+	{
+		OutOrder.push_back(Unit);
+		ForEachBVHChildUnit(BVH, Unit, [&](const uint32_t Child) { OutBorder.push_back(Child); });
+		return;
+	}
+
+	const uint32_t TopLevels = Levels / 2;
+	std::vector<uint32_t> BottomRoots;
+	OrderVanEmdeBoas(BVH, Unit, TopLevels, OutOrder, BottomRoots);
+	for (const uint32_t BottomRoot : BottomRoots)
+	{
+		OrderVanEmdeBoas(BVH, BottomRoot, Levels - TopLevels, OutOrder, OutBorder);
+	}
+}
+
+/* Number of unit levels in the subtree of every unit, indexed by the unit's first node */
+inline std::vector<uint32_t> ComputeBVHUnitHeights(const LinearBVH& BVH)
+{
+	std::vector<uint32_t> Units;
+	OrderDepthFirst(BVH, 0, Units);
+
+	// Children come after their parent in depth-first order, so walking it backwards sees them first
+	std::vector<uint32_t> Heights(BVH.Nodes.size(), 1);
+	for (auto It = Units.rbegin(); It != Units.rend(); ++It)
+	{
+		ForEachBVHChildUnit(BVH, *It, [&](const uint32_t Child) { Heights[*It] = std::max(Heights[*It], Heights[Child] + 1); });
+	}
+	return Heights;
+}
+
+/* Lay out the nodes of BVH in Order, leaves keep their primitive ranges */
+inline void ReorderBVHNodes(LinearBVH& BVH, const BVHNodeOrder Order)
+{
+	if (BVH.Nodes.size() < 2) return;
+
+	std::vector<uint32_t> Units;
+	Units.reserve(BVH.Nodes.size() / 2 + 1);
+	switch (Order)
+	{
+	case BVHNodeOrder::VanEmdeBoas:
+	{
+		std::vector<uint32_t> Border;
+		OrderVanEmdeBoas(BVH, 0, ComputeBVHUnitHeights(BVH)[0], Units, Border);
+		break;
+	}
+	case BVHNodeOrder::Treelets:
+		OrderTreelets(BVH, Units);
+		break;
+	default:
+		OrderDepthFirst(BVH, 0, Units);
+		break;
+	}
+
+	std::vector<uint32_t> NewIndices(BVH.Nodes.size());
+	uint32_t NextIndex = 0;
+	for (const uint32_t Unit : Units)
+	{
+		for (uint32_t i = Unit; i < Unit + GetBVHUnitSize(Unit); i++) NewIndices[i] = NextIndex++;
+	}
+
+	std::vector<LinearBVHNode> Nodes(BVH.Nodes.size());
+	for (size_t i = 0; i < BVH.Nodes.size(); i++)
+	{
+		LinearBVHNode& Node = Nodes[NewIndices[i]];
+		Node = BVH.Nodes[i];
+		if (!Node.IsLeaf()) Node.Offset = NewIndices[Node.Offset];
+	}
+	BVH.Nodes = std::move(Nodes);
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Core.h"
+
+
+/* Set to 0 to leave the traversal counters out of the render */
+#define BVH_TRAVERSAL_STATS 1
+
+struct LinearBVH;
+
+
+/* Traversal work summed over all rays traced by one thread, padded so that threads never share a cache line */
+struct alignas(64) BVHTraversalCounters
+{
+	uint64_t Rays = 0;
+	uint64_t NodeVisits = 0;
+	uint64_t PrimitiveTests = 0;
+};
+
+/* Quality of a built BVH, gathered in one pass over its nodes */
+struct BVHStatistics
+{
+	double SAHCost = 0.0;
+
+	uint32_t NodeCount = 0;
+	uint32_t LeafCount = 0;
+	uint32_t PrimitiveReferences = 0;
+	uint32_t MaxDepth = 0;
+
+	/* Number of leaves at every depth, the root is at depth 0 */
+	std::vector<uint32_t> DepthHistogram;
+
+	/* Number of leaves holding a given number of primitives */
+	std::vector<uint32_t> LeafSizeHistogram;
+
+	size_t InnerNodeBytes = 0;
+	size_t LeafNodeBytes = 0;
+	size_t PrimitiveReferenceBytes = 0;
+
+	size_t TotalBytes() const { return InnerNodeBytes + LeafNodeBytes + PrimitiveReferenceBytes; }
+};
+
+/* Statistics of the scene BVH, of every mesh BVH it references and the traversal counters of the last render */
+struct BVHReport
+{
+	BVHStatistics Scene;
+
+	/* Mesh BVHs in the order their first instance was added, with the number of instances sharing each */
+	std::vector<BVHStatistics> Meshes;
+	std::vector<uint32_t> MeshInstances;
+
+	BVHTraversalCounters Traversal;
+};
+
+namespace BVHStats
+{
+	BVHStatistics Compute(const LinearBVH& BVH);
+
+	/* Counters of the calling thread, they are created on the first call and live until the program exits */
+	BVHTraversalCounters& GetThreadCounters();
+
+	/* Sum of the counters of all threads, only exact while no thread is tracing */
+	BVHTraversalCounters GetTotalCounters();
+	void ResetCounters();
+
+	void Print(const BVHReport& Report);
+	std::string ToJSON(const BVHReport& Report);
+	bool ExportJSON(const std::string& Path, const BVHReport& Report);
+};
+
+/*
+ * Counts the work of one traversal in locals and adds it to the thread counters when it goes out of scope,
+ * so the hot loop never touches thread local storage.
+ */
+struct BVHTraversalScope
+{
+	uint32_t NodeVisits = 0;
+	uint32_t PrimitiveTests = 0;
+
+	BVHTraversalScope() = default;
+	BVHTraversalScope(const BVHTraversalScope&) = delete;
+	BVHTraversalScope& operator=(const BVHTraversalScope&) = delete;
+
+	~BVHTraversalScope()
+	{
+#if BVH_TRAVERSAL_STATS
+		BVHTraversalCounters& Counters = BVHStats::GetThreadCounters();
+		Counters.NodeVisits += NodeVisits;
+		Counters.PrimitiveTests += PrimitiveTests;
+#endif
+	}
+};
@@ -11,23 +11,71 @@ template<class T>
 using SharedPtr = std::shared_ptr<T>;
 
 
+/*
+ * Ray with the data of the slab test precomputed. Direction is expected to be normalized and must only be
+ * changed with SetDirection, so the cached inverse stays valid.
+ * Hits are only accepted at depths in [TMin, TMax], traversals shrink TMax to the closest hit found so far.
+ */
 struct RRay
 {
-    RRay() {}
-    RRay(const Vector3 InOrigin, const Vector3 InDirection) : Origin(InOrigin), Direction(InDirection) {}
+    RRay() { SetDirection(Direction); }
+    RRay(const Vector3 InOrigin, const Vector3 InDirection, const double InTMin = 0.0, const double InTMax = INFINITY)
+        : Origin(InOrigin), TMin(InTMin), TMax(InTMax)
+    {
+        SetDirection(InDirection);
+    }
 
     Vector3 Origin = Vector3(0.0, 0.0, 0.0);
     Vector3 Direction = Vector3(0.0, 0.0, -1.0);
+
+    /* 1 / Direction per axis */
+    Vector3 InvDirection;
+
+    /* 1 for axes along which the ray goes negative, index of the slab the ray enters last */
+    uint8_t Sign[3];
+
+    double TMin = 0.0;
+    double TMax = INFINITY;
+
+    void SetDirection(const Vector3& InDirection)
+    {
+        Direction = InDirection;
+        InvDirection = Vector3(1.0 / Direction.X, 1.0 / Direction.Y, 1.0 / Direction.Z);
+        Sign[0] = InvDirection.X < 0.0;
+        Sign[1] = InvDirection.Y < 0.0;
+        Sign[2] = InvDirection.Z < 0.0;
+    }
+
+    bool InRange(const double Distance) const { return Distance >= TMin && Distance <= TMax; }
 };
 
 
+/* 
+ * Hit as traversals keep it while looking for the closest one. It holds only what the ray test computes anyway,
+ * RPrimitive::GetHit turns the final one into an RHit with the surface data.
+ */
+struct RPrimitiveHit
+{
+    const class RPrimitive* Object = nullptr;
+
+    /* Part of the object that was hit, the face for meshes, primitives with one surface tell its sides apart */
+    uint32_t Part = 0;
+
+    double Depth = INFINITY;
+
+    /* Barycentric coordinates of the hit on the second and third vertex of a face */
+    double U = 0.0;
+    double V = 0.0;
+};
+
+/* Surface at the closest hit, pointers are owned by the scene and stay valid while it is rendered */
 struct RHit
 {
     Vector3 Position;
     Vector3 Normal;
-    SharedPtr<const class RMaterial> Mat = nullptr;
+    const class RMaterial* Mat = nullptr;
     double Depth = INFINITY;
-    SharedPtr<const class RPrimitive> Object = nullptr;
+    const class RPrimitive* Object = nullptr;
 };
 
 
@@ -0,0 +1,367 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include "Core.h"
+#include "AABB.h"
+#include "BVH.h"
+
+/*
+ * Linear BVH builder. Primitives are sorted along a Morton curve through their centroids and the hierarchy
+ * is emitted by splitting the sorted range at the highest differing bit, so the build costs little more than the sort.
+ * Optionally the tree is improved afterwards by restructuring small treelets for the lowest SAH cost.
+ */
+
+/* Above this many primitives the codes use 21 bits per axis instead of 10, to keep duplicate codes rare */
+constexpr uint32_t BVH_MORTON_WIDE_CODE_PRIMITIVES = 1 << 20;
+
+/* Number of subtrees a treelet is formed from when it gets restructured */
+constexpr uint32_t BVH_TREELET_LEAVES = 7;
+
+/* Subtrees below this depth are refined independently on all threads */
+constexpr uint32_t BVH_TREELET_TASK_DEPTH = 6;
+
+/* Interleave the lowest 21 bits of Value with two zero bits between each of them */
+inline uint64_t SpreadMortonBits(uint64_t Value)
+{
+	Value &= 0x1fffff;
+	Value = (Value | Value << 32) & 0x1f00000000ffff;
+	Value = (Value | Value << 16) & 0x1f0000ff0000ff;
+	Value = (Value | Value << 8) & 0x100f00f00f00f00f;
+	Value = (Value | Value << 4) & 0x10c30c30c30c30c3;
+	Value = (Value | Value << 2) & 0x1249249249249249;
+	return Value;
+}
+
+/* Morton code of every primitive centroid quantized to BitsPerAxis bits inside the centroid bounds */
+inline void ComputeMortonCodes(const std::vector<BVHBuildPrimitive>& Primitives, const AABB& CentroidBox, const uint32_t BitsPerAxis, std::vector<uint64_t>& OutCodes)
+{
+	const int32_t PrimitiveCount = static_cast<int32_t>(Primitives.size());
+	const double CellCount = static_cast<double>(1ull << BitsPerAxis);
+	const double MaxCell = CellCount - 1.0;
+	const Vector3 Extent = CentroidBox.Max - CentroidBox.Min;
+	const Vector3 Scale(
+		Extent.X > 0.0 ? CellCount / Extent.X : 0.0,
+		Extent.Y > 0.0 ? CellCount / Extent.Y : 0.0,
+		Extent.Z > 0.0 ? CellCount / Extent.Z : 0.0);
+
+	OutCodes.resize(PrimitiveCount);
+
+	#pragma omp parallel for
+	for (int32_t i = 0; i < PrimitiveCount; i++)
+	{
+		const Vector3 Cell = (Primitives[i].Centroid - CentroidBox.Min) * Scale;
+		const uint64_t X = static_cast<uint64_t>(std::min(Cell.X, MaxCell));
+		const uint64_t Y = static_cast<uint64_t>(std::min(Cell.Y, MaxCell));
+		const uint64_t Z = static_cast<uint64_t>(std::min(Cell.Z, MaxCell));
+		OutCodes[i] = SpreadMortonBits(X) << 2 | SpreadMortonBits(Y) << 1 | SpreadMortonBits(Z);
+	}
+}
+
+/*
+ * Stable LSD radix sort of the codes by 8 bit digits, Indices are moved along with them.
+ * Every chunk counts and scatters its own part, chunks are laid out in order inside each digit.
+ */
+inline void SortMortonCodes(std::vector<uint64_t>& Codes, std::vector<uint32_t>& Indices, const uint32_t CodeBits)
+{
+	const uint32_t Count = static_cast<uint32_t>(Codes.size());
+	std::vector<uint64_t> SortedCodes(Count);
+	std::vector<uint32_t> SortedIndices(Count);
+	std::vector<uint32_t> Offsets(BVH_BINNING_CHUNKS * 256);
+
+	for (uint32_t Shift = 0; Shift < CodeBits; Shift += 8)
+	{
+		std::fill(Offsets.begin(), Offsets.end(), 0);
+		ParallelForChunks(0, Count, [&](const int32_t Chunk, const uint32_t ChunkStart, const uint32_t ChunkEnd)
+			{
+				uint32_t* Histogram = &Offsets[Chunk * 256];
+				for (uint32_t i = ChunkStart; i < ChunkEnd; i++)
+				{
+					Histogram[(Codes[i] >> Shift) & 0xff]++;
+				}
+			});
+
+		uint32_t Sum = 0;
+		for (uint32_t Digit = 0; Digit < 256; Digit++)
+		{
+			for (int32_t Chunk = 0; Chunk < BVH_BINNING_CHUNKS; Chunk++)
+			{
+				const uint32_t DigitCount = Offsets[Chunk * 256 + Digit];
+				Offsets[Chunk * 256 + Digit] = Sum;
+				Sum += DigitCount;
+			}
+		}
+
+		ParallelForChunks(0, Count, [&](const int32_t Chunk, const uint32_t ChunkStart, const uint32_t ChunkEnd)
+			{
+				uint32_t* ChunkOffsets = &Offsets[Chunk * 256];
+				for (uint32_t i = ChunkStart; i < ChunkEnd; i++)
+				{
+					const uint32_t Destination = ChunkOffsets[(Codes[i] >> Shift) & 0xff]++;
+					SortedCodes[Destination] = Codes[i];
+					SortedIndices[Destination] = Indices[i];
+				}
+			});
+
+		Codes.swap(SortedCodes);
+		Indices.swap(SortedIndices);
+	}
+}
+
+/*
+ * Emit the subtree for the sorted range [Start, End) into the node at NodeIndex.
+ * The range is split where the highest bit that differs inside it flips, or in the middle if all codes are equal.
+ * Only leaf bounds are computed here, inner bounds are filled in bottom-up once the whole tree exists.
+ */
+inline void BuildLBVHRecursive(BVHBuildState& State, const std::vector<uint64_t>& Codes, const uint32_t Start, const uint32_t End, const uint32_t NodeIndex, std::vector<BVHBuildTask>* OutTasks)
+{
+	const uint32_t Count = End - Start;
+
+	if (OutTasks && Count < BVH_TASK_PRIMITIVES)
+	{
+		OutTasks->push_back({ Start, End, NodeIndex });
+		return;
+	}
+
+	if (Count < BVH_MIN_SPLIT_PRIMITIVES)
+	{
+		LinearBVHNode& Leaf = State.Nodes[NodeIndex];
+		Leaf.Box = AABB::Empty();
+		for (uint32_t i = Start; i < End; i++)
+		{
+			Leaf.Box.Expand(State.Primitives[State.Indices[i]].Box);
+		}
+		Leaf.Offset = Start;
+		Leaf.PrimitiveCount = Count;
+		return;
+	}
+
+	uint32_t Middle = Start + Count / 2;
+	const uint64_t DifferentBits = Codes[Start] ^ Codes[End - 1];
+	if (DifferentBits != 0)
+	{
+		uint64_t HighestBit = 1ull << 63;
+		while (!(DifferentBits & HighestBit)) HighestBit >>= 1;
+
+		const auto MiddleIt = std::partition_point(Codes.begin() + Start, Codes.begin() + End,
+			[HighestBit](const uint64_t Code) { return !(Code & HighestBit); });
+		Middle = static_cast<uint32_t>(MiddleIt - Codes.begin());
+	}
+
+	const uint32_t ChildIndex = State.NodeCount.fetch_add(2);
+	State.Nodes[NodeIndex].Offset = ChildIndex;
+	State.Nodes[NodeIndex].PrimitiveCount = 0;
+
+	BuildLBVHRecursive(State, Codes, Start, Middle, ChildIndex, OutTasks);
+	BuildLBVHRecursive(State, Codes, Middle, End, ChildIndex + 1, OutTasks);
+}
+
+/* Subsets of the treelet leaves and the best way found to build a subtree over each of them */
+struct BVHTreelet
+{
+	LinearBVHNode Leaves[BVH_TREELET_LEAVES];
+	uint32_t LeafCount = 0;
+
+	/* Child pairs owned by the treelet's inner nodes, reused in any order by the new topology */
+	uint32_t Pairs[BVH_TREELET_LEAVES - 1];
+	uint32_t PairCount = 0;
+
+	AABB Boxes[1 << BVH_TREELET_LEAVES];
+	double Costs[1 << BVH_TREELET_LEAVES];
+	uint8_t Partitions[1 << BVH_TREELET_LEAVES];
+};
+
+/* Write the subtree for Subset into Nodes[Slot], taking child pairs for new inner nodes from the treelet */
+inline void EmitTreeletNode(std::vector<LinearBVHNode>& Nodes, const BVHTreelet& Treelet, const uint32_t Subset, const uint32_t Slot, uint32_t& NextPair)
+{
+	if ((Subset & (Subset - 1)) == 0)
+	{
+		uint32_t Leaf = 0;
+		while (!(Subset & (1u << Leaf))) Leaf++;
+		Nodes[Slot] = Treelet.Leaves[Leaf];
+		return;
+	}
+
+	const uint32_t ChildIndex = Treelet.Pairs[NextPair++];
+	Nodes[Slot].Box = Treelet.Boxes[Subset];
+	Nodes[Slot].Offset = ChildIndex;
+	Nodes[Slot].PrimitiveCount = 0;
+
+	const uint32_t Left = Treelet.Partitions[Subset];
+	EmitTreeletNode(Nodes, Treelet, Left, ChildIndex, NextPair);
+	EmitTreeletNode(Nodes, Treelet, Subset ^ Left, ChildIndex + 1, NextPair);
+}
+
+/*
+ * Treelet restructuring (Karras and Aila, "Fast Parallel Construction of High-Quality BVHs").
+ * The treelet grows from the node by repeatedly opening its largest inner leaf, then the topology over its
+ * leaves with the smallest total inner node area is found by dynamic programming over all leaf subsets.
+ */
+inline void RestructureTreelet(std::vector<LinearBVHNode>& Nodes, const uint32_t RootIndex)
+{
+	if (Nodes[RootIndex].IsLeaf()) return;
+
+	BVHTreelet Treelet;
+	uint32_t LeafSlots[BVH_TREELET_LEAVES];
+	Treelet.Pairs[Treelet.PairCount++] = Nodes[RootIndex].Offset;
+	LeafSlots[Treelet.LeafCount++] = Nodes[RootIndex].Offset;
+	LeafSlots[Treelet.LeafCount++] = Nodes[RootIndex].Offset + 1;
+
+	while (Treelet.LeafCount < BVH_TREELET_LEAVES)
+	{
+		int32_t Largest = -1;
+		double LargestArea = -1.0;
+		for (uint32_t i = 0; i < Treelet.LeafCount; i++)
+		{
+			const LinearBVHNode& Node = Nodes[LeafSlots[i]];
+			if (!Node.IsLeaf() && Node.Box.Area() > LargestArea)
+			{
+				Largest = i;
+				LargestArea = Node.Box.Area();
+			}
+		}
+		if (Largest == -1) break;
+
+		const uint32_t ChildIndex = Nodes[LeafSlots[Largest]].Offset;
+		Treelet.Pairs[Treelet.PairCount++] = ChildIndex;
+		LeafSlots[Largest] = ChildIndex;
+		LeafSlots[Treelet.LeafCount++] = ChildIndex + 1;
+	}
+
+	// Two leaves can only be arranged one way
+	if (Treelet.LeafCount < 3) return;
+
+	for (uint32_t i = 0; i < Treelet.LeafCount; i++)
+	{
+		Treelet.Leaves[i] = Nodes[LeafSlots[i]];
+	}
+
+	// Subsets are visited in increasing order, so all their proper subsets are already solved
+	const uint32_t FullSet = (1u << Treelet.LeafCount) - 1;
+	for (uint32_t Subset = 1; Subset <= FullSet; Subset++)
+	{
+		const uint32_t LowestBit = Subset & (~Subset + 1);
+		if (Subset == LowestBit)
+		{
+			uint32_t Leaf = 0;
+			while (!(Subset & (1u << Leaf))) Leaf++;
+			Treelet.Boxes[Subset] = Treelet.Leaves[Leaf].Box;
+			Treelet.Costs[Subset] = 0.0;
+			continue;
+		}
+
+		Treelet.Boxes[Subset] = Treelet.Boxes[Subset ^ LowestBit];
+		Treelet.Boxes[Subset].Expand(Treelet.Boxes[LowestBit]);
+
+		// Every partition is tried once, with the lowest leaf always on the left
+		double BestCost = DBL_MAX;
+		uint8_t BestPartition = 0;
+		for (uint32_t Left = (Subset - 1) & Subset; Left != 0; Left = (Left - 1) & Subset)
+		{
+			if (!(Left & LowestBit)) continue;
+
+			const double Cost = Treelet.Costs[Left] + Treelet.Costs[Subset ^ Left];
+			if (Cost < BestCost)
+			{
+				BestCost = Cost;
+				BestPartition = static_cast<uint8_t>(Left);
+			}
+		}
+
+		Treelet.Costs[Subset] = Treelet.Boxes[Subset].Area() + BestCost;
+		Treelet.Partitions[Subset] = BestPartition;
+	}
+
+	uint32_t NextPair = 0;
+	EmitTreeletNode(Nodes, Treelet, FullSet, RootIndex, NextPair);
+}
+
+/* Restructure the treelets of the subtree bottom-up, nodes at StopDepth were already refined and are skipped */
+inline void RefineTreelets(std::vector<LinearBVHNode>& Nodes, const uint32_t NodeIndex, const uint32_t Depth, const uint32_t StopDepth)
+{
+	if (Depth == StopDepth || Nodes[NodeIndex].IsLeaf()) return;
+
+	const uint32_t ChildIndex = Nodes[NodeIndex].Offset;
+	RefineTreelets(Nodes, ChildIndex, Depth + 1, StopDepth);
+	RefineTreelets(Nodes, ChildIndex + 1, Depth + 1, StopDepth);
+	RestructureTreelet(Nodes, NodeIndex);
+}
+
+/* Collect the inner nodes at Depth, their subtrees don't overlap and can be refined in parallel */
+inline void CollectTreeletTasks(const std::vector<LinearBVHNode>& Nodes, const uint32_t NodeIndex, const uint32_t Depth, std::vector<uint32_t>& OutTasks)
+{
+	if (Nodes[NodeIndex].IsLeaf()) return;
+
+	if (Depth == BVH_TREELET_TASK_DEPTH)
+	{
+		OutTasks.push_back(NodeIndex);
+		return;
+	}
+
+	CollectTreeletTasks(Nodes, Nodes[NodeIndex].Offset, Depth + 1, OutTasks);
+	CollectTreeletTasks(Nodes, Nodes[NodeIndex].Offset + 1, Depth + 1, OutTasks);
+}
+
+/*
+ * Build the BVH along the Morton curve of the primitive centroids.
+ * Like CreateBVH the top levels are emitted first and the remaining ranges are built on all threads,
+ * the result doesn't depend on the number of threads.
+ */
+inline UniquePtr<LinearBVH> CreateLBVH(const std::vector<SharedPtr<RPrimitive>>& Primitives, const bool bRefineTreelets)
+{
+	auto BVH = MakeUnique<LinearBVH>();
+
+	if (Primitives.empty()) return BVH;
+
+	const uint32_t PrimitiveCount = static_cast<uint32_t>(Primitives.size());
+	std::vector<BVHBuildPrimitive> BuildPrimitives;
+	std::vector<uint32_t> Indices;
+	GatherBuildPrimitives(Primitives, BuildPrimitives, Indices);
+
+	std::vector<LinearBVHNode> Nodes(2 * PrimitiveCount - 1);
+	BVHBuildState State(BuildPrimitives, Indices, Nodes);
+
+	AABB Box, CentroidBox;
+	GetRangeBounds(State, 0, PrimitiveCount, true, Box, CentroidBox);
+
+	const uint32_t BitsPerAxis = PrimitiveCount > BVH_MORTON_WIDE_CODE_PRIMITIVES ? 21 : 10;
+	std::vector<uint64_t> Codes;
+	ComputeMortonCodes(BuildPrimitives, CentroidBox, BitsPerAxis, Codes);
+	SortMortonCodes(Codes, Indices, BitsPerAxis * 3);
+
+	std::vector<BVHBuildTask> Tasks;
+	BuildLBVHRecursive(State, Codes, 0, PrimitiveCount, 0, &Tasks);
+
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (int32_t i = 0; i < static_cast<int32_t>(Tasks.size()); i++)
+	{
+		BuildLBVHRecursive(State, Codes, Tasks[i].Start, Tasks[i].End, Tasks[i].NodeIndex, nullptr);
+	}
+
+	FinishBVH(State, Primitives, *BVH);
+	ComputeInnerBounds(BVH->Nodes);
+
+	if (bRefineTreelets)
+	{
+		std::vector<uint32_t> TreeletTasks;
+		CollectTreeletTasks(BVH->Nodes, 0, 0, TreeletTasks);
+
+		#pragma omp parallel for schedule(dynamic, 1)
+		for (int32_t i = 0; i < static_cast<int32_t>(TreeletTasks.size()); i++)
+		{
+			RefineTreelets(BVH->Nodes, TreeletTasks[i], 0, UINT32_MAX);
+		}
+		RefineTreelets(BVH->Nodes, 0, 0, BVH_TREELET_TASK_DEPTH);
+
+		// Restructuring moves nodes between the slots of their treelet, restore the depth-first order
+		std::vector<LinearBVHNode> RefinedNodes = std::move(BVH->Nodes);
+		BVH->Nodes.reserve(RefinedNodes.size());
+		BVH->Nodes.resize(1);
+		CopyDepthFirst(RefinedNodes, 0, 0, BVH->Nodes);
+	}
+
+	BVH->BuildCost = ComputeSAHCost(*BVH);
+
+	return BVH;
+}
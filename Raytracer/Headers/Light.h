@@ -1,6 +1,7 @@
 #pragma once
 #include <memory>
 #include "OObject.h"
+#include "ScenePrimitives.h"
 #include "Random.h"
 #include "math/Math.h"
 
@@ -30,10 +31,15 @@ public:
 		SetColor(InColor);
 	}
 
-	virtual bool Intersects(const RRay& Ray, RHit& OutHit) const override;
+	virtual bool FindHit(const RRay& Ray, RPrimitiveHit& OutHit) const override;
 	virtual AABB GetBoundingBox() const override;
 	virtual Vector3 SampleDirection(const Vector3& Point) const override;
 	virtual double Area() const override;
+
+	double GetRadius() const { return Radius; }
+
+protected:
+	virtual void GetHitSurface(const RRay& Ray, const RPrimitiveHit& Hit, RHit& OutHit) const override;
 };
 
 inline void RLight::SetColor(const Vector3& InColor)
@@ -42,42 +48,25 @@ inline void RLight::SetColor(const Vector3& InColor)
 	Mat->InitializeLight(InColor);
 }
 
-inline bool RSphereLight::Intersects(const RRay& Ray, RHit& OutHit) const
+inline bool RSphereLight::FindHit(const RRay& Ray, RPrimitiveHit& OutHit) const
 {
-	RRay LocalRay;
-	LocalRay.Direction = Transform.InverseTransformVector(Ray.Direction).Normalized();
-	LocalRay.Origin = Transform.InverseTransformPosition(Ray.Origin);
-	const Vector3 L = -LocalRay.Origin; //Vector from Ray origin to Sphere position
-
-	const double tca = L | LocalRay.Direction;
-	if (tca < 0) return false;
-
-	const double d2 = (L | L) - tca * tca; //Distance from Sphere position to ray
-	if (d2 > Radius * Radius) return false;
-
-	const double HalfInner = sqrt(Radius * Radius - d2); //half of the ray length inside sphere
-
-	double t0 = tca - HalfInner;
-	double t1 = tca + HalfInner;
+	double Depth;
+	bool bInside;
+	if (!GetPlacedSphereWorldDistance(Transform, Radius, Ray, Depth, bInside) || !Ray.InRange(Depth)) return false;
 
-	bool bInside = false;
-	if (t0 < 0)
-	{
-		bInside = true;
-		t0 = t1;
-		if (t0 < 0) return false;
-	}
+	OutHit.Object = this;
+	OutHit.Part = bInside;
+	OutHit.Depth = Depth;
 
-	const Vector3 LocalHitPoint = LocalRay.Origin + LocalRay.Direction * t0;
-	const Vector3 HitPoint = Transform.TransformPosition(LocalHitPoint);
+	return true;
+}
 
-	OutHit.Mat = GetMaterial();
-	OutHit.Normal = bInside ? -(HitPoint - Transform.GetPosition()).Normalized() : (HitPoint - Transform.GetPosition()).Normalized();
+/* Part is 1 if the ray started inside the light, the normal then points inwards */
+inline void RSphereLight::GetHitSurface(const RRay& Ray, const RPrimitiveHit& Hit, RHit& OutHit) const
+{
+	const Vector3 HitPoint = Ray.Origin + Ray.Direction * Hit.Depth;
+	OutHit.Normal = Hit.Part ? -(HitPoint - Transform.GetPosition()).Normalized() : (HitPoint - Transform.GetPosition()).Normalized();
 	OutHit.Position = HitPoint;
-	OutHit.Depth = (HitPoint - Ray.Origin).Length();
-	OutHit.Object = shared_from_this();
-
-	return true;
 }
 
 inline AABB RSphereLight::GetBoundingBox() const
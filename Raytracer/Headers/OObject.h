@@ -3,24 +3,20 @@
 #include <sstream>
 #include <vector>
 #include <fstream>
+#include <bit>
 
 #include "math/Vector.h"
 #include "CoreUtilities.h"
 #include "Transform.h"
 #include "Material.h"
 #include "AABB.h"
+#include "TriangleGroup.h"
+#include "SphereGroup.h"
 
-
-
-struct Vertex
-{
-	Vector3 Position;
-	Vector3 Normal;
-	Vector2 UV;
-
-	Vertex() : Position(0.0), Normal(0.0), UV(0.0) {}
-	Vertex(const Vector3& InPosition, const Vector3& InNormal) : Position(InPosition), Normal(InNormal) {}
-};
+struct LinearBVH;
+struct LinearBVHNode;
+struct QuantizedBVH;
+enum class BVHBuilder : uint8_t;
 
 
 class RPrimitive : public std::enable_shared_from_this<RPrimitive>
@@ -36,69 +32,71 @@ public:
 		Mat = MakeShared<RMaterial>();
 	}
 
+protected:
+	/* For primitives that take the material from somewhere else and don't need their own */
+	RPrimitive(SharedPtr<RMaterial> InMat) : Mat(InMat) {}
+
+public:
+
 	virtual AABB GetBoundingBox() const = 0;
-	virtual bool Intersects(const RRay& Ray, RHit& OutHit) const = 0;
-	virtual SharedPtr<RMaterial> GetMaterial() const { return Mat; };
-	virtual void SetMaterial(SharedPtr<RMaterial> NewMaterial) { Mat = NewMaterial; };
-};
 
-class Triangle : public RPrimitive
-{
-	SharedPtr<Vertex> Vertices[3];
-	bool bSmoothShading;
+	/* Primitives without finite bounds are kept out of the BVH and tested by every scene query directly */
+	virtual bool IsBounded() const { return true; }
 
-public:
-	Triangle()
+	/* Bounds of the part of the primitive inside Clip, used by spatial splits. Invalid if nothing is inside */
+	virtual AABB GetClippedBoundingBox(const AABB& Clip) const
 	{
-		Vertices[0] = nullptr;
-		Vertices[1] = nullptr;
-		Vertices[2] = nullptr;
-		bSmoothShading = true;
+		AABB Box = GetBoundingBox();
+		Box.Clip(Clip);
+		return Box;
 	}
-	Triangle(SharedPtr<Vertex>& V1, SharedPtr<Vertex>& V2, SharedPtr<Vertex>& V3, const bool InbSmoothShading = true)
+	/* 
+	 * Closest hit within the ray's range. Only the record traversals compare is filled, the surface is computed
+	 * by GetHit once the closest hit of a query is known.
+	 */
+	virtual bool FindHit(const RRay& Ray, RPrimitiveHit& OutHit) const = 0;
+
+	/* Full hit record for a hit FindHit found along Ray */
+	void GetHit(const RRay& Ray, const RPrimitiveHit& Hit, RHit& OutHit) const
 	{
-		Vertices[0] = V1;
-		Vertices[1] = V2;
-		Vertices[2] = V3;
-		bSmoothShading = InbSmoothShading;
+		OutHit.Depth = Hit.Depth;
+		OutHit.Object = this;
+		OutHit.Mat = Mat.get();
+		GetHitSurface(Ray, Hit, OutHit);
 	}
 
-	const SharedPtr<Vertex> GetVertex(const uint8_t Index) const
+	/* FindHit and GetHit for a single primitive */
+	bool Intersects(const RRay& Ray, RHit& OutHit) const
 	{
-		return Vertices[Index];
-	}
+		RPrimitiveHit Hit;
+		if (!FindHit(Ray, Hit)) return false;
 
-	void SetVertex(const uint8_t Index, SharedPtr<Vertex>& InVertex)
-	{
-		Vertices[Index] = InVertex;
+		GetHit(Ray, Hit, OutHit);
+		return true;
 	}
 
-	double Area() const
+	/* Returns true if the ray hits the primitive closer than MaxDistance, doesn't fill a hit record */
+	virtual bool Occludes(const RRay& Ray, const double MaxDistance) const
 	{
-		const Vector3 Edge1 = Vertices[1]->Position - Vertices[0]->Position;
-		const Vector3 Edge2 = Vertices[2]->Position - Vertices[0]->Position;
-		return (Edge1 ^ Edge2).Length() / 2.0;
+		RPrimitiveHit TempHit;
+		return FindHit(Ray, TempHit) && TempHit.Depth < MaxDistance;
 	}
 
-	//Normalized normal of the triangle
-	Vector3 Normal() const
-	{
-		const Vector3 Edge1 = Vertices[1]->Position - Vertices[0]->Position;
-		const Vector3 Edge2 = Vertices[2]->Position - Vertices[0]->Position;
-		return (Edge1 ^ Edge2).Normalized();
-	}
+	virtual SharedPtr<RMaterial> GetMaterial() const { return Mat; };
+	virtual void SetMaterial(SharedPtr<RMaterial> NewMaterial) { Mat = NewMaterial; };
 
-	//Unnormalized normal of the triangle, just the cross product
-	Vector3 RawNormal() const
-	{
-		const Vector3 Edge1 = Vertices[1]->Position - Vertices[0]->Position;
-		const Vector3 Edge2 = Vertices[2]->Position - Vertices[0]->Position;
-		return (Edge1 ^ Edge2);
-	}
+protected:
+	/* Position and normal of the hit for GetHit */
+	virtual void GetHitSurface(const RRay& Ray, const RPrimitiveHit& Hit, RHit& OutHit) const = 0;
+
+	/* World space bounds of an object space box placed with ObjectTransform */
+	static AABB ToWorldBoundingBox(const RTransform& ObjectTransform, const AABB& LocalBox);
+
+	/* Ray moved into object space, distances along it scale uniformly so its range carries over */
+	static RRay ToObjectSpace(const RTransform& ObjectTransform, const RRay& Ray);
 
-	
-	virtual AABB GetBoundingBox() const override;
-	virtual bool Intersects(const RRay& Ray, RHit& OutHit) const override;
+	/* Bring the depth of a hit found along the object space ray back to world space */
+	static double ToWorldDepth(const RTransform& ObjectTransform, const RRay& Ray, const RRay& LocalRay, const double LocalDepth);
 };
 
 class OSphere : public RPrimitive
@@ -112,7 +110,11 @@ public:
 	{ 
 		return AABB(Transform.GetPosition() + Vector3(-Radius), Transform.GetPosition() + Vector3(Radius)); 
 	}
-	virtual bool Intersects(const RRay& Ray, RHit& OutHit) const override;
+	virtual bool FindHit(const RRay& Ray, RPrimitiveHit& OutHit) const override;
+	virtual bool Occludes(const RRay& Ray, const double MaxDistance) const override;
+
+protected:
+	virtual void GetHitSurface(const RRay& Ray, const RPrimitiveHit& Hit, RHit& OutHit) const override;
 };
 
 class OPlane : public RPrimitive
@@ -124,13 +126,21 @@ public:
 
 	virtual AABB GetBoundingBox() const override
 	{ 
-		Vector3 Min(-1000.0, -1000.0, -0.01);
-		Vector3 Max( 1000.0,  1000.0,  0.01);
-		Min = TransformToWorld(Min, Normal);
-		Max = TransformToWorld(Max, Normal);
-		return AABB(Min, Max); 
+		/* Planes are infinite and never go into the BVH, this is a thin 2000x2000 slab around the plane position for anything else needing bounds */
+		AABB Box = AABB::Empty();
+		for (uint8_t Corner = 0; Corner < 8; Corner++)
+		{
+			const Vector3 Local(Corner & 1 ? 1000.0 : -1000.0, Corner & 2 ? 1000.0 : -1000.0, Corner & 4 ? 0.01 : -0.01);
+			Box.Expand(Transform.GetPosition() + TransformToWorld(Local, Normal));
+		}
+		return Box; 
 	}
-	virtual bool Intersects(const RRay& Ray, RHit& OutHit) const override;
+	virtual bool IsBounded() const override { return false; }
+	virtual bool FindHit(const RRay& Ray, RPrimitiveHit& OutHit) const override;
+	virtual bool Occludes(const RRay& Ray, const double MaxDistance) const override;
+
+protected:
+	virtual void GetHitSurface(const RRay& Ray, const RPrimitiveHit& Hit, RHit& OutHit) const override;
 };
 
 
@@ -141,8 +151,11 @@ public:
 
 	OBox() {}
 
-	virtual bool Intersects(const RRay& Ray, RHit& OutHit) const override;
+	virtual bool FindHit(const RRay& Ray, RPrimitiveHit& OutHit) const override;
 	void SetByMinMax(const Vector3& VMin, const Vector3& VMax);
+
+protected:
+	virtual void GetHitSurface(const RRay& Ray, const RPrimitiveHit& Hit, RHit& OutHit) const override;
 };
 
 
@@ -154,25 +167,300 @@ class OMesh : public RPrimitive
 public:
 	OMesh(const char* Path);
 	OMesh() {};
+	~OMesh();
 
 private:
-	std::vector<SharedPtr<Vertex>> Vertices;
-	std::vector<SharedPtr<Triangle>> Triangles;
+	/* Vertex attributes in object space, UVs is empty if the model has no texture coordinates */
+	std::vector<Vector3> Positions;
+	std::vector<Vector3> Normals;
+	std::vector<Vector2> UVs;
+
+	/* 
+	 * Three vertex indices per face, faces are addressed by their position in here.
+	 * Once the BVH is built every leaf owns a range of faces starting at a group boundary, see StoreFacesInLeafOrder.
+	 */
+	std::vector<uint32_t> Indices;
+
+	/* Intersection records of the faces, face i is lane i % TRIANGLE_GROUP_SIZE of group i / TRIANGLE_GROUP_SIZE */
+	std::vector<TriangleRecordGroup> FaceGroups;
+
+	/* Faces of the loaded model, without the copies and padding */
+	uint32_t FaceCount = 0;
+
+	/* Interpolate the vertex normals over the faces, otherwise every face is shaded with its geometric normal */
+	bool bSmoothShading = true;
+
 	AABB BBox;
 
-	/* Call when the model's vertices/triangles was modified */
+	/* Bottom level BVH over the faces in object space, shared by every instance of the mesh. Its leaf ranges are ranges of faces */
+	UniquePtr<LinearBVH> MeshBVH;
+	BVHBuilder MeshBVHBuilder{};
+
+	/* Loaded face each stored face is a copy of, empty while the faces are stored as they were loaded */
+	std::vector<uint32_t> FaceSources;
+
+	/* Quantized MeshBVH nodes made by CompressBVH, the full precision nodes are released while it exists */
+	UniquePtr<QuantizedBVH> MeshQuantizedBVH;
+
+	/* Call when the model's vertices/faces were modified */
 	void UpdateAABB();
 	void UpdateSmoothNormals();
+	void UpdateFaceRecords();
+
+	/* 
+	 * Store the faces in the order the BVH leaves reference them and the vertices as those faces first use them,
+	 * so leaf tests stream through memory. Small sibling leaves are merged first, then every leaf gets its own range
+	 * of faces starting at a group boundary, padded to whole groups by repeating its last face. Faces referenced by
+	 * several leaves are stored once for each. Leaf offsets then index faces directly.
+	 */
+	void StoreFacesInLeafOrder();
+
+	/* Store the faces as they were loaded again, without the copies and padding of the leaves */
+	void RestoreLoadedFaces();
 
 public:
 	bool LoadModel(const std::string& Path);
-	size_t CountVerts() const { return Vertices.size(); }
-	size_t CountFaces() const { return Triangles.size(); }
+	size_t CountVerts() const { return Positions.size(); }
+	size_t CountFaces() const { return FaceCount; }
+
+	/* Faces in the index buffer, the indices the face queries and hit Parts use */
+	size_t CountStoredFaces() const { return Indices.size() / 3; }
 
-	virtual AABB GetBoundingBox() const { return BBox; }
-	virtual bool Intersects(const RRay& Ray, RHit& OutHit) const;
+	/* Memory held by the vertex attributes, the index buffer, the face records and the face sources, the BVH isn't included */
+	size_t GetGeometryBytes() const;
+
+	const Vector3& GetFacePosition(const uint32_t Face, const uint8_t Corner) const { return Positions[Indices[3 * Face + Corner]]; }
+
+	/* Unnormalized normal of the face, just the cross product */
+	Vector3 GetFaceRawNormal(const uint32_t Face) const
+	{
+		return (GetFacePosition(Face, 1) - GetFacePosition(Face, 0)) ^ (GetFacePosition(Face, 2) - GetFacePosition(Face, 0));
+	}
+
+	/* Queries against a single face in object space */
+	AABB GetFaceBoundingBox(const uint32_t Face) const;
+	AABB GetFaceClippedBoundingBox(const uint32_t Face, const AABB& Clip) const;
+	bool IntersectsFace(const uint32_t Face, const RRay& Ray, RPrimitiveHit& OutHit) const;
+	bool OccludesFace(const uint32_t Face, const RRay& Ray, const double MaxDistance) const;
+
+	/* Object space position and normal at the barycentrics of a face hit */
+	void GetFaceSurface(const RPrimitiveHit& Hit, RHit& OutHit) const;
+
+	/* 
+	 * Closest hit of the object space ray among Count faces from First, whole groups at once, First must start a group.
+	 * Every closer hit is written to OutHit and shrinks the TMax of ClippedRay.
+	 */
+	bool IntersectsFaces(const uint32_t First, const uint32_t Count, RRay& ClippedRay, RPrimitiveHit& OutHit) const;
+	bool OccludesFaces(const uint32_t First, const uint32_t Count, const RRay& Ray, const double MaxDistance) const;
+
+	/* 
+	 * Builds the object space BVH, does nothing if it already exists and was built with Builder. Otherwise it is built
+	 * again from the loaded faces. With a CacheDirectory the BVH is loaded from there if this geometry was built before
+	 * with the same builder, and stored there otherwise.
+	 */
+	void BuildBVH(const BVHBuilder Builder, const std::string& CacheDirectory = "");
+	bool HasBVH(const BVHBuilder Builder) const { return MeshBVH != nullptr && MeshBVHBuilder == Builder; }
+
+	/* Hash over the face vertex positions in face order */
+	uint64_t ComputeGeometryHash() const;
+	bool HasBVH() const { return MeshBVH != nullptr; }
+	const LinearBVH* GetBVH() const { return MeshBVH.get(); }
+
+	/* 
+	 * Replace the BVH nodes with quantized ones, does nothing without a BVH or if it is compressed already.
+	 * The full precision nodes are released, reorder them and gather their statistics before.
+	 */
+	void CompressBVH();
+
+	/* Rebuild full precision nodes from the quantized ones and drop those, the nodes come back in depth-first order */
+	void DecompressBVH();
+	bool IsBVHCompressed() const { return MeshQuantizedBVH != nullptr; }
+
+	/* 
+	 * Full precision nodes of the BVH, rebuilt from the quantized ones when compressed. Leaves get the bounds of their
+	 * faces clipped to the decoded box, so boxes are exact again unless a spatial split cut those faces.
+	 */
+	std::vector<LinearBVHNode> RestoreBVHNodes() const;
+
+	/* Queries against the mesh placed with InstanceTransform, the ray and the results are in world space */
+	AABB GetInstanceBoundingBox(const RTransform& InstanceTransform) const;
+	bool IntersectsInstance(const RTransform& InstanceTransform, const RRay& Ray, RPrimitiveHit& OutHit) const;
+	bool OccludesInstance(const RTransform& InstanceTransform, const RRay& Ray, const double MaxDistance) const;
+
+	/* World space position and normal of a hit IntersectsInstance found */
+	void GetInstanceHitSurface(const RTransform& InstanceTransform, const RPrimitiveHit& Hit, RHit& OutHit) const;
+
+	/* 
+	 * The rays selected by Mask are traced as a packet through the mesh BVH. A hit is only written to OutHits if it is
+	 * closer than the ray's TMax, returns the mask of rays that got one.
+	 */
+	uint32_t IntersectsInstancePacket(const RTransform& InstanceTransform, const RRay* Rays, const uint32_t Mask, RPrimitiveHit* OutHits) const;
+
+	virtual AABB GetBoundingBox() const override { return GetInstanceBoundingBox(Transform); }
+	virtual bool FindHit(const RRay& Ray, RPrimitiveHit& OutHit) const override;
+	virtual bool Occludes(const RRay& Ray, const double MaxDistance) const override { return OccludesInstance(Transform, Ray, MaxDistance); }
 
 	friend class RScene;
+
+protected:
+	virtual void GetHitSurface(const RRay&, const RPrimitiveHit& Hit, RHit& OutHit) const override { GetInstanceHitSurface(Transform, Hit, OutHit); }
+};
+
+/* 
+ * One face of an OMesh as a primitive, in the mesh's object space. Meshes don't keep these, they only exist
+ * while the BVH builders, which work on primitives, build the mesh BVH.
+ */
+class OMeshFace : public RPrimitive
+{
+	const OMesh& Mesh;
+	uint32_t Face;
+
+public:
+	OMeshFace(const OMesh& InMesh, const uint32_t InFace) : RPrimitive(nullptr), Mesh(InMesh), Face(InFace) {}
+
+	virtual AABB GetBoundingBox() const override { return Mesh.GetFaceBoundingBox(Face); }
+	virtual AABB GetClippedBoundingBox(const AABB& Clip) const override { return Mesh.GetFaceClippedBoundingBox(Face, Clip); }
+	virtual bool FindHit(const RRay& Ray, RPrimitiveHit& OutHit) const override;
+	virtual bool Occludes(const RRay& Ray, const double MaxDistance) const override { return Mesh.OccludesFace(Face, Ray, MaxDistance); }
+
+protected:
+	virtual void GetHitSurface(const RRay&, const RPrimitiveHit& Hit, RHit& OutHit) const override { Mesh.GetFaceSurface(Hit, OutHit); }
+};
+
+/* 
+ * Placement of a shared mesh in the scene with its own transform and material.
+ * Any number of instances can reference one OMesh, the triangles and their BVH are stored only once.
+ */
+class OMeshInstance : public RPrimitive
+{
+	SharedPtr<OMesh> Mesh;
+
+public:
+	OMeshInstance(const SharedPtr<OMesh>& InMesh)
+		: Mesh(InMesh)
+	{
+		Transform = Mesh->Transform;
+		Mat = Mesh->GetMaterial();
+	}
+
+	OMesh* GetMesh() const { return Mesh.get(); }
+
+	virtual AABB GetBoundingBox() const override { return Mesh->GetInstanceBoundingBox(Transform); }
+	virtual bool FindHit(const RRay& Ray, RPrimitiveHit& OutHit) const override;
+	virtual bool Occludes(const RRay& Ray, const double MaxDistance) const override { return Mesh->OccludesInstance(Transform, Ray, MaxDistance); }
+
+protected:
+	virtual void GetHitSurface(const RRay&, const RPrimitiveHit& Hit, RHit& OutHit) const override { Mesh->GetInstanceHitSurface(Transform, Hit, OutHit); }
+};
+
+
+/* 
+ * Any number of spheres as one primitive, for particles and point clouds. A sphere is only its center and radius
+ * in object space and an index into the materials of the cloud, 18 bytes instead of a whole OSphere.
+ * Like the faces of a mesh the spheres get their own BVH, Transform places the whole cloud.
+ */
+class OSphereCloud : public RPrimitive
+{
+	/* 
+	 * Stored sphere i is lane i % SPHERE_GROUP_SIZE of group i / SPHERE_GROUP_SIZE. Once the BVH is built they are
+	 * in leaf order, with copies of spheres referenced by several leaves and the padding of every leaf.
+	 */
+	std::vector<SphereRecordGroup> SphereGroups;
+	std::vector<uint16_t> MaterialIndices;
+
+	/* Spheres added to the cloud, without the copies and padding */
+	uint32_t SphereCount = 0;
+
+	/* Materials the spheres pick from, while there are none every sphere has the material of the cloud */
+	std::vector<SharedPtr<RMaterial>> Materials;
+
+	/* Object space bounds of all spheres */
+	AABB BBox = AABB::Empty();
+
+	/* Object space BVH over the spheres, its leaf ranges are ranges of spheres */
+	UniquePtr<LinearBVH> CloudBVH;
+	BVHBuilder CloudBVHBuilder{};
+
+	/* Added sphere each stored sphere is a copy of, empty while the spheres are stored as they were added */
+	std::vector<uint32_t> SphereSources;
+
+	/* Same as OMesh::StoreFacesInLeafOrder, the spheres are stored in leaf order and every leaf is padded to whole groups */
+	void StoreSpheresInLeafOrder();
+
+	/* Same as OMesh::RestoreLoadedFaces, the spheres are stored in the order they were added again */
+	void RestoreAddedSpheres();
+
+public:
+	/* Set in the Part of a hit if the ray started inside the sphere, the other bits are the sphere */
+	static constexpr uint32_t INSIDE_PART_BIT = 1u << 31;
+
+	OSphereCloud() {}
+	~OSphereCloud();
+
+	void Reserve(const uint32_t Count);
+
+	/* 
+	 * Returns the index of the new sphere, which is only valid until BuildBVH stores the spheres in leaf order.
+	 * Spheres can't be added after that, UINT32_MAX is returned then.
+	 */
+	uint32_t AddSphere(const Vector3& Center, const double Radius, const uint16_t MaterialIndex = 0);
+	uint16_t AddMaterial(const SharedPtr<RMaterial>& Material);
+
+	uint32_t CountSpheres() const { return SphereCount; }
+
+	/* Spheres in the groups, the indices the sphere queries and hit Parts use */
+	uint32_t CountStoredSpheres() const { return static_cast<uint32_t>(MaterialIndices.size()); }
+
+	/* Memory held by the spheres, their material indices and their sources, the BVH isn't included */
+	size_t GetGeometryBytes() const;
+
+	Vector3 GetSphereCenter(const uint32_t Sphere) const { return SphereGroups[Sphere / SPHERE_GROUP_SIZE].GetCenter(Sphere % SPHERE_GROUP_SIZE); }
+	double GetSphereRadius(const uint32_t Sphere) const { return SphereGroups[Sphere / SPHERE_GROUP_SIZE].Radius[Sphere % SPHERE_GROUP_SIZE]; }
+
+	/* Queries against a single sphere in object space */
+	AABB GetSphereBoundingBox(const uint32_t Sphere) const;
+	bool IntersectsSphere(const uint32_t Sphere, const RRay& Ray, RPrimitiveHit& OutHit) const;
+
+	/* Object space normal at a point on the sphere of a hit, it points inwards if the ray started inside */
+	Vector3 GetSphereNormal(const uint32_t Part, const Vector3& LocalPosition) const;
+
+	/* 
+	 * Closest hit of the object space ray among Count spheres from First, whole groups at once, First must start a group.
+	 * Every closer hit is written to OutHit and shrinks the TMax of ClippedRay.
+	 */
+	bool IntersectsSpheres(const uint32_t First, const uint32_t Count, RRay& ClippedRay, RPrimitiveHit& OutHit) const;
+	bool OccludesSpheres(const uint32_t First, const uint32_t Count, const RRay& Ray, const double MaxDistance) const;
+
+	/* Builds the object space BVH, does nothing if it already exists and was built with Builder, see OMesh::BuildBVH */
+	void BuildBVH(const BVHBuilder Builder);
+	bool HasBVH() const { return CloudBVH != nullptr; }
+	bool HasBVH(const BVHBuilder Builder) const { return CloudBVH != nullptr && CloudBVHBuilder == Builder; }
+
+	virtual AABB GetBoundingBox() const override { return ToWorldBoundingBox(Transform, BBox); }
+	virtual bool FindHit(const RRay& Ray, RPrimitiveHit& OutHit) const override;
+	virtual bool Occludes(const RRay& Ray, const double MaxDistance) const override;
+
+protected:
+	/* Also picks the material of the sphere hit */
+	virtual void GetHitSurface(const RRay& Ray, const RPrimitiveHit& Hit, RHit& OutHit) const override;
 };
 
+/* One sphere of an OSphereCloud as a primitive in the cloud's object space, only exists while the cloud BVH is built */
+class OCloudSphere : public RPrimitive
+{
+	const OSphereCloud& Cloud;
+	uint32_t Sphere;
 
+public:
+	OCloudSphere(const OSphereCloud& InCloud, const uint32_t InSphere) : RPrimitive(nullptr), Cloud(InCloud), Sphere(InSphere) {}
+
+	virtual AABB GetBoundingBox() const override { return Cloud.GetSphereBoundingBox(Sphere); }
+	virtual bool FindHit(const RRay& Ray, RPrimitiveHit& OutHit) const override;
+
+protected:
+	virtual void GetHitSurface(const RRay& Ray, const RPrimitiveHit& Hit, RHit& OutHit) const override
+	{
+		OutHit.Position = Ray.Origin + Ray.Direction * Hit.Depth;
+		OutHit.Normal = Cloud.GetSphereNormal(Hit.Part, OutHit.Position);
+	}
+};
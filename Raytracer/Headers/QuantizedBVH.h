@@ -0,0 +1,316 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+
+#include "BVH.h"
+
+/* Leaves of the quantized BVH hold at most this many primitives, larger binary leaves are split into several */
+constexpr uint32_t QUANTIZED_BVH_MAX_LEAF_PRIMITIVES = UINT16_MAX;
+
+/* Number of steps between the minimum and the maximum of a parent box */
+constexpr uint32_t QUANTIZED_BVH_STEPS = 255;
+
+/*
+ * Compressed inner node of the binary BVH. Bounds of both children are stored as 8-bit steps inside
+ * the decoded box of this node, which itself comes from its parent, so no node stores absolute coordinates.
+ * Decoded boxes are always rounded outwards and only ever contain more than the original box.
+ */
+struct QuantizedBVHNode
+{
+	uint8_t Min[2][3];
+	uint8_t Max[2][3];
+
+	/* Index of the child node, or of the first primitive for leaf children */
+	uint32_t Child[2];
+
+	/* Number of primitives of leaf children, 0 for inner children */
+	uint16_t PrimitiveCount[2];
+
+	/* Unused children, only possible when the whole tree is a single leaf, point to node 0 which is never a child */
+	bool HasChild(const uint8_t Index) const { return PrimitiveCount[Index] > 0 || Child[Index] != 0; }
+};
+
+/* Quantized copy of a LinearBVH, leaves reference the primitives of the binary BVH */
+struct QuantizedBVH
+{
+	/* Box of the root in full precision, every other box is decoded from it */
+	AABB RootBox;
+
+	std::vector<QuantizedBVHNode> Nodes;
+};
+
+/* Coordinate of a step along [Min, Max], the last step is exactly Max */
+inline double DecodeQuantizedCoordinate(const uint8_t Step, const double Min, const double Max)
+{
+	return Step == QUANTIZED_BVH_STEPS ? Max : Min + (Max - Min) * (Step * (1.0 / QUANTIZED_BVH_STEPS));
+}
+
+inline AABB DecodeQuantizedBox(const QuantizedBVHNode& Node, const uint8_t Index, const AABB& ParentBox)
+{
+	AABB Box;
+	Box.Min.X = DecodeQuantizedCoordinate(Node.Min[Index][0], ParentBox.Min.X, ParentBox.Max.X);
+	Box.Min.Y = DecodeQuantizedCoordinate(Node.Min[Index][1], ParentBox.Min.Y, ParentBox.Max.Y);
+	Box.Min.Z = DecodeQuantizedCoordinate(Node.Min[Index][2], ParentBox.Min.Z, ParentBox.Max.Z);
+	Box.Max.X = DecodeQuantizedCoordinate(Node.Max[Index][0], ParentBox.Min.X, ParentBox.Max.X);
+	Box.Max.Y = DecodeQuantizedCoordinate(Node.Max[Index][1], ParentBox.Min.Y, ParentBox.Max.Y);
+	Box.Max.Z = DecodeQuantizedCoordinate(Node.Max[Index][2], ParentBox.Min.Z, ParentBox.Max.Z);
+	return Box;
+}
+
+/* Store Box as child Index of Node, rounding so that the decoded box still contains Box */
+inline void EncodeQuantizedBox(const AABB& Box, const AABB& ParentBox, const uint8_t Index, QuantizedBVHNode& OutNode)
+{
+	for (uint8_t Axis = 0; Axis < 3; Axis++)
+	{
+		const double Min = ParentBox.Min[Axis];
+		const double Max = ParentBox.Max[Axis];
+		const double Scale = Max > Min ? QUANTIZED_BVH_STEPS / (Max - Min) : 0.0;
+
+		int32_t Low = static_cast<int32_t>(std::floor((Box.Min[Axis] - Min) * Scale));
+		int32_t High = static_cast<int32_t>(std::ceil((Box.Max[Axis] - Min) * Scale));
+		Low = std::clamp(Low, 0, static_cast<int32_t>(QUANTIZED_BVH_STEPS));
+		High = std::clamp(High, Low, static_cast<int32_t>(QUANTIZED_BVH_STEPS));
+
+		// The scaled value can round to the wrong side, correct it with the exact decoding used by traversal
+		while (Low > 0 && DecodeQuantizedCoordinate(static_cast<uint8_t>(Low), Min, Max) > Box.Min[Axis]) Low--;
+		while (High < static_cast<int32_t>(QUANTIZED_BVH_STEPS) && DecodeQuantizedCoordinate(static_cast<uint8_t>(High), Min, Max) < Box.Max[Axis]) High++;
+
+		OutNode.Min[Index][Axis] = static_cast<uint8_t>(Low);
+		OutNode.Max[Index][Axis] = static_cast<uint8_t>(High);
+	}
+}
+
+/* Append the node for a leaf range too large for one quantized leaf, both halves keep the full parent box */
+inline uint32_t QuantizeLeafRange(const uint32_t Offset, const uint32_t Count, QuantizedBVH& OutBVH)
+{
+	const uint32_t NodeIndex = static_cast<uint32_t>(OutBVH.Nodes.size());
+	OutBVH.Nodes.emplace_back();
+
+	const uint32_t Half = Count / 2;
+	const uint32_t Offsets[2] = { Offset, Offset + Half };
+	const uint32_t Counts[2] = { Half, Count - Half };
+	for (uint8_t i = 0; i < 2; i++)
+	{
+		uint32_t Child = Offsets[i];
+		uint16_t PrimitiveCount = static_cast<uint16_t>(std::min(Counts[i], QUANTIZED_BVH_MAX_LEAF_PRIMITIVES));
+		if (Counts[i] > QUANTIZED_BVH_MAX_LEAF_PRIMITIVES)
+		{
+			Child = QuantizeLeafRange(Offsets[i], Counts[i], OutBVH);
+			PrimitiveCount = 0;
+		}
+
+		QuantizedBVHNode& Node = OutBVH.Nodes[NodeIndex];
+		for (uint8_t Axis = 0; Axis < 3; Axis++)
+		{
+			Node.Min[i][Axis] = 0;
+			Node.Max[i][Axis] = QUANTIZED_BVH_STEPS;
+		}
+		Node.Child[i] = Child;
+		Node.PrimitiveCount[i] = PrimitiveCount;
+	}
+	return NodeIndex;
+}
+
+/* Append the quantized node for the children of the binary node at NodeIndex, whose decoded box is DecodedBox */
+inline uint32_t QuantizeBVHNode(const LinearBVH& BVH, const uint32_t NodeIndex, const AABB& DecodedBox, QuantizedBVH& OutBVH)
+{
+	const uint32_t QuantizedIndex = static_cast<uint32_t>(OutBVH.Nodes.size());
+	OutBVH.Nodes.emplace_back();
+
+	// Children of a leaf root are the leaf itself and nothing
+	const LinearBVHNode& Node = BVH.Nodes[NodeIndex];
+	const uint32_t ChildCount = Node.IsLeaf() ? 1 : 2;
+
+	for (uint8_t i = 0; i < 2; i++)
+	{
+		if (i >= ChildCount)
+		{
+			OutBVH.Nodes[QuantizedIndex].Child[i] = 0;
+			OutBVH.Nodes[QuantizedIndex].PrimitiveCount[i] = 0;
+			EncodeQuantizedBox(DecodedBox, DecodedBox, i, OutBVH.Nodes[QuantizedIndex]);
+			continue;
+		}
+
+		const LinearBVHNode& Child = Node.IsLeaf() ? Node : BVH.Nodes[Node.Offset + i];
+		EncodeQuantizedBox(Child.Box, DecodedBox, i, OutBVH.Nodes[QuantizedIndex]);
+		const AABB ChildBox = DecodeQuantizedBox(OutBVH.Nodes[QuantizedIndex], i, DecodedBox);
+
+		// Appending children can reallocate the nodes, so the index is written only after the recursion
+		uint32_t ChildIndex = Child.Offset;
+		uint16_t PrimitiveCount = static_cast<uint16_t>(std::min(Child.PrimitiveCount, QUANTIZED_BVH_MAX_LEAF_PRIMITIVES));
+		if (!Child.IsLeaf())
+		{
+			ChildIndex = QuantizeBVHNode(BVH, Node.Offset + i, ChildBox, OutBVH);
+		}
+		else if (Child.PrimitiveCount > QUANTIZED_BVH_MAX_LEAF_PRIMITIVES)
+		{
+			ChildIndex = QuantizeLeafRange(Child.Offset, Child.PrimitiveCount, OutBVH);
+			PrimitiveCount = 0;
+		}
+
+		OutBVH.Nodes[QuantizedIndex].Child[i] = ChildIndex;
+		OutBVH.Nodes[QuantizedIndex].PrimitiveCount[i] = PrimitiveCount;
+	}
+
+	return QuantizedIndex;
+}
+
+/* Compress a binary BVH, nodes keep the depth-first order of the binary one */
+inline UniquePtr<QuantizedBVH> QuantizeBVH(const LinearBVH& BVH)
+{
+	auto Quantized = MakeUnique<QuantizedBVH>();
+	if (BVH.Nodes.empty()) return Quantized;
+
+	Quantized->RootBox = BVH.Nodes[0].Box;
+	Quantized->Nodes.reserve(BVH.Nodes.size() / 2 + 1);
+	QuantizeBVHNode(BVH, 0, Quantized->RootBox, *Quantized);
+
+	return Quantized;
+}
+
+/* Write the binary node at NodeIndex for a child of a quantized node, appending the nodes below it */
+inline void DequantizeBVHChild(const QuantizedBVH& BVH, const uint32_t Child, const uint16_t PrimitiveCount, const AABB& Box, const uint32_t NodeIndex, std::vector<LinearBVHNode>& OutNodes)
+{
+	OutNodes[NodeIndex].Box = Box;
+	if (PrimitiveCount > 0)
+	{
+		OutNodes[NodeIndex].Offset = Child;
+		OutNodes[NodeIndex].PrimitiveCount = PrimitiveCount;
+		return;
+	}
+
+	const uint32_t ChildIndex = static_cast<uint32_t>(OutNodes.size());
+	OutNodes.resize(OutNodes.size() + 2);
+	OutNodes[NodeIndex].Offset = ChildIndex;
+	OutNodes[NodeIndex].PrimitiveCount = 0;
+
+	const QuantizedBVHNode& Node = BVH.Nodes[Child];
+	for (uint8_t i = 0; i < 2; i++)
+	{
+		DequantizeBVHChild(BVH, Node.Child[i], Node.PrimitiveCount[i], DecodeQuantizedBox(Node, i, Box), ChildIndex + i, OutNodes);
+	}
+}
+
+/* 
+ * Binary nodes in depth-first order with the decoded boxes, which only ever contain more than the original ones.
+ * Leaves split by QuantizeLeafRange come back as several leaves.
+ */
+inline std::vector<LinearBVHNode> DequantizeBVH(const QuantizedBVH& BVH)
+{
+	std::vector<LinearBVHNode> Nodes;
+	if (BVH.Nodes.empty()) return Nodes;
+
+	Nodes.reserve(2 * BVH.Nodes.size() + 1);
+	Nodes.resize(1);
+
+	// Node 0 holds the children of the root, a single child is the root itself
+	const QuantizedBVHNode& Root = BVH.Nodes[0];
+	if (Root.HasChild(1)) DequantizeBVHChild(BVH, 0, 0, BVH.RootBox, 0, Nodes);
+	else DequantizeBVHChild(BVH, Root.Child[0], Root.PrimitiveCount[0], BVH.RootBox, 0, Nodes);
+
+	return Nodes;
+}
+
+/* Node or leaf waiting on the quantized traversal stack with its decoded box, PrimitiveCount is 0 for nodes */
+struct QuantizedBVHStackEntry
+{
+	uint32_t Index;
+	uint32_t PrimitiveCount;
+	double Distance;
+	AABB Box;
+};
+
+/* Closest hit traversal of the quantized BVH, see BVHTraverse */
+template<typename PrimitiveList>
+inline bool QuantizedBVHTraverse(const QuantizedBVH& BVH, const PrimitiveList& Primitives, const RRay& Ray, RPrimitiveHit& OutHit)
+{
+	if (BVH.Nodes.empty()) return false;
+
+	BVHTraversalStack<QuantizedBVHStackEntry> Stack;
+	BVHTraversalScope Stats;
+
+	RRay ClippedRay = Ray;
+	double RootDistance;
+	if (!BVH.RootBox.Intersects(ClippedRay, RootDistance)) return false;
+	Stack.Push({ 0, 0, RootDistance, BVH.RootBox });
+
+	bool bHit = false;
+
+	while (!Stack.IsEmpty())
+	{
+		const QuantizedBVHStackEntry Entry = Stack.Pop();
+
+		// A closer hit was found since this entry was pushed
+		if (Entry.Distance > ClippedRay.TMax) continue;
+
+		if (Entry.PrimitiveCount > 0)
+		{
+			Stats.PrimitiveTests += Entry.PrimitiveCount;
+			if (Primitives.IntersectsLeaf(Entry.Index, Entry.PrimitiveCount, ClippedRay, OutHit)) bHit = true;
+			continue;
+		}
+
+		const QuantizedBVHNode& Node = BVH.Nodes[Entry.Index];
+		Stats.NodeVisits++;
+
+		QuantizedBVHStackEntry Children[2];
+		bool bHitChild[2] = { false, false };
+		for (uint8_t i = 0; i < 2; i++)
+		{
+			if (!Node.HasChild(i)) continue;
+
+			Children[i] = { Node.Child[i], Node.PrimitiveCount[i], 0.0, DecodeQuantizedBox(Node, i, Entry.Box) };
+			bHitChild[i] = Children[i].Box.Intersects(ClippedRay, Children[i].Distance);
+		}
+
+		// Push the farther child first so the nearer one is processed next
+		const uint8_t Near = bHitChild[0] && bHitChild[1] && Children[1].Distance < Children[0].Distance ? 1 : 0;
+		if (bHitChild[1 - Near]) Stack.Push(Children[1 - Near]);
+		if (bHitChild[Near]) Stack.Push(Children[Near]);
+	}
+
+	return bHit;
+}
+
+/* Any hit traversal of the quantized BVH, see BVHOccluded */
+template<typename PrimitiveList>
+inline bool QuantizedBVHOccluded(const QuantizedBVH& BVH, const PrimitiveList& Primitives, const RRay& Ray, const double MaxDistance)
+{
+	if (BVH.Nodes.empty()) return false;
+
+	BVHTraversalStack<QuantizedBVHStackEntry> Stack;
+	BVHTraversalScope Stats;
+
+	RRay ClippedRay = Ray;
+	ClippedRay.TMax = std::min(Ray.TMax, MaxDistance);
+
+	double RootDistance;
+	if (!BVH.RootBox.Intersects(ClippedRay, RootDistance) || RootDistance >= ClippedRay.TMax) return false;
+	Stack.Push({ 0, 0, RootDistance, BVH.RootBox });
+
+	while (!Stack.IsEmpty())
+	{
+		const QuantizedBVHStackEntry Entry = Stack.Pop();
+
+		if (Entry.PrimitiveCount > 0)
+		{
+			Stats.PrimitiveTests += Entry.PrimitiveCount;
+			if (Primitives.OccludesLeaf(Entry.Index, Entry.PrimitiveCount, ClippedRay, ClippedRay.TMax)) return true;
+			continue;
+		}
+
+		const QuantizedBVHNode& Node = BVH.Nodes[Entry.Index];
+		Stats.NodeVisits++;
+
+		for (uint8_t i = 2; i-- > 0;)
+		{
+			if (!Node.HasChild(i)) continue;
+
+			QuantizedBVHStackEntry Child = { Node.Child[i], Node.PrimitiveCount[i], 0.0, DecodeQuantizedBox(Node, i, Entry.Box) };
+			if (Child.Box.Intersects(ClippedRay, Child.Distance) && Child.Distance < ClippedRay.TMax) Stack.Push(Child);
+		}
+	}
+
+	return false;
+}
@@ -0,0 +1,289 @@
+#pragma once
+
+#include <bit>
+#include <cmath>
+#include <algorithm>
+
+#include "Core.h"
+#include "AABB.h"
+#include "BVH.h"
+#include "WideBVH.h"
+
+/* Largest packet traced together, packets are cut from tiles of up to 4x4 pixels */
+constexpr uint32_t RAY_PACKET_MAX_SIZE = 16;
+static_assert(RAY_PACKET_MAX_SIZE <= 32, "The rays of a packet are addressed by 32-bit masks");
+
+/* Subtrees entered by fewer rays of a packet are traced by the single ray traversal */
+constexpr uint32_t RAY_PACKET_MIN_ACTIVE_RAYS = 2;
+
+/* Width and height of the pixel tile a packet of Size rays is made of, as square as possible */
+inline uint32_t GetRayPacketTileWidth(const uint32_t Size)
+{
+	return 1u << (std::bit_width(Size) / 2);
+}
+
+/*
+ * Up to Size rays traced together. Origins, inverse directions and ranges are also kept in SoA form for the SIMD
+ * slab test, lanes past Count have an empty range and never hit anything.
+ * Packets are coherent when all rays go in the same direction along every axis, only those share the near and far
+ * planes of every box and can be culled as a whole by the interval test.
+ */
+template<uint32_t Size>
+struct alignas(32) RayPacket
+{
+	static_assert(Size % 4 == 0 && Size <= 32, "Packets hold whole SIMD registers and are indexed by a 32-bit mask");
+
+	alignas(32) double OriginX[Size];
+	alignas(32) double OriginY[Size];
+	alignas(32) double OriginZ[Size];
+	alignas(32) double InvDirectionX[Size];
+	alignas(32) double InvDirectionY[Size];
+	alignas(32) double InvDirectionZ[Size];
+	alignas(32) double TMin[Size];
+	alignas(32) double TMax[Size];
+
+	RRay Rays[Size];
+	uint32_t Count;
+
+	bool bCoherent;
+	uint8_t Sign[3];
+
+	/* Bounds of the packet's origins, inverse directions and ranges */
+	AABB OriginBounds = AABB::Empty();
+	AABB InvDirectionBounds = AABB::Empty();
+	double MinTMin;
+	double MaxTMax;
+
+	RayPacket(const RRay* InRays, const uint32_t InCount) : Count(std::min(InCount, Size))
+	{
+		bCoherent = Count > 0;
+		for (uint8_t Axis = 0; Axis < 3; Axis++) Sign[Axis] = Count > 0 ? InRays[0].Sign[Axis] : 0;
+
+		MinTMin = INFINITY;
+
+		for (uint32_t i = 0; i < Size; i++)
+		{
+			const bool bActive = i < Count;
+			Rays[i] = bActive ? InRays[i] : InRays[0];
+
+			const RRay& Ray = Rays[i];
+			OriginX[i] = Ray.Origin.X;
+			OriginY[i] = Ray.Origin.Y;
+			OriginZ[i] = Ray.Origin.Z;
+			InvDirectionX[i] = Ray.InvDirection.X;
+			InvDirectionY[i] = Ray.InvDirection.Y;
+			InvDirectionZ[i] = Ray.InvDirection.Z;
+			TMin[i] = bActive ? Ray.TMin : 0.0;
+			TMax[i] = bActive ? Ray.TMax : -INFINITY;
+			if (!bActive) continue;
+
+			OriginBounds.Expand(Ray.Origin);
+			InvDirectionBounds.Expand(Ray.InvDirection);
+			MinTMin = std::min(MinTMin, Ray.TMin);
+
+			// Rays parallel to an axis have an infinite inverse, the interval test can't bound those
+			for (uint8_t Axis = 0; Axis < 3; Axis++)
+			{
+				bCoherent &= Ray.Sign[Axis] == Sign[Axis] && std::isfinite(Ray.InvDirection[Axis]);
+			}
+		}
+		UpdateMaxTMax();
+	}
+
+	uint32_t GetActiveMask() const
+	{
+		return Count == 32 ? ~0u : (1u << Count) - 1;
+	}
+
+	/* Shrink the range of ray Index to a hit found at Distance */
+	void ClipRay(const uint32_t Index, const double Distance)
+	{
+		Rays[Index].TMax = Distance;
+		TMax[Index] = Distance;
+		UpdateMaxTMax();
+	}
+
+	void UpdateMaxTMax()
+	{
+		MaxTMax = -INFINITY;
+		for (uint32_t i = 0; i < Count; i++) MaxTMax = std::max(MaxTMax, TMax[i]);
+	}
+
+	/*
+	 * Conservative test of the whole coherent packet against Box: the entry and exit distances of every ray
+	 * lie within the products of the origin and inverse direction intervals, if even those don't overlap no ray hits.
+	 */
+	bool MissesBox(const AABB& Box) const
+	{
+		double Near = MinTMin;
+		double Far = MaxTMax;
+		for (uint8_t Axis = 0; Axis < 3; Axis++)
+		{
+			const double NearPlane = Sign[Axis] ? Box.Max[Axis] : Box.Min[Axis];
+			const double FarPlane = Sign[Axis] ? Box.Min[Axis] : Box.Max[Axis];
+
+			const double InvMin = InvDirectionBounds.Min[Axis];
+			const double InvMax = InvDirectionBounds.Max[Axis];
+			Near = std::max(Near, IntervalProductMin(NearPlane - OriginBounds.Max[Axis], NearPlane - OriginBounds.Min[Axis], InvMin, InvMax));
+			Far = std::min(Far, IntervalProductMax(FarPlane - OriginBounds.Max[Axis], FarPlane - OriginBounds.Min[Axis], InvMin, InvMax));
+		}
+		return Near > Far;
+	}
+
+private:
+	static double IntervalProductMin(const double A0, const double A1, const double B0, const double B1)
+	{
+		return std::min(std::min(A0 * B0, A0 * B1), std::min(A1 * B0, A1 * B1));
+	}
+
+	static double IntervalProductMax(const double A0, const double A1, const double B0, const double B1)
+	{
+		return std::max(std::max(A0 * B0, A0 * B1), std::max(A1 * B0, A1 * B1));
+	}
+};
+
+/*
+ * Slab test of all rays of a coherent packet against Box, returns the mask of rays that hit it within their range.
+ * Operations and their order match AABB::Intersects, so every ray gets exactly the result of the single ray test.
+ */
+template<uint32_t Size>
+inline uint32_t IntersectPacket(const AABB& Box, const RayPacket<Size>& Packet)
+{
+	const double NearX = Packet.Sign[0] ? Box.Max.X : Box.Min.X;
+	const double NearY = Packet.Sign[1] ? Box.Max.Y : Box.Min.Y;
+	const double NearZ = Packet.Sign[2] ? Box.Max.Z : Box.Min.Z;
+	const double FarX = Packet.Sign[0] ? Box.Min.X : Box.Max.X;
+	const double FarY = Packet.Sign[1] ? Box.Min.Y : Box.Max.Y;
+	const double FarZ = Packet.Sign[2] ? Box.Min.Z : Box.Max.Z;
+
+	uint32_t Mask = 0;
+#if WIDE_BVH_AVX
+	for (uint32_t i = 0; i < Size; i += 4)
+	{
+		const __m256d OriginX = _mm256_load_pd(Packet.OriginX + i);
+		const __m256d OriginY = _mm256_load_pd(Packet.OriginY + i);
+		const __m256d OriginZ = _mm256_load_pd(Packet.OriginZ + i);
+		const __m256d InvX = _mm256_load_pd(Packet.InvDirectionX + i);
+		const __m256d InvY = _mm256_load_pd(Packet.InvDirectionY + i);
+		const __m256d InvZ = _mm256_load_pd(Packet.InvDirectionZ + i);
+
+		// max/min return their second operand when the first is NaN, so the accumulated distance goes second
+		__m256d Near = _mm256_load_pd(Packet.TMin + i);
+		Near = _mm256_max_pd(_mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(NearX), OriginX), InvX), Near);
+		Near = _mm256_max_pd(_mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(NearY), OriginY), InvY), Near);
+		Near = _mm256_max_pd(_mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(NearZ), OriginZ), InvZ), Near);
+
+		__m256d Far = _mm256_load_pd(Packet.TMax + i);
+		Far = _mm256_min_pd(_mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(FarX), OriginX), InvX), Far);
+		Far = _mm256_min_pd(_mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(FarY), OriginY), InvY), Far);
+		Far = _mm256_min_pd(_mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(FarZ), OriginZ), InvZ), Far);
+
+		Mask |= static_cast<uint32_t>(_mm256_movemask_pd(_mm256_cmp_pd(Near, Far, _CMP_LE_OQ))) << i;
+	}
+#elif WIDE_BVH_SSE
+	for (uint32_t i = 0; i < Size; i += 2)
+	{
+		const __m128d OriginX = _mm_load_pd(Packet.OriginX + i);
+		const __m128d OriginY = _mm_load_pd(Packet.OriginY + i);
+		const __m128d OriginZ = _mm_load_pd(Packet.OriginZ + i);
+		const __m128d InvX = _mm_load_pd(Packet.InvDirectionX + i);
+		const __m128d InvY = _mm_load_pd(Packet.InvDirectionY + i);
+		const __m128d InvZ = _mm_load_pd(Packet.InvDirectionZ + i);
+
+		// max/min return their second operand when the first is NaN, so the accumulated distance goes second
+		__m128d Near = _mm_load_pd(Packet.TMin + i);
+		Near = _mm_max_pd(_mm_mul_pd(_mm_sub_pd(_mm_set1_pd(NearX), OriginX), InvX), Near);
+		Near = _mm_max_pd(_mm_mul_pd(_mm_sub_pd(_mm_set1_pd(NearY), OriginY), InvY), Near);
+		Near = _mm_max_pd(_mm_mul_pd(_mm_sub_pd(_mm_set1_pd(NearZ), OriginZ), InvZ), Near);
+
+		__m128d Far = _mm_load_pd(Packet.TMax + i);
+		Far = _mm_min_pd(_mm_mul_pd(_mm_sub_pd(_mm_set1_pd(FarX), OriginX), InvX), Far);
+		Far = _mm_min_pd(_mm_mul_pd(_mm_sub_pd(_mm_set1_pd(FarY), OriginY), InvY), Far);
+		Far = _mm_min_pd(_mm_mul_pd(_mm_sub_pd(_mm_set1_pd(FarZ), OriginZ), InvZ), Far);
+
+		Mask |= static_cast<uint32_t>(_mm_movemask_pd(_mm_cmple_pd(Near, Far))) << i;
+	}
+#else
+	for (uint32_t i = 0; i < Size; i++)
+	{
+		if (Box.Intersects(Packet.Rays[i]) && Packet.TMin[i] <= Packet.TMax[i]) Mask |= 1u << i;
+	}
+#endif
+	return Mask & Packet.GetActiveMask();
+}
+
+/* Node waiting on the packet traversal stack with the rays that entered its parent */
+struct BVHPacketStackEntry
+{
+	uint32_t NodeIndex;
+	uint32_t Mask;
+};
+
+/*
+ * Closest hit traversal of a coherent packet. Every node is first culled against the whole packet with the interval test,
+ * then the rays still active are tested together and only those that hit it go on. Children are visited in the order
+ * given by the first active ray. Once fewer than RAY_PACKET_MIN_ACTIVE_RAYS remain, they finish the subtree alone.
+ * Returns the mask of rays that hit something, OutHits is only written for those.
+ */
+template<uint32_t Size, typename PrimitiveList>
+inline uint32_t BVHTraversePacket(const LinearBVH& BVH, const PrimitiveList& Primitives, RayPacket<Size>& Packet, RPrimitiveHit* OutHits)
+{
+	if (BVH.Nodes.empty() || !Packet.bCoherent) return 0;
+
+	BVHTraversalStack<BVHPacketStackEntry> Stack;
+	BVHTraversalScope Stats;
+	Stack.Push({ 0, Packet.GetActiveMask() });
+
+	uint32_t HitMask = 0;
+	while (!Stack.IsEmpty())
+	{
+		const BVHPacketStackEntry Entry = Stack.Pop();
+
+		const LinearBVHNode& Node = BVH.Nodes[Entry.NodeIndex];
+		if (Packet.MissesBox(Node.Box)) continue;
+
+		uint32_t Mask = IntersectPacket(Node.Box, Packet) & Entry.Mask;
+		if (!Mask) continue;
+		Stats.NodeVisits++;
+
+		if (static_cast<uint32_t>(std::popcount(Mask)) < RAY_PACKET_MIN_ACTIVE_RAYS)
+		{
+			for (; Mask; Mask &= Mask - 1)
+			{
+				const uint32_t i = std::countr_zero(Mask);
+				RPrimitiveHit TempHit;
+				if (BVHTraverse(BVH, Primitives, Packet.Rays[i], TempHit, Entry.NodeIndex) && TempHit.Depth < Packet.TMax[i])
+				{
+					OutHits[i] = TempHit;
+					HitMask |= 1u << i;
+					Packet.ClipRay(i, TempHit.Depth);
+				}
+			}
+			continue;
+		}
+
+		if (!Node.IsLeaf())
+		{
+			// Push the farther child first so the nearer one is processed next
+			const Vector3 ChildDelta = BVH.Nodes[Node.Offset + 1].Box.GetPosition() - BVH.Nodes[Node.Offset].Box.GetPosition();
+			const uint32_t Near = (ChildDelta | Packet.Rays[std::countr_zero(Mask)].Direction) < 0.0 ? 1 : 0;
+			Stack.Push({ Node.Offset + 1 - Near, Mask });
+			Stack.Push({ Node.Offset + Near, Mask });
+			continue;
+		}
+
+		for (uint32_t j = Node.Offset; j < Node.Offset + Node.PrimitiveCount; j++)
+		{
+			Stats.PrimitiveTests += std::popcount(Mask);
+			const uint32_t PrimitiveHits = Primitives.IntersectsPacket(j, Packet.Rays, Mask, OutHits);
+			for (uint32_t RayMask = PrimitiveHits; RayMask; RayMask &= RayMask - 1)
+			{
+				const uint32_t i = std::countr_zero(RayMask);
+				Packet.ClipRay(i, OutHits[i].Depth);
+			}
+			HitMask |= PrimitiveHits;
+		}
+	}
+
+	return HitMask;
+}
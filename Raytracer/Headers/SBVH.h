@@ -0,0 +1,372 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include "Core.h"
+#include "AABB.h"
+#include "OObject.h"
+#include "BVH.h"
+
+/*
+ * Spatial split BVH builder (Stich et al., "Spatial Splits in Bounding Volume Hierarchies").
+ * Besides object splits it considers splitting space itself, primitives crossing the plane are then referenced
+ * from both children with their boxes clipped to each side. This removes most of the overlap big slanted triangles
+ * cause, at the cost of duplicated references and a slower, single threaded build.
+ */
+
+/* Spatial splits are only tried where the object split children overlap by more than this fraction of the root area */
+constexpr double BVH_SPATIAL_SPLIT_ALPHA = 1e-5;
+
+/* Number of bins along every axis of the node box for spatial splits */
+constexpr uint32_t BVH_SPATIAL_BINS = 32;
+
+/* Below this depth only object splits are used, so thin clipped references can't recurse forever */
+constexpr uint32_t BVH_SPATIAL_SPLIT_MAX_DEPTH = 48;
+
+/* One reference to a primitive, Box may cover only the part of it left after spatial splits */
+struct BVHReference
+{
+	AABB Box;
+	uint32_t PrimitiveIndex;
+};
+
+/* Bin of the spatial split search, references are counted in the bins where they start and end */
+struct BVHSpatialBin
+{
+	AABB Box = AABB::Empty();
+	uint32_t Enter = 0;
+	uint32_t Exit = 0;
+};
+
+/* Best split of a node, Position is the split plane for spatial splits and the last left bin for object splits */
+struct BVHSpatialSplit
+{
+	int32_t Axis = -1;
+	bool bSpatial = false;
+	double Position = 0.0;
+	uint32_t Bin = 0;
+	double Cost = DBL_MAX;
+	AABB LeftBox;
+	AABB RightBox;
+};
+
+struct SBVHBuildState
+{
+	const std::vector<SharedPtr<RPrimitive>>& Primitives;
+	LinearBVH& BVH;
+
+	/* Overlap area above which spatial splits are tried, BVH_SPATIAL_SPLIT_ALPHA times the root area */
+	double MinOverlapArea;
+
+	SBVHBuildState(const std::vector<SharedPtr<RPrimitive>>& InPrimitives, LinearBVH& InBVH)
+		: Primitives(InPrimitives), BVH(InBVH), MinOverlapArea(0.0) {}
+};
+
+inline Vector3 WithComponent(const Vector3& V, const uint8_t Axis, const double Value)
+{
+	return Vector3(Axis == 0 ? Value : V.X, Axis == 1 ? Value : V.Y, Axis == 2 ? Value : V.Z);
+}
+
+/* Binned SAH object split over the reference centroids, like FindBestSplit */
+inline BVHSpatialSplit FindObjectSplit(const std::vector<BVHReference>& References, const AABB& CentroidBox)
+{
+	BVHSpatialSplit Best;
+
+	for (uint8_t Axis = 0; Axis < 3; Axis++)
+	{
+		const BVHBinMapping Mapping(CentroidBox, Axis);
+		if (!Mapping.IsValid()) continue;
+
+		BVHBin Bins[BVH_SAH_BINS];
+		for (const BVHReference& Reference : References)
+		{
+			BVHBin& Bin = Bins[Mapping.GetBin(Reference.Box.GetPosition())];
+			Bin.Box.Expand(Reference.Box);
+			Bin.Count++;
+		}
+
+		AABB RightBoxes[BVH_SAH_BINS];
+		uint32_t RightCount[BVH_SAH_BINS];
+		AABB RightBox = AABB::Empty();
+		uint32_t Count = 0;
+		for (uint32_t i = BVH_SAH_BINS - 1; i > 0; i--)
+		{
+			RightBox.Expand(Bins[i].Box);
+			Count += Bins[i].Count;
+			RightBoxes[i] = RightBox;
+			RightCount[i] = Count;
+		}
+
+		AABB LeftBox = AABB::Empty();
+		Count = 0;
+		for (uint32_t i = 0; i < BVH_SAH_BINS - 1; i++)
+		{
+			LeftBox.Expand(Bins[i].Box);
+			Count += Bins[i].Count;
+			if (Count == 0 || RightCount[i + 1] == 0) continue;
+
+			const double Cost = LeftBox.Area() * Count + RightBoxes[i + 1].Area() * RightCount[i + 1];
+			if (Cost < Best.Cost)
+			{
+				Best.Cost = Cost;
+				Best.Axis = Axis;
+				Best.bSpatial = false;
+				Best.Bin = i;
+				Best.LeftBox = LeftBox;
+				Best.RightBox = RightBoxes[i + 1];
+			}
+		}
+	}
+
+	return Best;
+}
+
+/*
+ * Binned spatial split search inside the node box. A reference is clipped to every bin it crosses, and it is
+ * counted as entering its first bin and exiting its last, so the sweep knows how many references each side gets.
+ */
+inline BVHSpatialSplit FindSpatialSplit(const SBVHBuildState& State, const std::vector<BVHReference>& References, const AABB& NodeBox)
+{
+	BVHSpatialSplit Best;
+
+	for (uint8_t Axis = 0; Axis < 3; Axis++)
+	{
+		const double Min = NodeBox.Min[Axis];
+		const double Extent = NodeBox.Max[Axis] - Min;
+		if (Extent < 1e-9) continue;
+
+		const double BinWidth = Extent / BVH_SPATIAL_BINS;
+		auto GetBin = [Min, BinWidth](const double Value)
+		{
+			return std::min(static_cast<uint32_t>(std::max((Value - Min) / BinWidth, 0.0)), BVH_SPATIAL_BINS - 1);
+		};
+
+		BVHSpatialBin Bins[BVH_SPATIAL_BINS];
+		for (const BVHReference& Reference : References)
+		{
+			const uint32_t FirstBin = GetBin(Reference.Box.Min[Axis]);
+			const uint32_t LastBin = GetBin(Reference.Box.Max[Axis]);
+			Bins[FirstBin].Enter++;
+			Bins[LastBin].Exit++;
+
+			if (FirstBin == LastBin)
+			{
+				Bins[FirstBin].Box.Expand(Reference.Box);
+				continue;
+			}
+
+			for (uint32_t i = FirstBin; i <= LastBin; i++)
+			{
+				AABB Slab = Reference.Box;
+				if (i > FirstBin) Slab.Min = WithComponent(Slab.Min, Axis, Min + BinWidth * i);
+				if (i < LastBin) Slab.Max = WithComponent(Slab.Max, Axis, Min + BinWidth * (i + 1));
+				Bins[i].Box.Expand(State.Primitives[Reference.PrimitiveIndex]->GetClippedBoundingBox(Slab));
+			}
+		}
+
+		AABB RightBoxes[BVH_SPATIAL_BINS];
+		uint32_t RightCount[BVH_SPATIAL_BINS];
+		AABB RightBox = AABB::Empty();
+		uint32_t Count = 0;
+		for (uint32_t i = BVH_SPATIAL_BINS - 1; i > 0; i--)
+		{
+			RightBox.Expand(Bins[i].Box);
+			Count += Bins[i].Exit;
+			RightBoxes[i] = RightBox;
+			RightCount[i] = Count;
+		}
+
+		AABB LeftBox = AABB::Empty();
+		Count = 0;
+		for (uint32_t i = 0; i < BVH_SPATIAL_BINS - 1; i++)
+		{
+			LeftBox.Expand(Bins[i].Box);
+			Count += Bins[i].Enter;
+			if (Count == 0 || RightCount[i + 1] == 0) continue;
+
+			const double Cost = LeftBox.Area() * Count + RightBoxes[i + 1].Area() * RightCount[i + 1];
+			if (Cost < Best.Cost)
+			{
+				Best.Cost = Cost;
+				Best.Axis = Axis;
+				Best.bSpatial = true;
+				Best.Position = Min + BinWidth * (i + 1);
+				Best.LeftBox = LeftBox;
+				Best.RightBox = RightBoxes[i + 1];
+			}
+		}
+	}
+
+	return Best;
+}
+
+/*
+ * Distribute the references along a spatial split. References crossing the plane are split in two,
+ * unless moving them to one side entirely is cheaper ("reference unsplitting").
+ */
+inline void PartitionSpatial(const SBVHBuildState& State, const std::vector<BVHReference>& References, const BVHSpatialSplit& Split,
+	std::vector<BVHReference>& OutLeft, std::vector<BVHReference>& OutRight)
+{
+	const uint8_t Axis = static_cast<uint8_t>(Split.Axis);
+
+	AABB LeftBox = Split.LeftBox;
+	AABB RightBox = Split.RightBox;
+	std::vector<const BVHReference*> Straddling;
+
+	for (const BVHReference& Reference : References)
+	{
+		if (Reference.Box.Max[Axis] <= Split.Position) OutLeft.push_back(Reference);
+		else if (Reference.Box.Min[Axis] >= Split.Position) OutRight.push_back(Reference);
+		else Straddling.push_back(&Reference);
+	}
+	uint32_t LeftCount = static_cast<uint32_t>(OutLeft.size() + Straddling.size());
+	uint32_t RightCount = static_cast<uint32_t>(OutRight.size() + Straddling.size());
+
+	for (const BVHReference* Reference : Straddling)
+	{
+		AABB UnsplitLeft = LeftBox;
+		UnsplitLeft.Expand(Reference->Box);
+		AABB UnsplitRight = RightBox;
+		UnsplitRight.Expand(Reference->Box);
+
+		const double SplitCost = LeftBox.Area() * LeftCount + RightBox.Area() * RightCount;
+		const double LeftOnlyCost = UnsplitLeft.Area() * LeftCount + RightBox.Area() * (RightCount - 1);
+		const double RightOnlyCost = LeftBox.Area() * (LeftCount - 1) + UnsplitRight.Area() * RightCount;
+
+		if (LeftOnlyCost < SplitCost && LeftOnlyCost <= RightOnlyCost)
+		{
+			OutLeft.push_back(*Reference);
+			LeftBox = UnsplitLeft;
+			RightCount--;
+			continue;
+		}
+		if (RightOnlyCost < SplitCost)
+		{
+			OutRight.push_back(*Reference);
+			RightBox = UnsplitRight;
+			LeftCount--;
+			continue;
+		}
+
+		const RPrimitive* Primitive = State.Primitives[Reference->PrimitiveIndex].get();
+
+		AABB LeftClip = Reference->Box;
+		LeftClip.Max = WithComponent(LeftClip.Max, Axis, Split.Position);
+		const AABB LeftPart = Primitive->GetClippedBoundingBox(LeftClip);
+		if (LeftPart.IsValid()) OutLeft.push_back({ LeftPart, Reference->PrimitiveIndex });
+
+		AABB RightClip = Reference->Box;
+		RightClip.Min = WithComponent(RightClip.Min, Axis, Split.Position);
+		const AABB RightPart = Primitive->GetClippedBoundingBox(RightClip);
+		if (RightPart.IsValid()) OutRight.push_back({ RightPart, Reference->PrimitiveIndex });
+	}
+}
+
+/* Build the subtree over References into the node at NodeIndex, children are appended as sibling pairs in depth-first order */
+inline void BuildSBVHRecursive(SBVHBuildState& State, std::vector<BVHReference>& References, const uint32_t NodeIndex, const uint32_t Depth)
+{
+	AABB Box = AABB::Empty();
+	AABB CentroidBox = AABB::Empty();
+	for (const BVHReference& Reference : References)
+	{
+		Box.Expand(Reference.Box);
+		CentroidBox.Expand(Reference.Box.GetPosition());
+	}
+	State.BVH.Nodes[NodeIndex].Box = Box;
+
+	const uint32_t Count = static_cast<uint32_t>(References.size());
+
+	BVHSpatialSplit Split;
+	if (Count >= BVH_MIN_SPLIT_PRIMITIVES)
+	{
+		Split = FindObjectSplit(References, CentroidBox);
+
+		AABB Overlap = Split.LeftBox;
+		Overlap.Clip(Split.RightBox);
+		if (Depth < BVH_SPATIAL_SPLIT_MAX_DEPTH && (Split.Axis == -1 || (Overlap.IsValid() && Overlap.Area() > State.MinOverlapArea)))
+		{
+			const BVHSpatialSplit SpatialSplit = FindSpatialSplit(State, References, Box);
+			if (SpatialSplit.Cost < Split.Cost) Split = SpatialSplit;
+		}
+	}
+
+	std::vector<BVHReference> Left, Right;
+	if (Split.Axis != -1 && Split.Cost < Count * Box.Area())
+	{
+		if (Split.bSpatial)
+		{
+			PartitionSpatial(State, References, Split, Left, Right);
+		}
+		else
+		{
+			const BVHBinMapping Mapping(CentroidBox, static_cast<uint8_t>(Split.Axis));
+			for (const BVHReference& Reference : References)
+			{
+				(Mapping.GetBin(Reference.Box.GetPosition()) <= Split.Bin ? Left : Right).push_back(Reference);
+			}
+		}
+	}
+
+	// No split beats the leaf cost, or clipping left one side empty
+	if (Left.empty() || Right.empty())
+	{
+		LinearBVHNode& Leaf = State.BVH.Nodes[NodeIndex];
+		Leaf.Offset = static_cast<uint32_t>(State.BVH.Primitives.size());
+		Leaf.PrimitiveCount = Count;
+		for (const BVHReference& Reference : References)
+		{
+			State.BVH.Primitives.push_back(State.Primitives[Reference.PrimitiveIndex]);
+			State.BVH.PrimitiveIndices.push_back(Reference.PrimitiveIndex);
+		}
+		return;
+	}
+
+	// Release the parent's references before going deeper, the tree can hold many more than there are primitives
+	std::vector<BVHReference>().swap(References);
+
+	const uint32_t ChildIndex = static_cast<uint32_t>(State.BVH.Nodes.size());
+	State.BVH.Nodes.resize(State.BVH.Nodes.size() + 2);
+	State.BVH.Nodes[NodeIndex].Offset = ChildIndex;
+	State.BVH.Nodes[NodeIndex].PrimitiveCount = 0;
+
+	BuildSBVHRecursive(State, Left, ChildIndex, Depth + 1);
+	BuildSBVHRecursive(State, Right, ChildIndex + 1, Depth + 1);
+}
+
+/* Build a spatial split BVH, leaves can share primitives so LinearBVH::Primitives may hold some of them more than once */
+inline UniquePtr<LinearBVH> CreateSBVH(const std::vector<SharedPtr<RPrimitive>>& Primitives)
+{
+	auto BVH = MakeUnique<LinearBVH>();
+
+	if (Primitives.empty()) return BVH;
+
+	const int32_t PrimitiveCount = static_cast<int32_t>(Primitives.size());
+	std::vector<BVHReference> References(PrimitiveCount);
+
+	#pragma omp parallel for
+	for (int32_t i = 0; i < PrimitiveCount; i++)
+	{
+		References[i].Box = Primitives[i]->GetBoundingBox();
+		References[i].PrimitiveIndex = i;
+	}
+
+	AABB RootBox = AABB::Empty();
+	for (const BVHReference& Reference : References)
+	{
+		RootBox.Expand(Reference.Box);
+	}
+
+	SBVHBuildState State(Primitives, *BVH);
+	State.MinOverlapArea = BVH_SPATIAL_SPLIT_ALPHA * RootBox.Area();
+
+	BVH->Nodes.reserve(2 * PrimitiveCount);
+	BVH->Nodes.resize(1);
+	BVH->Primitives.reserve(PrimitiveCount);
+	BVH->PrimitiveIndices.reserve(PrimitiveCount);
+	BuildSBVHRecursive(State, References, 0, 0);
+
+	BVH->BuildCost = ComputeSAHCost(*BVH);
+
+	return BVH;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+/* Compiler and CPU support shared by the SIMD kernels, every kernel also has a scalar version for other targets */
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#else
+#define SIMD_X86 0
+#endif
+
+/* MSVC compiles any intrinsic without extra flags, GCC and Clang need the instruction set enabled per function */
+#if SIMD_X86 && !defined(_MSC_VER)
+#define SIMD_TARGET_AVX __attribute__((target("avx")))
+#else
+#define SIMD_TARGET_AVX
+#endif
+
+
+#if SIMD_X86
+/* AVX needs the CPU to support it and the OS to save the YMM registers on context switches */
+inline bool SupportsAVX()
+{
+#if defined(_MSC_VER)
+	int Info[4];
+	__cpuid(Info, 1);
+	const bool bAVX = (Info[2] & (1 << 28)) != 0;
+	const bool bOSXSAVE = (Info[2] & (1 << 27)) != 0;
+	return bAVX && bOSXSAVE && (_xgetbv(0) & 0x6) == 0x6;
+#else
+	return __builtin_cpu_supports("avx");
+#endif
+}
+#endif // SIMD_X86
@@ -2,6 +2,7 @@
 #include <cassert>
 #include <cstdint>
 #include <vector>
+#include <string>
 
 
 #include "Core.h"
@@ -15,6 +16,39 @@ class RLight;
 class RPrimitive;
 class BRDF;
 class RShader;
+template<uint32_t Width> struct WideBVH;
+struct QuantizedBVH;
+struct ScenePrimitives;
+struct BVHReport;
+
+
+/* Acceleration structure variants QueryScene can traverse */
+enum class BVHLayout : uint8_t
+{
+	Binary,
+	Wide4,
+	Wide8,
+
+	/* Binary BVH with 8-bit child bounds, mesh BVHs are compressed as well and their full precision nodes released */
+	Quantized
+};
+
+/* Algorithms that can build the BVH */
+enum class BVHBuilder : uint8_t
+{
+	BinnedSAH,
+	Morton,
+	MortonTreelet,
+	SpatialSAH
+};
+
+/* Memory order of the nodes of built BVHs, see BVHNodeOrder.h */
+enum class BVHNodeOrder : uint8_t
+{
+	DepthFirst,
+	VanEmdeBoas,
+	Treelets
+};
 
 
 class RScene
@@ -28,6 +62,24 @@ public:
 	uint8_t SamplesSSAA;
 	double FOV;
 
+	/* BVH variant built and traversed by the next Render call */
+	BVHLayout Layout;
+
+	/* Algorithm used for the scene BVH and the BVHs of meshes that don't have one yet */
+	BVHBuilder Builder;
+
+	/* Node order applied to the scene and mesh BVHs after they are built */
+	BVHNodeOrder NodeOrder;
+
+	/* Mesh BVHs are cached here between runs, empty to always build them */
+	std::string BVHCacheDirectory;
+
+	/* JSON report of the BVHs and their traversal counters is written here after every Render, empty to skip it */
+	std::string BVHStatisticsFile;
+
+	/* Primary rays of a pixel tile traced together by Render, 4, 8 or 16 rays, 1 traces every ray alone */
+	uint8_t PacketSize;
+
 private:	
 	
 	/* HDR output of the scene render */
@@ -48,7 +100,23 @@ private:
 	mutable uint64_t TotalRaysShooted = 0;
 
 #if USE_BVH
-	UniquePtr<class BVHNodeBase> BVHRoot = nullptr;
+	/* Scene objects that aren't bounded, they are tested by every query next to the BVH */
+	std::vector<SharedPtr<RPrimitive>> UnboundedObjects;
+
+	/* Kept next to the wide and quantized copies, it has a node per object and is refit every update */
+	UniquePtr<struct LinearBVH> SceneBVH = nullptr;
+	UniquePtr<WideBVH<4>> SceneBVH4 = nullptr;
+	UniquePtr<WideBVH<8>> SceneBVH8 = nullptr;
+	UniquePtr<QuantizedBVH> SceneQuantizedBVH = nullptr;
+
+	/* Settings the current BVHs were made with, UpdateBVH redoes whatever they no longer match */
+	BVHLayout BuiltLayout = BVHLayout::Binary;
+	BVHBuilder BuiltBuilder = BVHBuilder::BinnedSAH;
+	BVHNodeOrder BuiltNodeOrder = BVHNodeOrder::DepthFirst;
+
+	/* Primitives of the BVH in leaf order and the unbounded objects, grouped by type for the queries */
+	UniquePtr<ScenePrimitives> BVHPrimitives = nullptr;
+	UniquePtr<ScenePrimitives> UnboundedPrimitives = nullptr;
 #endif // USE_BVH
 
 	
@@ -63,10 +131,26 @@ public:
 	
 	void Render();
 
+	/* 
+	 * Trace the primary rays of the camera Repetitions times with every BVHNodeOrder and log the best rays per second of each.
+	 * The BVHs are left in NodeOrder.
+	 */
+	void BenchmarkNodeOrders(const uint32_t Repetitions = 3);
+
 	void SetEnvironmentTexture(SharedPtr<RTexture>& Texture);
 
 	bool QueryScene(const RRay& Ray, RHit& OutHit) const;
 
+	/*
+	 * QueryScene for up to RAY_PACKET_MAX_SIZE rays, returns the mask of rays that hit something.
+	 * Count must not be larger, callers with more rays split them into packets of that size. Release builds trace only the first RAY_PACKET_MAX_SIZE rays otherwise.
+	 * Coherent rays are traced as a packet through the binary BVH, others and other layouts are traced one by one.
+	 */
+	uint32_t QueryScenePacket(const RRay* Rays, const uint32_t Count, RHit* OutHits) const;
+
+	/* Shadow ray query, true if anything except IgnoredObject is hit closer than MaxDistance */
+	bool QueryOcclusion(const RRay& Ray, const double MaxDistance, const RPrimitive* IgnoredObject = nullptr) const;
+
 	void SetShader(UniquePtr<RShader> InShader);
 
 	void SetBRDF(UniquePtr<BRDF> InBRDF);
@@ -78,11 +162,33 @@ private:
 
 #if USE_BVH
 	void BuildBVH();
+
+	/* 
+	 * Refit the existing BVH to moved primitives. It is built from scratch if there is none, the refit one got too slow
+	 * or Builder or NodeOrder changed, and collapsed again if Layout changed.
+	 */
+	void UpdateBVH();
+
+	/* Copy the primitives into the type grouped arrays the queries traverse, needed whenever they moved */
+	void CompileScenePrimitives();
+
+	/* Rebuild the wide or quantized BVH selected by Layout from the binary one */
+	void CollapseSceneBVH();
+
+	/* Lay out the scene BVH and the BVHs of all meshes in Order */
+	void ReorderSceneBVHNodes(const BVHNodeOrder Order);
+
+	/* Statistics of the scene and mesh BVHs together with the current traversal counters */
+	BVHReport MakeBVHReport() const;
 #endif // USE_BVH
 
 	
 	
-	RColor RenderPixel(const RRay& Ray) const;
+	/* Camera ray through the screen position X, Y given in pixels */
+	RRay GetPrimaryRay(const double X, const double Y) const;
+
+	/* Trace Rays together and add their colors to OutColors */
+	void RenderPacket(const RRay* Rays, const uint32_t Count, RColor* OutColors) const;
 
 	friend class RShader;
 };
\ No newline at end of file
@@ -0,0 +1,383 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "Core.h"
+#include "Transform.h"
+#include "OObject.h"
+#include "SphereGroup.h"
+
+
+/*
+ * Ray tests of the basic shapes, shared by their RPrimitive classes and by the type grouped scene primitives below.
+ * The ray is in the space of the shape with a normalized direction, unless the shape's transform is passed along.
+ * The sphere test itself is GetSphereDistance in SphereGroup.h.
+ */
+
+/* Rotating a sphere doesn't change it, so without scale its object space test is the world space one */
+inline bool IsUnscaled(const RTransform& Transform)
+{
+	return Transform.GetScale() == Vector3(1.0);
+}
+
+/* 
+ * Distance to a sphere of Radius placed with Transform, along the ray moved into the space of the sphere.
+ * That is the depth spheres report, which differs from the world space one if Transform scales.
+ */
+inline bool GetPlacedSphereDistance(const RTransform& Transform, const double Radius, const RRay& Ray, double& OutDistance, bool& bOutInside)
+{
+	if (IsUnscaled(Transform)) return GetSphereDistance(Ray.Origin - Transform.GetPosition(), Ray.Direction, Radius, OutDistance, bOutInside);
+
+	const Vector3 LocalDirection = Transform.InverseTransformVector(Ray.Direction).Normalized();
+	const Vector3 LocalOrigin = Transform.InverseTransformPosition(Ray.Origin);
+	return GetSphereDistance(LocalOrigin, LocalDirection, Radius, OutDistance, bOutInside);
+}
+
+/* GetPlacedSphereDistance with the distance measured in world space, as sphere lights report it */
+inline bool GetPlacedSphereWorldDistance(const RTransform& Transform, const double Radius, const RRay& Ray, double& OutDistance, bool& bOutInside)
+{
+	if (IsUnscaled(Transform)) return GetSphereDistance(Ray.Origin - Transform.GetPosition(), Ray.Direction, Radius, OutDistance, bOutInside);
+
+	const Vector3 LocalDirection = Transform.InverseTransformVector(Ray.Direction).Normalized();
+	const Vector3 LocalOrigin = Transform.InverseTransformPosition(Ray.Origin);
+
+	double LocalDistance;
+	if (!GetSphereDistance(LocalOrigin, LocalDirection, Radius, LocalDistance, bOutInside)) return false;
+
+	OutDistance = (Transform.TransformPosition(LocalOrigin + LocalDirection * LocalDistance) - Ray.Origin).Length();
+	return true;
+}
+
+/* Distance along the ray to a plane through Position, false if the ray is parallel to it or hits it closer than 1e-5 */
+inline bool GetPlaneDistance(const Vector3& Position, const Vector3& Normal, const RRay& Ray, double& OutDistance)
+{
+	const double Denom = Normal | Ray.Direction;
+	if (std::abs(Denom) <= 1e-10) return false;
+
+	OutDistance = ((Position - Ray.Origin) | Normal) / Denom;
+	return OutDistance >= 1e-5;
+}
+
+
+/* Kinds of primitives the scene traversals test without virtual calls, every other kind is Other */
+enum class ScenePrimitiveType : uint8_t
+{
+	Sphere,
+	SphereLight,
+	Plane,
+	MeshInstance,
+	Other
+};
+
+/* Entry Index of the array of Type */
+struct ScenePrimitiveRef
+{
+	ScenePrimitiveType Type;
+	uint32_t Index;
+};
+
+/*
+ * Unscaled spheres or sphere lights as world space centers and radii, one array per component.
+ * Object is the primitive the sphere was copied from and is reported in hits.
+ */
+struct SceneSpheres
+{
+	std::vector<double> X;
+	std::vector<double> Y;
+	std::vector<double> Z;
+	std::vector<double> Radius;
+	std::vector<const RPrimitive*> Objects;
+
+	void Add(const Vector3& Center, const double InRadius, const RPrimitive* Object)
+	{
+		X.push_back(Center.X);
+		Y.push_back(Center.Y);
+		Z.push_back(Center.Z);
+		Radius.push_back(InRadius);
+		Objects.push_back(Object);
+	}
+
+	void Clear()
+	{
+		X.clear();
+		Y.clear();
+		Z.clear();
+		Radius.clear();
+		Objects.clear();
+	}
+
+	/* Closest hit among Count spheres from First, every closer hit is written to OutHit and shrinks the TMax of ClippedRay */
+	bool Intersects(const uint32_t First, const uint32_t Count, RRay& ClippedRay, RPrimitiveHit& OutHit) const
+	{
+		bool bHit = false;
+		for (uint32_t i = First; i < First + Count; i++)
+		{
+			double Distance;
+			bool bInside;
+			if (!GetSphereDistance(ClippedRay.Origin - Vector3(X[i], Y[i], Z[i]), ClippedRay.Direction, Radius[i], Distance, bInside)) continue;
+			if (!(Distance >= ClippedRay.TMin && Distance < ClippedRay.TMax)) continue;
+
+			OutHit.Object = Objects[i];
+			OutHit.Part = bInside;
+			OutHit.Depth = Distance;
+			ClippedRay.TMax = Distance;
+			bHit = true;
+		}
+		return bHit;
+	}
+
+	/* True if one of Count spheres from First except IgnoredObject is hit closer than MaxDistance, and within the ray's range if bInRayRange */
+	bool Occludes(const uint32_t First, const uint32_t Count, const RRay& Ray, const double MaxDistance, const bool bInRayRange, const RPrimitive* IgnoredObject) const
+	{
+		for (uint32_t i = First; i < First + Count; i++)
+		{
+			double Distance;
+			bool bInside;
+			if (!GetSphereDistance(Ray.Origin - Vector3(X[i], Y[i], Z[i]), Ray.Direction, Radius[i], Distance, bInside)) continue;
+			if (Distance < MaxDistance && (!bInRayRange || Ray.InRange(Distance)) && Objects[i] != IgnoredObject) return true;
+		}
+		return false;
+	}
+};
+
+/* Planes as world space positions and normals, one array per component, like SceneSpheres */
+struct ScenePlanes
+{
+	std::vector<double> X;
+	std::vector<double> Y;
+	std::vector<double> Z;
+	std::vector<double> NormalX;
+	std::vector<double> NormalY;
+	std::vector<double> NormalZ;
+	std::vector<const RPrimitive*> Objects;
+
+	void Add(const Vector3& Position, const Vector3& Normal, const RPrimitive* Object)
+	{
+		X.push_back(Position.X);
+		Y.push_back(Position.Y);
+		Z.push_back(Position.Z);
+		NormalX.push_back(Normal.X);
+		NormalY.push_back(Normal.Y);
+		NormalZ.push_back(Normal.Z);
+		Objects.push_back(Object);
+	}
+
+	void Clear()
+	{
+		X.clear();
+		Y.clear();
+		Z.clear();
+		NormalX.clear();
+		NormalY.clear();
+		NormalZ.clear();
+		Objects.clear();
+	}
+
+	bool Intersects(const uint32_t First, const uint32_t Count, RRay& ClippedRay, RPrimitiveHit& OutHit) const
+	{
+		bool bHit = false;
+		for (uint32_t i = First; i < First + Count; i++)
+		{
+			double Distance;
+			if (!GetPlaneDistance(Vector3(X[i], Y[i], Z[i]), Vector3(NormalX[i], NormalY[i], NormalZ[i]), ClippedRay, Distance)) continue;
+			if (!(Distance >= ClippedRay.TMin && Distance < ClippedRay.TMax)) continue;
+
+			OutHit.Object = Objects[i];
+			OutHit.Depth = Distance;
+			ClippedRay.TMax = Distance;
+			bHit = true;
+		}
+		return bHit;
+	}
+
+	bool Occludes(const uint32_t First, const uint32_t Count, const RRay& Ray, const double MaxDistance, const RPrimitive* IgnoredObject) const
+	{
+		for (uint32_t i = First; i < First + Count; i++)
+		{
+			double Distance;
+			if (!GetPlaneDistance(Vector3(X[i], Y[i], Z[i]), Vector3(NormalX[i], NormalY[i], NormalZ[i]), Ray, Distance)) continue;
+			if (Distance < MaxDistance && Objects[i] != IgnoredObject) return true;
+		}
+		return false;
+	}
+};
+
+struct SceneMeshInstance
+{
+	RTransform Transform;
+	const OMesh* Mesh;
+	const RPrimitive* Object;
+};
+
+/*
+ * Copy of a list of scene primitives grouped into one array per type, the traversal side of the RPrimitive objects.
+ * Reference i is the i-th primitive of the list it was compiled from, so BVH leaf ranges carry over unchanged.
+ * Consecutive references of one type are consecutive entries of its array, so a leaf is tested as runs of one type.
+ * It has to be compiled again whenever the primitives move.
+ */
+struct ScenePrimitives
+{
+	std::vector<ScenePrimitiveRef> References;
+
+	SceneSpheres Spheres;
+	SceneSpheres SphereLights;
+	ScenePlanes Planes;
+	std::vector<SceneMeshInstance> MeshInstances;
+
+	/* Primitives of other types, and scaled spheres, are still called through RPrimitive */
+	std::vector<const RPrimitive*> Others;
+
+	void Compile(const std::vector<SharedPtr<RPrimitive>>& Primitives);
+
+	uint32_t Count() const { return static_cast<uint32_t>(References.size()); }
+};
+
+/*
+ * Primitive list of the scene traversals, a leaf is the range [First, First + Count) of references.
+ * The leaf is split into runs of references of one type and every run is tested by the kernel of its type.
+ */
+struct ScenePrimitiveList
+{
+	const ScenePrimitives& Primitives;
+
+	/* Skipped by OccludesLeaf, usually the object a shadow ray starts on */
+	const RPrimitive* IgnoredObject = nullptr;
+
+	/* End of the run of references of one type starting at First, no further than End */
+	uint32_t GetRunEnd(const uint32_t First, const uint32_t End) const
+	{
+		const ScenePrimitiveType Type = Primitives.References[First].Type;
+		uint32_t RunEnd = First + 1;
+		while (RunEnd < End && Primitives.References[RunEnd].Type == Type) RunEnd++;
+		return RunEnd;
+	}
+
+	/* Closest hit among Count entries of the array of Type from First, closer hits shrink the TMax of ClippedRay */
+	bool IntersectsRun(const ScenePrimitiveType Type, const uint32_t First, const uint32_t Count, RRay& ClippedRay, RPrimitiveHit& OutHit) const
+	{
+		switch (Type)
+		{
+		case ScenePrimitiveType::Sphere:
+			return Primitives.Spheres.Intersects(First, Count, ClippedRay, OutHit);
+		case ScenePrimitiveType::SphereLight:
+			return Primitives.SphereLights.Intersects(First, Count, ClippedRay, OutHit);
+		case ScenePrimitiveType::Plane:
+			return Primitives.Planes.Intersects(First, Count, ClippedRay, OutHit);
+		case ScenePrimitiveType::MeshInstance:
+		{
+			bool bHit = false;
+			for (uint32_t i = First; i < First + Count; i++)
+			{
+				const SceneMeshInstance& Instance = Primitives.MeshInstances[i];
+				RPrimitiveHit TempHit;
+				if (Instance.Mesh->IntersectsInstance(Instance.Transform, ClippedRay, TempHit) && TempHit.Depth < ClippedRay.TMax)
+				{
+					OutHit = TempHit;
+					OutHit.Object = Instance.Object;
+					ClippedRay.TMax = TempHit.Depth;
+					bHit = true;
+				}
+			}
+			return bHit;
+		}
+		default:
+		{
+			bool bHit = false;
+			for (uint32_t i = First; i < First + Count; i++)
+			{
+				RPrimitiveHit TempHit;
+				if (Primitives.Others[i]->FindHit(ClippedRay, TempHit) && TempHit.Depth < ClippedRay.TMax)
+				{
+					OutHit = TempHit;
+					ClippedRay.TMax = TempHit.Depth;
+					bHit = true;
+				}
+			}
+			return bHit;
+		}
+		}
+	}
+
+	bool OccludesRun(const ScenePrimitiveType Type, const uint32_t First, const uint32_t Count, const RRay& Ray, const double MaxDistance) const
+	{
+		switch (Type)
+		{
+		case ScenePrimitiveType::Sphere:
+			return Primitives.Spheres.Occludes(First, Count, Ray, MaxDistance, false, IgnoredObject);
+		case ScenePrimitiveType::SphereLight:
+			// Lights have no shadow test of their own, RPrimitive::Occludes keeps the range check of their closest hit test
+			return Primitives.SphereLights.Occludes(First, Count, Ray, MaxDistance, true, IgnoredObject);
+		case ScenePrimitiveType::Plane:
+			return Primitives.Planes.Occludes(First, Count, Ray, MaxDistance, IgnoredObject);
+		case ScenePrimitiveType::MeshInstance:
+			for (uint32_t i = First; i < First + Count; i++)
+			{
+				const SceneMeshInstance& Instance = Primitives.MeshInstances[i];
+				if (Instance.Object != IgnoredObject && Instance.Mesh->OccludesInstance(Instance.Transform, Ray, MaxDistance)) return true;
+			}
+			return false;
+		default:
+			for (uint32_t i = First; i < First + Count; i++)
+			{
+				const RPrimitive* Primitive = Primitives.Others[i];
+				if (Primitive != IgnoredObject && Primitive->Occludes(Ray, MaxDistance)) return true;
+			}
+			return false;
+		}
+	}
+
+	/* Closest hit in the leaf nearer than ClippedRay.TMax, which shrinks to it */
+	bool IntersectsLeaf(const uint32_t First, const uint32_t Count, RRay& ClippedRay, RPrimitiveHit& OutHit) const
+	{
+		bool bHit = false;
+		for (uint32_t Start = First; Start < First + Count;)
+		{
+			const uint32_t RunEnd = GetRunEnd(Start, First + Count);
+			const ScenePrimitiveRef Ref = Primitives.References[Start];
+			if (IntersectsRun(Ref.Type, Ref.Index, RunEnd - Start, ClippedRay, OutHit)) bHit = true;
+			Start = RunEnd;
+		}
+		return bHit;
+	}
+
+	bool OccludesLeaf(const uint32_t First, const uint32_t Count, const RRay& Ray, const double MaxDistance) const
+	{
+		for (uint32_t Start = First; Start < First + Count;)
+		{
+			const uint32_t RunEnd = GetRunEnd(Start, First + Count);
+			const ScenePrimitiveRef Ref = Primitives.References[Start];
+			if (OccludesRun(Ref.Type, Ref.Index, RunEnd - Start, Ray, MaxDistance)) return true;
+			Start = RunEnd;
+		}
+		return false;
+	}
+
+	/*
+	 * Hits of the rays selected by Mask with the primitive of Reference, a hit is only written to OutHits if it is closer
+	 * than the ray's TMax. Returns the mask of rays that got one, mesh instances trace the rays as a packet.
+	 */
+	uint32_t IntersectsPacket(const uint32_t Reference, const RRay* Rays, uint32_t Mask, RPrimitiveHit* OutHits) const
+	{
+		const ScenePrimitiveRef Ref = Primitives.References[Reference];
+		if (Ref.Type == ScenePrimitiveType::MeshInstance)
+		{
+			const SceneMeshInstance& Instance = Primitives.MeshInstances[Ref.Index];
+			const uint32_t HitMask = Instance.Mesh->IntersectsInstancePacket(Instance.Transform, Rays, Mask, OutHits);
+			for (uint32_t RayMask = HitMask; RayMask; RayMask &= RayMask - 1)
+			{
+				OutHits[std::countr_zero(RayMask)].Object = Instance.Object;
+			}
+			return HitMask;
+		}
+
+		uint32_t HitMask = 0;
+		for (; Mask; Mask &= Mask - 1)
+		{
+			const uint32_t i = std::countr_zero(Mask);
+			RRay ClippedRay = Rays[i];
+			if (IntersectsRun(Ref.Type, Ref.Index, 1, ClippedRay, OutHits[i])) HitMask |= 1u << i;
+		}
+		return HitMask;
+	}
+};
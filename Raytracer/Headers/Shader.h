@@ -25,8 +25,12 @@ private:
 public:
 	Vector3 Light(const RScene* const Scene, const RRay& Ray) const;
 
+	/* Light along a primary ray that was already traced, Hit is null if it missed the scene */
+	Vector3 Light(const RScene* const Scene, const RRay& Ray, const RHit* const Hit) const;
+
 private:
 	Vector3 LightInternal(const RScene* const Scene, const RRay& Ray) const;
+	Vector3 ShadeHit(const RScene* const Scene, const RRay& Ray, const RHit& Hit) const;
 	Vector3 RayRecurse(const RScene* const Scene, const RRay& Ray, const uint8_t Depth) const;
 
 	Vector3 DirectLighting(const RScene* const Scene, const RRay& Ray, const RHit& Hit) const;
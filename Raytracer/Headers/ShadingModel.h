@@ -19,10 +19,10 @@ struct RLightInfo
 	Vector3 Normal;
 	Vector3 View;
 	Vector3 Light;
-	const SharedPtr<const class RMaterial> Mat;
+	const class RMaterial* const Mat;
 
 public:
-	RLightInfo(const Vector3& InNormal, const Vector3& InView, const Vector3& InLight, const SharedPtr<const RMaterial> InMat) : Normal(InNormal), View(InView), Light(InLight), Mat(InMat) {}
+	RLightInfo(const Vector3& InNormal, const Vector3& InView, const Vector3& InLight, const RMaterial* const InMat) : Normal(InNormal), View(InView), Light(InLight), Mat(InMat) {}
 };
 
 class BRDF
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+
+#include "Core.h"
+
+
+/* 
+ * Distance at which the ray enters a sphere around the origin, or leaves it if bOutInside, false if it misses.
+ * The ray is in the space of the sphere, with a normalized direction.
+ */
+inline bool GetSphereDistance(const Vector3& LocalOrigin, const Vector3& LocalDirection, const double Radius, double& OutDistance, bool& bOutInside)
+{
+	const Vector3 L = -LocalOrigin; //Vector from Ray origin to Sphere position
+
+	const double tca = L | LocalDirection;
+	if (tca < 0) return false;
+
+	const double d2 = (L | L) - tca * tca; //Distance from Sphere position to ray
+	if (d2 > Radius * Radius) return false;
+
+	const double HalfInner = sqrt(Radius * Radius - d2); //half of the ray length inside sphere
+
+	double t0 = tca - HalfInner;
+	double t1 = tca + HalfInner;
+
+	bOutInside = false;
+	if (t0 < 0)
+	{
+		bOutInside = true;
+		t0 = t1;
+		if (t0 < 0) return false;
+	}
+
+	OutDistance = t0;
+	return true;
+}
+
+
+/* Spheres tested together by one kernel call, sphere cloud BVH leaves are padded to whole groups of this size */
+constexpr uint32_t SPHERE_GROUP_SIZE = 4;
+
+/*
+ * Centers and radii of SPHERE_GROUP_SIZE spheres in SoA form, 16 bytes per sphere.
+ * They are stored as floats and widened to doubles by the kernels, the ray tests themselves run in double precision.
+ */
+struct alignas(16) SphereRecordGroup
+{
+	float X[SPHERE_GROUP_SIZE];
+	float Y[SPHERE_GROUP_SIZE];
+	float Z[SPHERE_GROUP_SIZE];
+	float Radius[SPHERE_GROUP_SIZE];
+
+	/* All lanes start as a NaN sphere that is never hit */
+	SphereRecordGroup();
+
+	void SetSphere(const uint32_t Lane, const Vector3& Center, const double InRadius);
+	Vector3 GetCenter(const uint32_t Lane) const { return Vector3(X[Lane], Y[Lane], Z[Lane]); }
+};
+
+/* Per lane results of a group test, only valid for the lanes that hit */
+struct alignas(32) SphereGroupHits
+{
+	double Distance[SPHERE_GROUP_SIZE];
+
+	/* Lanes whose sphere the ray starts in, the distance is then the one where it leaves */
+	uint32_t InsideMask;
+};
+
+namespace SphereGroup
+{
+	/*
+	 * Test the ray against all spheres of Group with the same steps as GetSphereDistance, a sphere is hit within [TMin, TMax).
+	 * Returns the mask of lanes hit. Runs the widest kernel the CPU supports, which is picked on the first call.
+	 */
+	uint32_t Intersect(const SphereRecordGroup& Group, const RRay& Ray, SphereGroupHits& OutHits);
+
+	/* Instruction set of the kernel Intersect runs */
+	const char* GetKernelName();
+};
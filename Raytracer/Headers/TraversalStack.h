@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+/* Entries kept on the call stack, nearest-first traversal of any tree our builders produce stays well below it */
+constexpr uint32_t BVH_TRAVERSAL_STACK_SIZE = 64;
+
+/*
+ * LIFO of the nodes a traversal still has to visit. The first BVH_TRAVERSAL_STACK_SIZE entries live in an array
+ * inside the object, which is a local of the traversal, only deeper stacks spill into a heap vector.
+ * Entries are left uninitialized until pushed, so creating the stack for every ray costs nothing.
+ */
+template<typename T>
+class BVHTraversalStack
+{
+	static_assert(std::is_trivially_copyable_v<T> && std::is_trivially_destructible_v<T>, "Entries are copied around as plain memory");
+
+	alignas(T) std::byte Storage[sizeof(T) * BVH_TRAVERSAL_STACK_SIZE];
+	uint32_t Size = 0;
+	std::vector<T> Overflow;
+
+	T* GetEntries() { return std::launder(reinterpret_cast<T*>(Storage)); }
+
+public:
+	BVHTraversalStack() = default;
+	BVHTraversalStack(const BVHTraversalStack&) = delete;
+	BVHTraversalStack& operator=(const BVHTraversalStack&) = delete;
+
+	bool IsEmpty() const { return Size == 0; }
+
+	void Push(const T& Entry)
+	{
+		if (Size < BVH_TRAVERSAL_STACK_SIZE)
+		{
+			new (GetEntries() + Size) T(Entry);
+		}
+		else
+		{
+			Overflow.push_back(Entry);
+		}
+		Size++;
+	}
+
+	T Pop()
+	{
+		Size--;
+		if (Size < BVH_TRAVERSAL_STACK_SIZE) return GetEntries()[Size];
+
+		const T Entry = Overflow.back();
+		Overflow.pop_back();
+		return Entry;
+	}
+};
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+
+#include "Core.h"
+
+
+/* Triangles tested together by one kernel call, mesh BVH leaves are padded to whole groups of this size */
+constexpr uint32_t TRIANGLE_GROUP_SIZE = 4;
+
+/*
+ * Precomputed intersection record of a triangle in Baldwin-Weber form, an affine transform into a space where
+ * the triangle is the unit triangle in the XY plane. Row 2 gives the signed distance to the plane along its dominant
+ * normal axis, rows 0 and 1 the barycentric coordinates of the second and third vertex for a point on the plane.
+ * Degenerate triangles get an all zero record that no ray hits.
+ */
+struct TriangleRecord
+{
+	double Rows[3][4];
+
+	TriangleRecord() = default;
+	TriangleRecord(const Vector3& A, const Vector3& B, const Vector3& C);
+
+	/* Distance along the ray to the plane of the triangle, NaN or infinite if the ray is parallel to it */
+	double GetPlaneDistance(const RRay& Ray) const
+	{
+		const double* Row = Rows[2];
+		const double OriginDistance = Row[0] * Ray.Origin.X + Row[1] * Ray.Origin.Y + Row[2] * Ray.Origin.Z + Row[3];
+		const double Slope = Row[0] * Ray.Direction.X + Row[1] * Ray.Direction.Y + Row[2] * Ray.Direction.Z;
+		return -OriginDistance / Slope;
+	}
+
+	/* Barycentric coordinates of the second and third vertex for a point on the plane, false if it is outside */
+	bool GetBarycentrics(const Vector3& Point, double& OutU, double& OutV) const
+	{
+		OutU = Rows[0][0] * Point.X + Rows[0][1] * Point.Y + Rows[0][2] * Point.Z + Rows[0][3];
+		OutV = Rows[1][0] * Point.X + Rows[1][1] * Point.Y + Rows[1][2] * Point.Z + Rows[1][3];
+		return OutU >= 0.0 && OutV >= 0.0 && OutU + OutV <= 1.0;
+	}
+};
+
+/* TRIANGLE_GROUP_SIZE records in SoA form, so every row element of all triangles is one SIMD load */
+struct alignas(32) TriangleRecordGroup
+{
+	double Rows[3][4][TRIANGLE_GROUP_SIZE];
+
+	/* All lanes start with the zero record that is never hit */
+	TriangleRecordGroup();
+
+	void SetRecord(const uint32_t Lane, const TriangleRecord& Record);
+	TriangleRecord GetRecord(const uint32_t Lane) const;
+};
+
+/* Per lane results of a group test, only valid for the lanes that hit */
+struct alignas(32) TriangleGroupHits
+{
+	double Distance[TRIANGLE_GROUP_SIZE];
+	double U[TRIANGLE_GROUP_SIZE];
+	double V[TRIANGLE_GROUP_SIZE];
+};
+
+namespace TriangleGroup
+{
+	/*
+	 * Test the ray against all triangles of Group, a triangle is hit within [max(TMin, SMALL_NUMBER), TMax).
+	 * Returns the mask of lanes hit. Runs the widest kernel the CPU supports, which is picked on the first call.
+	 */
+	uint32_t Intersect(const TriangleRecordGroup& Group, const RRay& Ray, TriangleGroupHits& OutHits);
+
+	/* Instruction set of the kernel Intersect runs */
+	const char* GetKernelName();
+};
@@ -0,0 +1,360 @@
+#pragma once
+
+#include <vector>
+#include <bit>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define WIDE_BVH_SSE 1
+#include <immintrin.h>
+#else
+#define WIDE_BVH_SSE 0
+#endif
+
+#if WIDE_BVH_SSE && defined(__AVX__)
+#define WIDE_BVH_AVX 1
+#else
+#define WIDE_BVH_AVX 0
+#endif
+
+#include "BVH.h"
+
+/*
+ * Node of a BVH with up to Width children. Child bounds are stored as floats in SoA form,
+ * so all children are tested against a ray with one SIMD slab test.
+ * Children occupy the first ChildCount slots.
+ */
+template<uint32_t Width>
+struct alignas(32) WideBVHNode
+{
+	float MinX[Width];
+	float MinY[Width];
+	float MinZ[Width];
+	float MaxX[Width];
+	float MaxY[Width];
+	float MaxZ[Width];
+
+	/* Index of the child node, or of the first primitive in LinearBVH::Primitives for leaf children */
+	uint32_t Child[Width];
+
+	/* Number of primitives of leaf children, 0 for inner children */
+	uint32_t PrimitiveCount[Width];
+
+	uint32_t ChildCount;
+};
+
+/* BVH4 (SSE) or BVH8 (AVX) collapsed from the binary LinearBVH, leaves reference the binary BVH primitives */
+template<uint32_t Width>
+struct WideBVH
+{
+	std::vector<WideBVHNode<Width>> Nodes;
+};
+
+/* Ray in the precision of the wide node bounds */
+struct WideBVHRay
+{
+	float Origin[3];
+	float InvDirection[3];
+
+	explicit WideBVHRay(const RRay& Ray)
+	{
+		for (uint8_t Axis = 0; Axis < 3; Axis++)
+		{
+			// Keep the inverse finite, so the slab test never produces 0 * inf
+			double Direction = Ray.Direction[Axis];
+			if (std::abs(Direction) < 1e-20) Direction = std::copysign(1e-20, Direction);
+
+			Origin[Axis] = static_cast<float>(Ray.Origin[Axis]);
+			InvDirection[Axis] = static_cast<float>(1.0 / Direction);
+		}
+	}
+};
+
+/* Node or leaf waiting on the wide traversal stack, PrimitiveCount is 0 for nodes */
+struct WideBVHStackEntry
+{
+	uint32_t Index;
+	uint32_t PrimitiveCount;
+	float Distance;
+};
+
+inline float RoundFloatDown(const double Value)
+{
+	const float Result = static_cast<float>(Value);
+	return Result > Value ? std::nextafter(Result, -INFINITY) : Result;
+}
+
+inline float RoundFloatUp(const double Value)
+{
+	const float Result = static_cast<float>(Value);
+	return Result < Value ? std::nextafter(Result, INFINITY) : Result;
+}
+
+/*
+ * Append the wide node made from the binary node at NodeIndex and its subtree, returns its index.
+ * Up to Width binary descendants are pulled up, always opening the inner one with the largest area.
+ * Padding grows the float bounds to cover the rounding of the ray origin.
+ */
+template<uint32_t Width>
+inline uint32_t CollapseBVHNode(const LinearBVH& BVH, const uint32_t NodeIndex, const float Padding, WideBVH<Width>& OutBVH)
+{
+	uint32_t Children[Width];
+	uint32_t ChildCount = 0;
+
+	const LinearBVHNode& Node = BVH.Nodes[NodeIndex];
+	if (Node.IsLeaf())
+	{
+		Children[ChildCount++] = NodeIndex;
+	}
+	else
+	{
+		Children[ChildCount++] = Node.Offset;
+		Children[ChildCount++] = Node.Offset + 1;
+	}
+
+	while (ChildCount < Width)
+	{
+		int32_t Best = -1;
+		double BestArea = -1.0;
+		for (uint32_t i = 0; i < ChildCount; i++)
+		{
+			const LinearBVHNode& Child = BVH.Nodes[Children[i]];
+			if (!Child.IsLeaf() && Child.Box.Area() > BestArea)
+			{
+				Best = i;
+				BestArea = Child.Box.Area();
+			}
+		}
+		if (Best == -1) break;
+
+		const uint32_t Opened = Children[Best];
+		Children[Best] = BVH.Nodes[Opened].Offset;
+		Children[ChildCount++] = BVH.Nodes[Opened].Offset + 1;
+	}
+
+	const uint32_t WideIndex = static_cast<uint32_t>(OutBVH.Nodes.size());
+	OutBVH.Nodes.emplace_back();
+
+	WideBVHNode<Width> WideNode = {};
+	WideNode.ChildCount = ChildCount;
+	for (uint32_t i = 0; i < ChildCount; i++)
+	{
+		const LinearBVHNode& Child = BVH.Nodes[Children[i]];
+		WideNode.MinX[i] = RoundFloatDown(Child.Box.Min.X) - Padding;
+		WideNode.MinY[i] = RoundFloatDown(Child.Box.Min.Y) - Padding;
+		WideNode.MinZ[i] = RoundFloatDown(Child.Box.Min.Z) - Padding;
+		WideNode.MaxX[i] = RoundFloatUp(Child.Box.Max.X) + Padding;
+		WideNode.MaxY[i] = RoundFloatUp(Child.Box.Max.Y) + Padding;
+		WideNode.MaxZ[i] = RoundFloatUp(Child.Box.Max.Z) + Padding;
+
+		if (Child.IsLeaf())
+		{
+			WideNode.Child[i] = Child.Offset;
+			WideNode.PrimitiveCount[i] = Child.PrimitiveCount;
+		}
+		else
+		{
+			WideNode.Child[i] = CollapseBVHNode(BVH, Children[i], Padding, OutBVH);
+		}
+	}
+	OutBVH.Nodes[WideIndex] = WideNode;
+
+	return WideIndex;
+}
+
+template<uint32_t Width>
+inline UniquePtr<WideBVH<Width>> CollapseBVH(const LinearBVH& BVH)
+{
+	auto Wide = MakeUnique<WideBVH<Width>>();
+	if (BVH.Nodes.empty()) return Wide;
+
+	const AABB& Root = BVH.Nodes[0].Box;
+	const double Magnitude = std::max(Root.Min.Abs().GetMax(), Root.Max.Abs().GetMax());
+	const float Padding = static_cast<float>(Magnitude * FLT_EPSILON * 4.0);
+
+	Wide->Nodes.reserve(BVH.Nodes.size() / (Width - 1) + 1);
+	CollapseBVHNode(BVH, 0, Padding, *Wide);
+
+	return Wide;
+}
+
+/*
+ * Slab test of the ray against all children of Node. Returns a bit mask of children entered
+ * before MaxDistance and writes the entry distances to OutDistances.
+ */
+template<uint32_t Width>
+inline uint32_t IntersectWideNode(const WideBVHNode<Width>& Node, const WideBVHRay& Ray, const float MaxDistance, float* OutDistances)
+{
+	uint32_t Mask = 0;
+	for (uint32_t i = 0; i < Width; i++)
+	{
+		const float tX1 = (Node.MinX[i] - Ray.Origin[0]) * Ray.InvDirection[0];
+		const float tX2 = (Node.MaxX[i] - Ray.Origin[0]) * Ray.InvDirection[0];
+		const float tY1 = (Node.MinY[i] - Ray.Origin[1]) * Ray.InvDirection[1];
+		const float tY2 = (Node.MaxY[i] - Ray.Origin[1]) * Ray.InvDirection[1];
+		const float tZ1 = (Node.MinZ[i] - Ray.Origin[2]) * Ray.InvDirection[2];
+		const float tZ2 = (Node.MaxZ[i] - Ray.Origin[2]) * Ray.InvDirection[2];
+
+		const float tN = std::max(std::max(std::min(tX1, tX2), std::min(tY1, tY2)), std::max(std::min(tZ1, tZ2), 0.0f));
+		const float tF = std::min(std::min(std::max(tX1, tX2), std::max(tY1, tY2)), std::min(std::max(tZ1, tZ2), MaxDistance));
+
+		OutDistances[i] = tN;
+		Mask |= static_cast<uint32_t>(tN <= tF) << i;
+	}
+	return Mask & ((1u << Node.ChildCount) - 1);
+}
+
+#if WIDE_BVH_SSE
+template<>
+inline uint32_t IntersectWideNode<4>(const WideBVHNode<4>& Node, const WideBVHRay& Ray, const float MaxDistance, float* OutDistances)
+{
+	const __m128 OriginX = _mm_set1_ps(Ray.Origin[0]);
+	const __m128 OriginY = _mm_set1_ps(Ray.Origin[1]);
+	const __m128 OriginZ = _mm_set1_ps(Ray.Origin[2]);
+	const __m128 InvX = _mm_set1_ps(Ray.InvDirection[0]);
+	const __m128 InvY = _mm_set1_ps(Ray.InvDirection[1]);
+	const __m128 InvZ = _mm_set1_ps(Ray.InvDirection[2]);
+
+	const __m128 tX1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(Node.MinX), OriginX), InvX);
+	const __m128 tX2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(Node.MaxX), OriginX), InvX);
+	const __m128 tY1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(Node.MinY), OriginY), InvY);
+	const __m128 tY2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(Node.MaxY), OriginY), InvY);
+	const __m128 tZ1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(Node.MinZ), OriginZ), InvZ);
+	const __m128 tZ2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(Node.MaxZ), OriginZ), InvZ);
+
+	const __m128 tN = _mm_max_ps(_mm_max_ps(_mm_min_ps(tX1, tX2), _mm_min_ps(tY1, tY2)), _mm_max_ps(_mm_min_ps(tZ1, tZ2), _mm_setzero_ps()));
+	const __m128 tF = _mm_min_ps(_mm_min_ps(_mm_max_ps(tX1, tX2), _mm_max_ps(tY1, tY2)), _mm_min_ps(_mm_max_ps(tZ1, tZ2), _mm_set1_ps(MaxDistance)));
+
+	_mm_storeu_ps(OutDistances, tN);
+	return static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(tN, tF))) & ((1u << Node.ChildCount) - 1);
+}
+#endif // WIDE_BVH_SSE
+
+#if WIDE_BVH_AVX
+template<>
+inline uint32_t IntersectWideNode<8>(const WideBVHNode<8>& Node, const WideBVHRay& Ray, const float MaxDistance, float* OutDistances)
+{
+	const __m256 OriginX = _mm256_set1_ps(Ray.Origin[0]);
+	const __m256 OriginY = _mm256_set1_ps(Ray.Origin[1]);
+	const __m256 OriginZ = _mm256_set1_ps(Ray.Origin[2]);
+	const __m256 InvX = _mm256_set1_ps(Ray.InvDirection[0]);
+	const __m256 InvY = _mm256_set1_ps(Ray.InvDirection[1]);
+	const __m256 InvZ = _mm256_set1_ps(Ray.InvDirection[2]);
+
+	const __m256 tX1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(Node.MinX), OriginX), InvX);
+	const __m256 tX2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(Node.MaxX), OriginX), InvX);
+	const __m256 tY1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(Node.MinY), OriginY), InvY);
+	const __m256 tY2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(Node.MaxY), OriginY), InvY);
+	const __m256 tZ1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(Node.MinZ), OriginZ), InvZ);
+	const __m256 tZ2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(Node.MaxZ), OriginZ), InvZ);
+
+	const __m256 tN = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tX1, tX2), _mm256_min_ps(tY1, tY2)), _mm256_max_ps(_mm256_min_ps(tZ1, tZ2), _mm256_setzero_ps()));
+	const __m256 tF = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tX1, tX2), _mm256_max_ps(tY1, tY2)), _mm256_min_ps(_mm256_max_ps(tZ1, tZ2), _mm256_set1_ps(MaxDistance)));
+
+	_mm256_storeu_ps(OutDistances, tN);
+	return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(tN, tF, _CMP_LE_OQ))) & ((1u << Node.ChildCount) - 1);
+}
+#endif // WIDE_BVH_AVX
+
+/* Closest hit traversal of the wide BVH, hit children are visited nearest first */
+template<uint32_t Width, typename PrimitiveList>
+inline bool WideBVHTraverse(const WideBVH<Width>& BVH, const PrimitiveList& Primitives, const RRay& Ray, RPrimitiveHit& OutHit)
+{
+	if (BVH.Nodes.empty()) return false;
+
+	const WideBVHRay WideRay(Ray);
+	RRay ClippedRay = Ray;
+
+	BVHTraversalStack<WideBVHStackEntry> Stack;
+	BVHTraversalScope Stats;
+	Stack.Push({ 0, 0, 0.0f });
+
+	bool bHit = false;
+
+	while (!Stack.IsEmpty())
+	{
+		const WideBVHStackEntry Entry = Stack.Pop();
+
+		// A closer hit was found since this entry was pushed
+		if (Entry.Distance > ClippedRay.TMax) continue;
+
+		if (Entry.PrimitiveCount > 0)
+		{
+			Stats.PrimitiveTests += Entry.PrimitiveCount;
+			if (Primitives.IntersectsLeaf(Entry.Index, Entry.PrimitiveCount, ClippedRay, OutHit)) bHit = true;
+			continue;
+		}
+
+		const WideBVHNode<Width>& Node = BVH.Nodes[Entry.Index];
+		Stats.NodeVisits++;
+
+		alignas(32) float Distances[Width];
+		uint32_t Mask = IntersectWideNode(Node, WideRay, RoundFloatUp(ClippedRay.TMax), Distances);
+
+		// Insertion sort of hit children, farthest first
+		uint32_t Order[Width];
+		uint32_t HitCount = 0;
+		while (Mask)
+		{
+			const uint32_t Child = std::countr_zero(Mask);
+			Mask &= Mask - 1;
+
+			uint32_t j = HitCount++;
+			for (; j > 0 && Distances[Order[j - 1]] < Distances[Child]; j--)
+			{
+				Order[j] = Order[j - 1];
+			}
+			Order[j] = Child;
+		}
+
+		for (uint32_t i = 0; i < HitCount; i++)
+		{
+			const uint32_t Child = Order[i];
+			Stack.Push({ Node.Child[Child], Node.PrimitiveCount[Child], Distances[Child] });
+		}
+	}
+
+	return bHit;
+}
+
+/* Any hit traversal of the wide BVH, see BVHOccluded */
+template<uint32_t Width, typename PrimitiveList>
+inline bool WideBVHOccluded(const WideBVH<Width>& BVH, const PrimitiveList& Primitives, const RRay& Ray, const double MaxDistance)
+{
+	if (BVH.Nodes.empty()) return false;
+
+	const WideBVHRay WideRay(Ray);
+	RRay ClippedRay = Ray;
+	ClippedRay.TMax = std::min(Ray.TMax, MaxDistance);
+	const float MaxWideDistance = RoundFloatUp(ClippedRay.TMax);
+
+	BVHTraversalStack<uint32_t> Stack;
+	BVHTraversalScope Stats;
+	Stack.Push(0);
+
+	while (!Stack.IsEmpty())
+	{
+		const WideBVHNode<Width>& Node = BVH.Nodes[Stack.Pop()];
+		Stats.NodeVisits++;
+
+		alignas(32) float Distances[Width];
+		uint32_t Mask = IntersectWideNode(Node, WideRay, MaxWideDistance, Distances);
+
+		while (Mask)
+		{
+			const uint32_t Child = std::countr_zero(Mask);
+			Mask &= Mask - 1;
+
+			if (Node.PrimitiveCount[Child] == 0)
+			{
+				Stack.Push(Node.Child[Child]);
+				continue;
+			}
+
+			Stats.PrimitiveTests += Node.PrimitiveCount[Child];
+			if (Primitives.OccludesLeaf(Node.Child[Child], Node.PrimitiveCount[Child], ClippedRay, ClippedRay.TMax)) return true;
+		}
+	}
+
+	return false;
+}
@@ -0,0 +1,36 @@
+#include "../Headers/AllocationCounter.h"
+#include <cstdlib>
+#include <new>
+
+
+/* Zero initialized, so it is usable before any dynamic initialization and in every thread */
+static thread_local uint64_t ThreadAllocations = 0;
+
+
+uint64_t AllocationCounter::GetThreadAllocations()
+{
+	return ThreadAllocations;
+}
+
+#if COUNT_HEAP_ALLOCATIONS
+/*
+ * Replacements of the global allocation functions, all other forms of new and delete
+ * except the over-aligned ones end up here.
+ */
+void* operator new(std::size_t Size)
+{
+	ThreadAllocations++;
+	if (void* Memory = std::malloc(Size > 0 ? Size : 1)) return Memory;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* Memory) noexcept
+{
+	std::free(Memory);
+}
+
+void operator delete(void* Memory, std::size_t) noexcept
+{
+	std::free(Memory);
+}
+#endif
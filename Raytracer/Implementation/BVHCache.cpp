@@ -0,0 +1,210 @@
+#include "../Headers/BVHCache.h"
+#include "../Headers/BVH.h"
+#include "../Headers/SBVH.h"
+#include "../Headers/CoreUtilities.h"
+#include <bit>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <format>
+#include <type_traits>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#define NOGDI
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+/* Bump whenever a builder changes its output, old cache files then stop matching */
+constexpr uint32_t BVH_CACHE_VERSION = 1;
+
+static_assert(std::is_trivially_copyable_v<LinearBVHNode>, "Cached nodes are copied as raw bytes");
+
+/* Layout of the cache file: header, NodeCount nodes, PrimitiveCount uint32 primitive indices */
+struct BVHCacheHeader
+{
+	char Magic[4];
+	uint32_t Version;
+	uint64_t Key;
+	uint32_t NodeCount;
+	uint32_t PrimitiveCount;
+	double BuildCost;
+};
+
+
+RMappedFile::RMappedFile(const std::string& Path)
+{
+#ifdef _WIN32
+	HANDLE File = CreateFileA(Path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (File == INVALID_HANDLE_VALUE) return;
+
+	LARGE_INTEGER FileSize;
+	if (GetFileSizeEx(File, &FileSize) && FileSize.QuadPart > 0)
+	{
+		// The view keeps the mapping alive, both handles can be closed right away
+		HANDLE Mapping = CreateFileMappingA(File, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (Mapping)
+		{
+			MappedData = MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0);
+			if (MappedData) MappedSize = static_cast<size_t>(FileSize.QuadPart);
+			CloseHandle(Mapping);
+		}
+	}
+	CloseHandle(File);
+#else
+	const int File = open(Path.c_str(), O_RDONLY);
+	if (File < 0) return;
+
+	struct stat FileStat;
+	if (fstat(File, &FileStat) == 0 && FileStat.st_size > 0)
+	{
+		void* Mapping = mmap(nullptr, FileStat.st_size, PROT_READ, MAP_PRIVATE, File, 0);
+		if (Mapping != MAP_FAILED)
+		{
+			MappedData = Mapping;
+			MappedSize = static_cast<size_t>(FileStat.st_size);
+		}
+	}
+	close(File);
+#endif
+}
+
+RMappedFile::~RMappedFile()
+{
+	if (!MappedData) return;
+
+#ifdef _WIN32
+	UnmapViewOfFile(MappedData);
+#else
+	munmap(const_cast<void*>(MappedData), MappedSize);
+#endif
+}
+
+
+uint64_t BVHCache::HashBytes(uint64_t Hash, const void* Data, const size_t Size)
+{
+	const uint8_t* Bytes = static_cast<const uint8_t*>(Data);
+	for (size_t i = 0; i < Size; i++)
+	{
+		Hash ^= Bytes[i];
+		Hash *= 1099511628211ull;
+	}
+	return Hash;
+}
+
+uint64_t BVHCache::MakeKey(const uint64_t GeometryHash, const BVHBuilder Builder)
+{
+	const uint64_t Settings[] = {
+		GeometryHash,
+		BVH_CACHE_VERSION,
+		static_cast<uint64_t>(Builder),
+		sizeof(LinearBVHNode),
+		BVH_SAH_BINS,
+		BVH_MIN_SPLIT_PRIMITIVES,
+		BVH_SPATIAL_BINS,
+		std::bit_cast<uint64_t>(BVH_SPATIAL_SPLIT_ALPHA)
+	};
+	return HashBytes(HASH_SEED, Settings, sizeof(Settings));
+}
+
+std::string BVHCache::GetPath(const std::string& Directory, const uint64_t Key)
+{
+	return (std::filesystem::path(Directory) / std::format("{:016x}.bvh", Key)).string();
+}
+
+bool BVHCache::Save(const std::string& Path, const uint64_t Key, const LinearBVH& BVH)
+{
+	const std::vector<uint32_t>& Order = BVH.PrimitiveIndices;
+
+	BVHCacheHeader Header;
+	std::memcpy(Header.Magic, "RBVH", 4);
+	Header.Version = BVH_CACHE_VERSION;
+	Header.Key = Key;
+	Header.NodeCount = static_cast<uint32_t>(BVH.Nodes.size());
+	Header.PrimitiveCount = static_cast<uint32_t>(Order.size());
+	Header.BuildCost = BVH.BuildCost;
+
+	/* Write to a temporary file first so that other processes never map a half-written cache */
+	std::error_code Error;
+	std::filesystem::create_directories(std::filesystem::path(Path).parent_path(), Error);
+	const std::string TempPath = Path + ".tmp";
+	{
+		std::ofstream Out(TempPath, std::ios::binary | std::ios::trunc);
+		if (!Out)
+		{
+			LOG("BVH Cache", LogType::WARNING, "Failed to write {}", TempPath);
+			return false;
+		}
+
+		Out.write(reinterpret_cast<const char*>(&Header), sizeof(Header));
+		Out.write(reinterpret_cast<const char*>(BVH.Nodes.data()), BVH.Nodes.size() * sizeof(LinearBVHNode));
+		Out.write(reinterpret_cast<const char*>(Order.data()), Order.size() * sizeof(uint32_t));
+		if (!Out)
+		{
+			LOG("BVH Cache", LogType::WARNING, "Failed to write {}", TempPath);
+			Out.close();
+			std::filesystem::remove(TempPath, Error);
+			return false;
+		}
+	}
+
+	std::filesystem::rename(TempPath, Path, Error);
+	if (Error)
+	{
+		LOG("BVH Cache", LogType::WARNING, "Failed to write {}: {}", Path, Error.message());
+		std::filesystem::remove(TempPath, Error);
+		return false;
+	}
+	return true;
+}
+
+UniquePtr<LinearBVH> BVHCache::Load(const std::string& Path, const uint64_t Key, const uint32_t PrimitiveCount)
+{
+	const RMappedFile File(Path);
+	if (!File.Data() || File.Size() < sizeof(BVHCacheHeader)) return nullptr;
+
+	BVHCacheHeader Header;
+	std::memcpy(&Header, File.Data(), sizeof(Header));
+	if (std::memcmp(Header.Magic, "RBVH", 4) != 0 || Header.Version != BVH_CACHE_VERSION || Header.Key != Key) return nullptr;
+	// Spatial splits can reference a primitive more than once, so there may be more indices than primitives
+	if (Header.PrimitiveCount < PrimitiveCount || Header.NodeCount == 0) return nullptr;
+
+	const size_t NodeBytes = static_cast<size_t>(Header.NodeCount) * sizeof(LinearBVHNode);
+	const size_t OrderBytes = static_cast<size_t>(Header.PrimitiveCount) * sizeof(uint32_t);
+	if (File.Size() != sizeof(Header) + NodeBytes + OrderBytes) return nullptr;
+
+	auto BVH = MakeUnique<LinearBVH>();
+	BVH->BuildCost = Header.BuildCost;
+	BVH->Nodes.resize(Header.NodeCount);
+	std::memcpy(BVH->Nodes.data(), File.Data() + sizeof(Header), NodeBytes);
+
+	BVH->PrimitiveIndices.resize(Header.PrimitiveCount);
+	std::memcpy(BVH->PrimitiveIndices.data(), File.Data() + sizeof(Header) + NodeBytes, OrderBytes);
+
+	/* 
+	 * Cheap sanity check so that a damaged file can never send traversal out of bounds.
+	 * Children always follow their parent, which also rules out cycles.
+	 */
+	for (uint32_t i = 0; i < Header.NodeCount; i++)
+	{
+		const LinearBVHNode& Node = BVH->Nodes[i];
+		const bool bValid = Node.IsLeaf()
+			? static_cast<uint64_t>(Node.Offset) + Node.PrimitiveCount <= Header.PrimitiveCount
+			: Node.Offset > i && static_cast<uint64_t>(Node.Offset) + 1 < Header.NodeCount;
+		if (!bValid) return nullptr;
+	}
+
+	for (const uint32_t Index : BVH->PrimitiveIndices)
+	{
+		if (Index >= PrimitiveCount) return nullptr;
+	}
+
+	return BVH;
+}
@@ -0,0 +1,194 @@
+#include "../Headers/BVHStats.h"
+#include "../Headers/BVH.h"
+#include "../Headers/CoreUtilities.h"
+#include <deque>
+#include <fstream>
+#include <format>
+#include <mutex>
+
+
+/* Counters of every thread that ever traced a ray, a deque never moves the elements it already holds */
+static std::deque<BVHTraversalCounters> ThreadCounters;
+static std::mutex ThreadCountersMutex;
+
+
+BVHStatistics BVHStats::Compute(const LinearBVH& BVH)
+{
+	BVHStatistics Stats;
+	Stats.SAHCost = ComputeSAHCost(BVH);
+	Stats.NodeCount = static_cast<uint32_t>(BVH.Nodes.size());
+	Stats.PrimitiveReferences = CountPrimitives(BVH);
+	Stats.PrimitiveReferenceBytes = BVH.Primitives.size() * sizeof(BVH.Primitives[0]) + BVH.PrimitiveIndices.size() * sizeof(BVH.PrimitiveIndices[0]);
+
+	/* Children always come after their parent, so depths are known by the time a node is reached */
+	std::vector<uint32_t> Depths(BVH.Nodes.size(), 0);
+	for (size_t i = 0; i < BVH.Nodes.size(); i++)
+	{
+		const LinearBVHNode& Node = BVH.Nodes[i];
+		const uint32_t Depth = Depths[i];
+
+		if (!Node.IsLeaf())
+		{
+			Depths[Node.Offset] = Depth + 1;
+			Depths[Node.Offset + 1] = Depth + 1;
+			Stats.InnerNodeBytes += sizeof(LinearBVHNode);
+			continue;
+		}
+
+		Stats.LeafCount++;
+		Stats.LeafNodeBytes += sizeof(LinearBVHNode);
+		Stats.MaxDepth = std::max(Stats.MaxDepth, Depth);
+
+		if (Stats.DepthHistogram.size() <= Depth) Stats.DepthHistogram.resize(Depth + 1, 0);
+		Stats.DepthHistogram[Depth]++;
+
+		if (Stats.LeafSizeHistogram.size() <= Node.PrimitiveCount) Stats.LeafSizeHistogram.resize(Node.PrimitiveCount + 1, 0);
+		Stats.LeafSizeHistogram[Node.PrimitiveCount]++;
+	}
+
+	return Stats;
+}
+
+BVHTraversalCounters& BVHStats::GetThreadCounters()
+{
+	thread_local BVHTraversalCounters* Counters = nullptr;
+	if (!Counters)
+	{
+		const std::lock_guard<std::mutex> Lock(ThreadCountersMutex);
+		Counters = &ThreadCounters.emplace_back();
+	}
+	return *Counters;
+}
+
+BVHTraversalCounters BVHStats::GetTotalCounters()
+{
+	const std::lock_guard<std::mutex> Lock(ThreadCountersMutex);
+
+	BVHTraversalCounters Total;
+	for (const BVHTraversalCounters& Counters : ThreadCounters)
+	{
+		Total.Rays += Counters.Rays;
+		Total.NodeVisits += Counters.NodeVisits;
+		Total.PrimitiveTests += Counters.PrimitiveTests;
+	}
+	return Total;
+}
+
+void BVHStats::ResetCounters()
+{
+	const std::lock_guard<std::mutex> Lock(ThreadCountersMutex);
+	for (BVHTraversalCounters& Counters : ThreadCounters)
+	{
+		Counters = BVHTraversalCounters();
+	}
+}
+
+static std::string FormatHistogram(const std::vector<uint32_t>& Histogram)
+{
+	std::string Result;
+	for (size_t i = 0; i < Histogram.size(); i++)
+	{
+		if (Histogram[i] == 0) continue;
+		Result += std::format("{}{}:{}", Result.empty() ? "" : " ", i, Histogram[i]);
+	}
+	return Result;
+}
+
+static void PrintStatistics(const std::string& Name, const BVHStatistics& Stats)
+{
+	LOG("BVH Stats", LogType::LOG, "{}: SAH cost {:.2f}, {} Nodes, {} Leaves, {} Primitive references, max depth {}, {:.2f} MB (inner nodes {:.2f}, leaves {:.2f}, references {:.2f})",
+		Name,
+		Stats.SAHCost,
+		Stats.NodeCount,
+		Stats.LeafCount,
+		Stats.PrimitiveReferences,
+		Stats.MaxDepth,
+		Stats.TotalBytes() / 1048576.0,
+		Stats.InnerNodeBytes / 1048576.0,
+		Stats.LeafNodeBytes / 1048576.0,
+		Stats.PrimitiveReferenceBytes / 1048576.0);
+	LOG("BVH Stats", LogType::LOG, "{} leaf depths (depth:leaves): {}", Name, FormatHistogram(Stats.DepthHistogram));
+	LOG("BVH Stats", LogType::LOG, "{} leaf sizes (primitives:leaves): {}", Name, FormatHistogram(Stats.LeafSizeHistogram));
+}
+
+void BVHStats::Print(const BVHReport& Report)
+{
+	PrintStatistics("Scene", Report.Scene);
+	for (size_t i = 0; i < Report.Meshes.size(); i++)
+	{
+		PrintStatistics(std::format("Mesh {} ({} Instances)", i, Report.MeshInstances[i]), Report.Meshes[i]);
+	}
+
+	const BVHTraversalCounters& Traversal = Report.Traversal;
+	if (Traversal.Rays == 0) return;
+
+	LOG("BVH Stats", LogType::LOG, "{} Rays, {:.2f} Node visits and {:.2f} Primitive tests per ray",
+		Traversal.Rays,
+		static_cast<double>(Traversal.NodeVisits) / Traversal.Rays,
+		static_cast<double>(Traversal.PrimitiveTests) / Traversal.Rays);
+}
+
+static std::string HistogramToJSON(const std::vector<uint32_t>& Histogram)
+{
+	std::string Result = "[";
+	for (size_t i = 0; i < Histogram.size(); i++)
+	{
+		Result += std::format("{}{}", i > 0 ? ", " : "", Histogram[i]);
+	}
+	return Result + "]";
+}
+
+static std::string StatisticsToJSON(const BVHStatistics& Stats, const std::string& Indent)
+{
+	std::string Result = "{\n";
+	Result += std::format("{}\t\"SAHCost\": {},\n", Indent, Stats.SAHCost);
+	Result += std::format("{}\t\"NodeCount\": {},\n", Indent, Stats.NodeCount);
+	Result += std::format("{}\t\"LeafCount\": {},\n", Indent, Stats.LeafCount);
+	Result += std::format("{}\t\"PrimitiveReferences\": {},\n", Indent, Stats.PrimitiveReferences);
+	Result += std::format("{}\t\"MaxDepth\": {},\n", Indent, Stats.MaxDepth);
+	Result += std::format("{}\t\"DepthHistogram\": {},\n", Indent, HistogramToJSON(Stats.DepthHistogram));
+	Result += std::format("{}\t\"LeafSizeHistogram\": {},\n", Indent, HistogramToJSON(Stats.LeafSizeHistogram));
+	Result += std::format("{}\t\"InnerNodeBytes\": {},\n", Indent, Stats.InnerNodeBytes);
+	Result += std::format("{}\t\"LeafNodeBytes\": {},\n", Indent, Stats.LeafNodeBytes);
+	Result += std::format("{}\t\"PrimitiveReferenceBytes\": {}\n", Indent, Stats.PrimitiveReferenceBytes);
+	return Result + Indent + "}";
+}
+
+std::string BVHStats::ToJSON(const BVHReport& Report)
+{
+	const BVHTraversalCounters& Traversal = Report.Traversal;
+	const double Rays = static_cast<double>(std::max<uint64_t>(Traversal.Rays, 1));
+
+	std::string Result = "{\n";
+	Result += "\t\"Scene\": " + StatisticsToJSON(Report.Scene, "\t") + ",\n";
+
+	Result += "\t\"Meshes\": [";
+	for (size_t i = 0; i < Report.Meshes.size(); i++)
+	{
+		Result += i > 0 ? ",\n\t\t{\n" : "\n\t\t{\n";
+		Result += std::format("\t\t\t\"Instances\": {},\n", Report.MeshInstances[i]);
+		Result += "\t\t\t\"BVH\": " + StatisticsToJSON(Report.Meshes[i], "\t\t\t") + "\n\t\t}";
+	}
+	Result += Report.Meshes.empty() ? "],\n" : "\n\t],\n";
+
+	Result += "\t\"Traversal\": {\n";
+	Result += std::format("\t\t\"Rays\": {},\n", Traversal.Rays);
+	Result += std::format("\t\t\"NodeVisits\": {},\n", Traversal.NodeVisits);
+	Result += std::format("\t\t\"PrimitiveTests\": {},\n", Traversal.PrimitiveTests);
+	Result += std::format("\t\t\"NodeVisitsPerRay\": {},\n", Traversal.NodeVisits / Rays);
+	Result += std::format("\t\t\"PrimitiveTestsPerRay\": {}\n", Traversal.PrimitiveTests / Rays);
+	return Result + "\t}\n}\n";
+}
+
+bool BVHStats::ExportJSON(const std::string& Path, const BVHReport& Report)
+{
+	std::ofstream Out(Path, std::ios::trunc);
+	if (!Out)
+	{
+		LOG("BVH Stats", LogType::WARNING, "Failed to write {}", Path);
+		return false;
+	}
+
+	Out << ToJSON(Report);
+	return static_cast<bool>(Out);
+}
@@ -1,10 +1,49 @@
 #include "../Headers/OObject.h" 
+#include "../Headers/BVH.h"
+#include "../Headers/BVHBuilders.h"
+#include "../Headers/BVHCache.h"
+#include "../Headers/QuantizedBVH.h"
+#include "../Headers/RayPacket.h"
+#include "../Headers/ScenePrimitives.h"
+#include <chrono>
 
 
-bool OBox::Intersects(const RRay& Ray, RHit& OutHit) const
+AABB RPrimitive::ToWorldBoundingBox(const RTransform& ObjectTransform, const AABB& LocalBox)
+{
+	AABB Box = AABB::Empty();
+	for (uint8_t Corner = 0; Corner < 8; Corner++)
+	{
+		const Vector3 Local(
+			Corner & 1 ? LocalBox.Max.X : LocalBox.Min.X,
+			Corner & 2 ? LocalBox.Max.Y : LocalBox.Min.Y,
+			Corner & 4 ? LocalBox.Max.Z : LocalBox.Min.Z);
+		Box.Expand(ObjectTransform.TransformPosition(Local));
+	}
+	return Box;
+}
+
+/* 
+ * Meshes and sphere clouds are stored in object space and test rays moved there.
+ * Hit position and depth are brought back to world space, normals use the inverse transpose.
+ */
+RRay RPrimitive::ToObjectSpace(const RTransform& ObjectTransform, const RRay& Ray)
+{
+	const Vector3 LocalDirection = ObjectTransform.InverseTransformVector(Ray.Direction);
+	const double LocalScale = LocalDirection.Length() / Ray.Direction.Length();
+	return RRay(ObjectTransform.InverseTransformPosition(Ray.Origin), LocalDirection.Normalized(), Ray.TMin * LocalScale, Ray.TMax * LocalScale);
+}
+
+double RPrimitive::ToWorldDepth(const RTransform& ObjectTransform, const RRay& Ray, const RRay& LocalRay, const double LocalDepth)
+{
+	const Vector3 Position = ObjectTransform.TransformPosition(LocalRay.Origin + LocalRay.Direction * LocalDepth);
+	return (Ray.Origin - Position).Length();
+}
+
+
+bool OBox::FindHit(const RRay& Ray, RPrimitiveHit& OutHit) const
 {
 	const Vector3 LocalRayOrigin = Ray.Origin - Transform.GetPosition();
-	const Vector3 m = Vector3(1.0) / Ray.Direction;
+	const Vector3& m = Ray.InvDirection;
 	const Vector3 n = m * LocalRayOrigin;
 	const Vector3 k = m.Abs() * Extent;
 	const Vector3 t1 = -n - k;
@@ -18,10 +57,20 @@ bool OBox::Intersects(const RRay& Ray, RHit& OutHit) const
 	//If the ray origin is inside the box (tN < 0) the actual intersection position will be at (RayDir * tF)
 	//Same goes for Depth
 	const bool bInsideBox = tN < 0.0;
-	OutHit.Position = Transform.GetPosition() + (bInsideBox ? LocalRayOrigin + Ray.Direction * tF : LocalRayOrigin + Ray.Direction * tN);
+	if (!Ray.InRange(bInsideBox ? tF : tN)) return false;
+
+	OutHit.Object = this;
+	OutHit.Part = bInsideBox;
 	OutHit.Depth = bInsideBox ? tF : tN;
 
-	OutHit.Mat = Mat;
+	return true;
+}
+
+/* Part is 1 if the ray started inside the box */
+void OBox::GetHitSurface(const RRay& Ray, const RPrimitiveHit& Hit, RHit& OutHit) const
+{
+	const Vector3 LocalRayOrigin = Ray.Origin - Transform.GetPosition();
+	OutHit.Position = Transform.GetPosition() + LocalRayOrigin + Ray.Direction * Hit.Depth;
 
 	const Vector3 LocalHit = OutHit.Position - Transform.GetPosition();
 	Vector3 Normal = {
@@ -29,10 +78,8 @@ bool OBox::Intersects(const RRay& Ray, RHit& OutHit) const
 		std::trunc(LocalHit.Y / Extent.Y * (1.0 + 1e-8)),
 		std::trunc(LocalHit.Z / Extent.Z * (1.0 + 1e-8))
 	};
-	if (bInsideBox) Normal = -Normal;
+	if (Hit.Part) Normal = -Normal;
 	OutHit.Normal = Normal.Normalized();
-
-	return true;
 }
 
 void OBox::SetByMinMax(const Vector3& VMin, const Vector3& VMax)
@@ -41,58 +88,58 @@ void OBox::SetByMinMax(const Vector3& VMin, const Vector3& VMax)
 	Extent = (VMax - VMin) / 2;
 }
 
-bool OSphere::Intersects(const RRay& Ray, RHit& OutHit) const
+bool OSphere::FindHit(const RRay& Ray, RPrimitiveHit& OutHit) const
 {
-	RRay LocalRay;
-	LocalRay.Direction = Transform.InverseTransformVector(Ray.Direction).Normalized();
-	LocalRay.Origin = Transform.InverseTransformPosition(Ray.Origin);
-	const Vector3 L = -LocalRay.Origin; //Vector from Ray origin to Sphere position
-
-	const double tca = L | LocalRay.Direction;
-	if (tca < 0) return false;
+	double Distance;
+	bool bInside;
+	if (!GetPlacedSphereDistance(Transform, Radius, Ray, Distance, bInside) || !Ray.InRange(Distance)) return false;
 
-	const double d2 = (L | L) - tca * tca; //Distance from Sphere position to ray
-	if (d2 > Radius * Radius) return false;
+	OutHit.Object = this;
+	OutHit.Part = bInside;
+	OutHit.Depth = Distance;
 
-	const double HalfInner = sqrt(Radius * Radius - d2); //half of the ray length inside sphere
-
-	double t0 = tca - HalfInner;
-	double t1 = tca + HalfInner;
+	return true;
+}
 
-	bool bInside = false;
-	if (t0 < 0)
-	{
-		bInside = true;
-		t0 = t1;
-		if (t0 < 0) return false;
-	}
+/* Part is 1 if the ray started inside the sphere, the normal then points inwards */
+void OSphere::GetHitSurface(const RRay& Ray, const RPrimitiveHit& Hit, RHit& OutHit) const
+{
+	const Vector3 LocalDirection = Transform.InverseTransformVector(Ray.Direction).Normalized();
+	const Vector3 LocalOrigin = Transform.InverseTransformPosition(Ray.Origin);
 
-	const Vector3 LocalHitPoint = LocalRay.Origin + LocalRay.Direction * t0;
+	const Vector3 LocalHitPoint = LocalOrigin + LocalDirection * Hit.Depth;
 	const Vector3 HitPoint = Transform.TransformPosition(LocalHitPoint);
-	OutHit.Mat = this->Mat;
-	OutHit.Normal = bInside ? -(HitPoint - Transform.GetPosition()).Normalized() : (HitPoint - Transform.GetPosition()).Normalized();
+	OutHit.Normal = Hit.Part ? -(HitPoint - Transform.GetPosition()).Normalized() : (HitPoint - Transform.GetPosition()).Normalized();
 	OutHit.Position = HitPoint;
-	OutHit.Depth = t0;
+}
+
+bool OPlane::FindHit(const RRay& Ray, RPrimitiveHit& OutHit) const
+{
+	double Distance;
+	if (!GetPlaneDistance(Transform.GetPosition(), Normal, Ray, Distance) || !Ray.InRange(Distance)) return false;
 
+	OutHit.Object = this;
+	OutHit.Depth = Distance;
 	return true;
 }
 
-bool OPlane::Intersects(const RRay& Ray, RHit& OutHit) const
+void OPlane::GetHitSurface(const RRay& Ray, const RPrimitiveHit& Hit, RHit& OutHit) const
 {
-	const double Denom = Normal | Ray.Direction;
-	if (abs(Denom) > 1e-10)
-	{
-		const double T = ((Transform.GetPosition() - Ray.Origin) | Normal) / Denom;
-		if (T >= 1e-5)
-		{
-			OutHit.Mat = this->Mat;
-			OutHit.Normal = this->Normal;
-			OutHit.Position = Ray.Origin + Ray.Direction * T;
-			OutHit.Depth = T;
-			return true;
-		}
-	}
-	return false;
+	OutHit.Normal = this->Normal;
+	OutHit.Position = Ray.Origin + Ray.Direction * Hit.Depth;
+}
+
+bool OSphere::Occludes(const RRay& Ray, const double MaxDistance) const
+{
+	double Distance;
+	bool bInside;
+	return GetPlacedSphereDistance(Transform, Radius, Ray, Distance, bInside) && Distance < MaxDistance;
+}
+
+bool OPlane::Occludes(const RRay& Ray, const double MaxDistance) const
+{
+	double Distance;
+	return GetPlaneDistance(Transform.GetPosition(), Normal, Ray, Distance) && Distance < MaxDistance;
 }
 
 OMesh::OMesh(const char* Path)
@@ -100,10 +147,19 @@ OMesh::OMesh(const char* Path)
 	LoadModel(Path);
 }
 
+OMesh::~OMesh() = default;
+
 bool OMesh::LoadModel(const std::string& Path)
 {
-	Triangles.clear();
-	Vertices.clear();
+	Positions.clear();
+	Normals.clear();
+	UVs.clear();
+	Indices.clear();
+	FaceGroups.clear();
+	FaceCount = 0;
+	MeshBVH = nullptr;
+	MeshQuantizedBVH = nullptr;
+	FaceSources.clear();
 
 
 	std::ifstream In;
@@ -114,6 +170,10 @@ bool OMesh::LoadModel(const std::string& Path)
 		return false;
 	}
 
+	/* Texture coordinates have their own indices in the file, a vertex keeps the first one a face gives it */
+	std::vector<Vector2> TextureCoordinates;
+	std::vector<bool> bHasUV;
+
 	std::string Line;
 	while (!In.eof())
 	{
@@ -125,7 +185,7 @@ bool OMesh::LoadModel(const std::string& Path)
 			iss >> Trash;
 			Vector3 V;
 			iss >> V.X >> V.Y >> V.Z;
-			Vertices.push_back(MakeShared<Vertex>(V, Vector3(0.0)));
+			Positions.push_back(V);
 		}
 		else if (Line.substr(0, 3) == "vn ")
 		{
@@ -137,48 +197,79 @@ bool OMesh::LoadModel(const std::string& Path)
 		{
 			iss >> Trash >> Trash;
 			Vector2 UV;
-			iss >> UV.X >> UV.Y;			
+			iss >> UV.X >> UV.Y;
+			TextureCoordinates.push_back(UV);
 		}
 		else if (Line.substr(0, 2) == "f ")
 		{
 			iss >> Trash;
-			uint32_t F, T, N;
-			std::string S1, S2, S3;
-			auto Tri = MakeShared<Triangle>();
-			iss >> S1 >> S2 >> S3;
-			
-			F = std::stoi(S1);
-			Tri->SetVertex(0, Vertices[F - 1]);
-			F = std::stoi(S2);
-			Tri->SetVertex(1, Vertices[F - 1]);
-			F = std::stoi(S3);
-			Tri->SetVertex(2, Vertices[F - 1]);
-
-			Triangles.push_back(Tri);
+			std::string Corners[3];
+			iss >> Corners[0] >> Corners[1] >> Corners[2];
+
+			for (const std::string& Corner : Corners)
+			{
+				const uint32_t V = std::stoi(Corner) - 1;
+				Indices.push_back(V);
+
+				// Corners are written as v, v/vt, v//vn or v/vt/vn
+				const size_t Slash = Corner.find('/');
+				if (Slash == std::string::npos || Slash + 1 >= Corner.size() || Corner[Slash + 1] == '/') continue;
+
+				const uint32_t T = std::stoi(Corner.substr(Slash + 1)) - 1;
+				if (T >= TextureCoordinates.size()) continue;
+
+				if (UVs.size() < Positions.size())
+				{
+					UVs.resize(Positions.size(), Vector2(0.0));
+					bHasUV.resize(Positions.size(), false);
+				}
+				if (!bHasUV[V])
+				{
+					UVs[V] = TextureCoordinates[T];
+					bHasUV[V] = true;
+				}
+			}
 		}
 	}
 	In.close();
 
+	if (!UVs.empty()) UVs.resize(Positions.size(), Vector2(0.0));
+
+	Positions.shrink_to_fit();
+	Indices.shrink_to_fit();
+	FaceCount = static_cast<uint32_t>(Indices.size() / 3);
+
 	UpdateAABB();
 	UpdateSmoothNormals();
+	UpdateFaceRecords();
 
-	LOG("Mesh", LogType::LOG, "Successfully loaded mesh {}, V:{}, F:{}, Extent:({})",
+	LOG("Mesh", LogType::LOG, "Successfully loaded mesh {}, V:{}, F:{}, Extent:({}), {:.2f} MB, {:.1f} Bytes per Face",
 		Path,
 		CountVerts(),
 		CountFaces(),
-		BBox.GetExtent().ToString());
+		BBox.GetExtent().ToString(),
+		GetGeometryBytes() / 1048576.0,
+		CountFaces() > 0 ? static_cast<double>(GetGeometryBytes()) / CountFaces() : 0.0);
 	
 	return true;
 }
 
+size_t OMesh::GetGeometryBytes() const
+{
+	return Positions.capacity() * sizeof(Vector3)
+		+ Normals.capacity() * sizeof(Vector3)
+		+ UVs.capacity() * sizeof(Vector2)
+		+ Indices.capacity() * sizeof(uint32_t)
+		+ FaceGroups.capacity() * sizeof(TriangleRecordGroup)
+		+ FaceSources.capacity() * sizeof(uint32_t);
+}
+
 void OMesh::UpdateAABB()
 {
 	Vector3 Min(DBL_MAX), Max(-DBL_MAX);
 
-	for (size_t i = 0; i < CountVerts(); i++)
+	for (const Vector3& V : Positions)
 	{
-		Vector3 V = Vertices[i]->Position;
-		
 		Min.X = std::min(Min.X, V.X);
 		Min.Y = std::min(Min.Y, V.Y);
 		Min.Z = std::min(Min.Z, V.Z);
@@ -192,13 +283,13 @@ void OMesh::UpdateAABB()
 	BBox.Max = Max;
 }
 
-AABB Triangle::GetBoundingBox() const
+AABB OMesh::GetFaceBoundingBox(const uint32_t Face) const
 {
 	Vector3 Max, Min;
 
-	const Vector3 P1 = Transform.TransformPosition(Vertices[0]->Position);
-	const Vector3 P2 = Transform.TransformPosition(Vertices[1]->Position);
-	const Vector3 P3 = Transform.TransformPosition(Vertices[2]->Position);
+	const Vector3& P1 = GetFacePosition(Face, 0);
+	const Vector3& P2 = GetFacePosition(Face, 1);
+	const Vector3& P3 = GetFacePosition(Face, 2);
 
 	Max.X = std::max(std::max(P1.X, P2.X), P3.X);
 	Max.Y = std::max(std::max(P1.Y, P2.Y), P3.Y);
@@ -211,94 +302,861 @@ AABB Triangle::GetBoundingBox() const
 	return AABB(Min, Max);
 }
 
-/* Moller-Trumbore intersection algorithm */
-bool Triangle::Intersects(const RRay& Ray, RHit& OutHit) const
+/* Sutherland-Hodgman clipping of the face against the six planes of Clip */
+AABB OMesh::GetFaceClippedBoundingBox(const uint32_t Face, const AABB& Clip) const
 {
-	RRay LocalRay;
-	LocalRay.Origin = Transform.InverseTransformPosition(Ray.Origin);
-	LocalRay.Direction = Transform.InverseTransformVector(Ray.Direction).Normalized();
+	// Every plane adds at most one vertex, so the polygon never has more than 9
+	Vector3 Polygon[9];
+	Vector3 Clipped[9];
+	uint32_t Count = 3;
+	for (uint8_t i = 0; i < 3; i++)
+	{
+		Polygon[i] = GetFacePosition(Face, i);
+	}
 
-	const Vertex V1 = *Vertices[0];
-	const Vertex V2 = *Vertices[1];
-	const Vertex V3 = *Vertices[2];
+	for (uint8_t Plane = 0; Plane < 6 && Count > 0; Plane++)
+	{
+		const uint8_t Axis = Plane / 2;
+		const bool bMaxPlane = Plane % 2 == 1;
+		const double Bound = bMaxPlane ? Clip.Max[Axis] : Clip.Min[Axis];
+		auto IsInside = [Axis, bMaxPlane, Bound](const Vector3& Point) { return bMaxPlane ? Point[Axis] <= Bound : Point[Axis] >= Bound; };
 
-	Vector3 Edge1 = V2.Position - V1.Position;
-	Vector3 Edge2 = V3.Position - V1.Position;
-	Vector3 P = LocalRay.Direction ^ Edge2;
+		// Most planes don't cut the polygon at all
+		if (std::all_of(Polygon, Polygon + Count, IsInside)) continue;
 
-	double Det = P | Edge1;
-	if (std::abs(Det) < SMALL_NUMBER) return false;
+		uint32_t ClippedCount = 0;
+		for (uint32_t i = 0; i < Count; i++)
+		{
+			const Vector3& Current = Polygon[i];
+			const Vector3& Next = Polygon[(i + 1) % Count];
+			const bool bCurrentInside = IsInside(Current);
 
-	double InvDet = 1.0 / Det;
+			if (bCurrentInside) Clipped[ClippedCount++] = Current;
+			if (bCurrentInside != IsInside(Next))
+			{
+				const double T = (Bound - Current[Axis]) / (Next[Axis] - Current[Axis]);
+				Clipped[ClippedCount++] = Current + (Next - Current) * T;
+			}
+		}
 
-	Vector3 T = LocalRay.Origin - V1.Position;
-	const double U = (T | P) * InvDet;
-	if (U < 0.0 || U > 1.0) return false;
+		std::copy(Clipped, Clipped + ClippedCount, Polygon);
+		Count = ClippedCount;
+	}
 
-	Vector3 Q = T ^ Edge1;
-	const double V = (LocalRay.Direction | Q) * InvDet;
-	if (V < 0.0 || U + V > 1.0) return false;
+	AABB Box = AABB::Empty();
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		Box.Expand(Polygon[i]);
+	}
 
-	if ((Edge2 | Q) * InvDet < SMALL_NUMBER) return false;
+	// Intersection points can land slightly outside the planes
+	Box.Clip(Clip);
+	return Box;
+}
+
+void OMesh::UpdateFaceRecords()
+{
+	const int32_t StoredFaces = static_cast<int32_t>(CountStoredFaces());
+	FaceGroups.assign((StoredFaces + TRIANGLE_GROUP_SIZE - 1) / TRIANGLE_GROUP_SIZE, TriangleRecordGroup());
+
+	#pragma omp parallel for
+	for (int32_t Face = 0; Face < StoredFaces; Face++)
+	{
+		const TriangleRecord Record(GetFacePosition(Face, 0), GetFacePosition(Face, 1), GetFacePosition(Face, 2));
+		FaceGroups[Face / TRIANGLE_GROUP_SIZE].SetRecord(Face % TRIANGLE_GROUP_SIZE, Record);
+	}
+}
+
+void OMesh::GetFaceSurface(const RPrimitiveHit& Hit, RHit& OutHit) const
+{
+	const uint32_t* FaceIndices = &Indices[3 * Hit.Part];
+	const double W = 1.0 - Hit.U - Hit.V;
+	OutHit.Position = Hit.U * Positions[FaceIndices[1]] + Hit.V * Positions[FaceIndices[2]] + W * Positions[FaceIndices[0]];
 
-	OutHit.Mat = this->Mat;	
-	OutHit.Position = Transform.TransformPosition(LocalRay.Origin + LocalRay.Direction * (Edge2 | Q) * InvDet);
-	OutHit.Depth = (Ray.Origin - OutHit.Position).Length();
-	
 	if (bSmoothShading)
 	{
-		OutHit.Normal = U * V2.Normal + V * V3.Normal + (1.0 - U - V) * V1.Normal;
+		OutHit.Normal = (Hit.U * Normals[FaceIndices[1]] + Hit.V * Normals[FaceIndices[2]] + W * Normals[FaceIndices[0]]).Normalized();
 	}
 	else
 	{
-		OutHit.Normal = (Edge1 ^ Edge2).Normalized();
+		OutHit.Normal = GetFaceRawNormal(Hit.Part).Normalized();
 	}
-	OutHit.Normal = Transform.TransformVector(OutHit.Normal).Normalized();
+}
+
+/* 
+ * The ray is in object space with a normalized direction, so the distance to the plane is the hit depth.
+ * The vertices are only read by GetFaceSurface. Hits are within [max(TMin, SMALL_NUMBER), TMax) like in the group kernels.
+ */
+bool OMesh::IntersectsFace(const uint32_t Face, const RRay& Ray, RPrimitiveHit& OutHit) const
+{
+	const TriangleRecord Record = FaceGroups[Face / TRIANGLE_GROUP_SIZE].GetRecord(Face % TRIANGLE_GROUP_SIZE);
+
+	const double Depth = Record.GetPlaneDistance(Ray);
+	if (!(Depth >= std::max(Ray.TMin, SMALL_NUMBER) && Depth < Ray.TMax)) return false;
+
+	double U, V;
+	if (!Record.GetBarycentrics(Ray.Origin + Ray.Direction * Depth, U, V)) return false;
 
+	OutHit.Part = Face;
+	OutHit.Depth = Depth;
+	OutHit.U = U;
+	OutHit.V = V;
 	return true;
 }
 
+/* Same test as IntersectsFace without the hit record */
+bool OMesh::OccludesFace(const uint32_t Face, const RRay& Ray, const double MaxDistance) const
+{
+	const TriangleRecord Record = FaceGroups[Face / TRIANGLE_GROUP_SIZE].GetRecord(Face % TRIANGLE_GROUP_SIZE);
+
+	const double Distance = Record.GetPlaneDistance(Ray);
+	if (!(Distance >= std::max(Ray.TMin, SMALL_NUMBER) && Distance < std::min(Ray.TMax, MaxDistance))) return false;
+
+	double U, V;
+	return Record.GetBarycentrics(Ray.Origin + Ray.Direction * Distance, U, V);
+}
+
+bool OMesh::IntersectsFaces(const uint32_t First, const uint32_t Count, RRay& ClippedRay, RPrimitiveHit& OutHit) const
+{
+	bool bHit = false;
+	const uint32_t EndGroup = (First + Count + TRIANGLE_GROUP_SIZE - 1) / TRIANGLE_GROUP_SIZE;
+	for (uint32_t Group = First / TRIANGLE_GROUP_SIZE; Group < EndGroup; Group++)
+	{
+		TriangleGroupHits Hits;
+		for (uint32_t Mask = TriangleGroup::Intersect(FaceGroups[Group], ClippedRay, Hits); Mask; Mask &= Mask - 1)
+		{
+			// Lanes are visited in face order, like one face at a time
+			const uint32_t Lane = std::countr_zero(Mask);
+			if (Hits.Distance[Lane] >= ClippedRay.TMax) continue;
+
+			OutHit.Part = Group * TRIANGLE_GROUP_SIZE + Lane;
+			OutHit.Depth = Hits.Distance[Lane];
+			OutHit.U = Hits.U[Lane];
+			OutHit.V = Hits.V[Lane];
+			ClippedRay.TMax = Hits.Distance[Lane];
+			bHit = true;
+		}
+	}
+	return bHit;
+}
+
+bool OMesh::OccludesFaces(const uint32_t First, const uint32_t Count, const RRay& Ray, const double MaxDistance) const
+{
+	RRay ClippedRay = Ray;
+	ClippedRay.TMax = std::min(Ray.TMax, MaxDistance);
+
+	const uint32_t EndGroup = (First + Count + TRIANGLE_GROUP_SIZE - 1) / TRIANGLE_GROUP_SIZE;
+	for (uint32_t Group = First / TRIANGLE_GROUP_SIZE; Group < EndGroup; Group++)
+	{
+		TriangleGroupHits Hits;
+		if (TriangleGroup::Intersect(FaceGroups[Group], ClippedRay, Hits)) return true;
+	}
+	return false;
+}
+
 void OMesh::UpdateSmoothNormals()
 {
-	#pragma omp parallel for
-	for (int32_t i = 0; i < CountFaces(); i++)
+	Normals.assign(Positions.size(), Vector3(0.0));
+
+	// Faces share vertices, so the sums are accumulated on one thread. Copies of a face are only summed once
+	std::vector<bool> bSummed(FaceSources.empty() ? 0 : CountFaces(), false);
+	for (uint32_t Face = 0; Face < CountStoredFaces(); Face++)
 	{
-		const Vector3 Normal = Triangles[i]->RawNormal();
-		Triangles[i]->GetVertex(0)->Normal += Normal;
-		Triangles[i]->GetVertex(1)->Normal += Normal;
-		Triangles[i]->GetVertex(2)->Normal += Normal;
+		if (!FaceSources.empty())
+		{
+			if (bSummed[FaceSources[Face]]) continue;
+			bSummed[FaceSources[Face]] = true;
+		}
+
+		const Vector3 Normal = GetFaceRawNormal(Face);
+		Normals[Indices[3 * Face]] += Normal;
+		Normals[Indices[3 * Face + 1]] += Normal;
+		Normals[Indices[3 * Face + 2]] += Normal;
 	}
 	
 	#pragma omp parallel for
-	for (int32_t i = 0; i < CountVerts(); i++)
+	for (int32_t i = 0; i < static_cast<int32_t>(CountVerts()); i++)
 	{
-		Vertices[i]->Normal = Vertices[i]->Normal.Normalized();
+		Normals[i] = Normals[i].Normalized();
 	}
 }
 
-bool OMesh::Intersects(const RRay& Ray, RHit& OutHit) const
+void OMesh::BuildBVH(const BVHBuilder Builder, const std::string& CacheDirectory)
 {
-	RRay LocalRay;
-	LocalRay.Origin = Transform.InverseTransformPosition(Ray.Origin);
-	LocalRay.Direction = Transform.InverseTransformVector(Ray.Direction).Normalized();
+	if (HasBVH(Builder)) return;
 
+	// The stored faces hold copies and padding for the leaves of the old BVH, the new one starts from the loaded faces
+	RestoreLoadedFaces();
+	MeshBVH = nullptr;
+	MeshQuantizedBVH = nullptr;
+	MeshBVHBuilder = Builder;
 
-	if (!BBox.Intersects(LocalRay)) return false;
+	std::string CachePath;
+	uint64_t CacheKey = 0;
+	if (!CacheDirectory.empty())
+	{
+		CacheKey = BVHCache::MakeKey(ComputeGeometryHash(), Builder);
+		CachePath = BVHCache::GetPath(CacheDirectory, CacheKey);
 
-	double Distance = INFINITY;
-	bool bHit = false;
+		MeshBVH = BVHCache::Load(CachePath, CacheKey, static_cast<uint32_t>(CountFaces()));
+		if (MeshBVH)
+		{
+			LOG("Mesh", LogType::LOG, "BVH was loaded from {}", CachePath);
+			StoreFacesInLeafOrder();
+			return;
+		}
+	}
 
+	/* The builders work on primitives, so every face is wrapped in one until the BVH is done */
+	const int32_t LoadedFaces = static_cast<int32_t>(CountFaces());
+	std::vector<SharedPtr<RPrimitive>> Faces(LoadedFaces);
 	#pragma omp parallel for
-	for (int32_t i = 0; i < CountFaces(); i++)
+	for (int32_t Face = 0; Face < LoadedFaces; Face++)
+	{
+		Faces[Face] = MakeShared<OMeshFace>(*this, Face);
+	}
+
+	const auto StartTime = std::chrono::high_resolution_clock::now();
+	MeshBVH = CreateBVH(Faces, Builder);
+	const auto EndTime = std::chrono::high_resolution_clock::now();
+
+	// Traversal only needs the face indices
+	std::vector<SharedPtr<RPrimitive>>().swap(MeshBVH->Primitives);
+
+	const std::chrono::duration<double> DeltaTime = EndTime - StartTime;
+	LOG("Mesh", LogType::LOG, "BVH was built in {:.2f} seconds, {} Nodes, {} References to {} Faces, SAH cost {:.2f}",
+		DeltaTime.count(),
+		MeshBVH->Nodes.size(),
+		MeshBVH->PrimitiveIndices.size(),
+		CountFaces(),
+		MeshBVH->BuildCost);
+
+	if (!CachePath.empty() && BVHCache::Save(CachePath, CacheKey, *MeshBVH))
 	{
-		RHit TempHit;
-		if (Triangles[i]->Intersects(Ray, TempHit) && TempHit.Depth < Distance)
+		LOG("Mesh", LogType::LOG, "BVH was saved to {}", CachePath);
+	}
+
+	StoreFacesInLeafOrder();
+}
+
+void OMesh::StoreFacesInLeafOrder()
+{
+	CollapseBVHLeaves(*MeshBVH, TRIANGLE_GROUP_SIZE);
+
+	const uint32_t ReferencedFaces = static_cast<uint32_t>(MeshBVH->PrimitiveIndices.size());
+	constexpr uint32_t Unplaced = UINT32_MAX;
+
+	std::vector<uint32_t> NewVertices(CountVerts(), Unplaced);
+	std::vector<uint32_t> StoredIndices;
+	StoredIndices.reserve(Indices.size() + 3 * TRIANGLE_GROUP_SIZE * CountLeaves(*MeshBVH));
+	FaceSources.reserve(CountFaces() + TRIANGLE_GROUP_SIZE * CountLeaves(*MeshBVH));
+	uint32_t VertexCount = 0;
+
+	auto Store = [&](const uint32_t Face)
+	{
+		FaceSources.push_back(Face);
+		for (uint8_t Corner = 0; Corner < 3; Corner++)
 		{
+			uint32_t& Vertex = NewVertices[Indices[3 * Face + Corner]];
+			if (Vertex == Unplaced) Vertex = VertexCount++;
+			StoredIndices.push_back(Vertex);
+		}
+	};
+
+	/* Spatial splits can reference a face from several leaves, each of them gets a copy */
+	for (LinearBVHNode& Node : MeshBVH->Nodes)
+	{
+		if (!Node.IsLeaf()) continue;
+
+		const uint32_t* LeafFaces = &MeshBVH->PrimitiveIndices[Node.Offset];
+		Node.Offset = static_cast<uint32_t>(StoredIndices.size() / 3);
+		for (uint32_t i = 0; i < Node.PrimitiveCount; i++)
+		{
+			Store(LeafFaces[i]);
+		}
+
+		// The padding lanes hit exactly where the last face does, so they never change the result
+		for (uint32_t i = Node.PrimitiveCount; i % TRIANGLE_GROUP_SIZE != 0; i++)
+		{
+			Store(LeafFaces[Node.PrimitiveCount - 1]);
+		}
+	}
+	Indices = std::move(StoredIndices);
+
+	const uint32_t StoredFaces = static_cast<uint32_t>(CountStoredFaces());
+	std::vector<uint32_t>().swap(MeshBVH->PrimitiveIndices);
+
+	// Vertices no face uses go to the end
+	for (uint32_t& Vertex : NewVertices)
+	{
+		if (Vertex == Unplaced) Vertex = VertexCount++;
+	}
+
+	auto Reorder = [&NewVertices](auto& Attributes)
+	{
+		if (Attributes.empty()) return;
+
+		std::remove_reference_t<decltype(Attributes)> Stored(Attributes.size());
+		for (size_t i = 0; i < Attributes.size(); i++)
+		{
+			Stored[NewVertices[i]] = Attributes[i];
+		}
+		Attributes = std::move(Stored);
+	};
+	Reorder(Positions);
+	Reorder(Normals);
+	Reorder(UVs);
+
+	UpdateFaceRecords();
+
+	LOG("Mesh", LogType::LOG, "{} Faces stored in {} groups of {}, {:.1f}% of the lanes used, {} kernel",
+		StoredFaces,
+		FaceGroups.size(),
+		TRIANGLE_GROUP_SIZE,
+		StoredFaces > 0 ? 100.0 * ReferencedFaces / StoredFaces : 0.0,
+		TriangleGroup::GetKernelName());
+}
+
+void OMesh::CompressBVH()
+{
+	if (!MeshBVH || MeshQuantizedBVH) return;
+
+	MeshQuantizedBVH = QuantizeBVH(*MeshBVH);
+
+	const size_t FullPrecisionBytes = MeshBVH->Nodes.size() * sizeof(LinearBVHNode);
+	std::vector<LinearBVHNode>().swap(MeshBVH->Nodes);
+
+	LOG("Mesh", LogType::LOG, "BVH was compressed from {:.2f} MB to {:.2f} MB",
+		FullPrecisionBytes / 1048576.0,
+		MeshQuantizedBVH->Nodes.size() * sizeof(QuantizedBVHNode) / 1048576.0);
+}
+
+void OMesh::DecompressBVH()
+{
+	if (!MeshQuantizedBVH) return;
+
+	MeshBVH->Nodes = RestoreBVHNodes();
+	MeshQuantizedBVH = nullptr;
+}
+
+std::vector<LinearBVHNode> OMesh::RestoreBVHNodes() const
+{
+	if (!MeshQuantizedBVH) return MeshBVH ? MeshBVH->Nodes : std::vector<LinearBVHNode>();
+
+	std::vector<LinearBVHNode> Nodes = DequantizeBVH(*MeshQuantizedBVH);
+	for (LinearBVHNode& Node : Nodes)
+	{
+		if (!Node.IsLeaf()) continue;
+
+		// Faces of spatial splits can reach out of their leaf, the decoded box bounds the part inside it
+		AABB Box = GetFaceBoundingBox(Node.Offset);
+		for (uint32_t Face = Node.Offset + 1; Face < Node.Offset + Node.PrimitiveCount; Face++)
+		{
+			Box.Expand(GetFaceBoundingBox(Face));
+		}
+		Box.Clip(Node.Box);
+		Node.Box = Box;
+	}
+	ComputeInnerBounds(Nodes);
+
+	return Nodes;
+}
+
+void OMesh::RestoreLoadedFaces()
+{
+	if (FaceSources.empty()) return;
+
+	// Copies of a loaded face hold the same vertices
+	std::vector<uint32_t> LoadedIndices(3 * CountFaces());
+	for (uint32_t Face = 0; Face < FaceSources.size(); Face++)
+	{
+		std::copy_n(&Indices[3 * Face], 3, &LoadedIndices[3 * FaceSources[Face]]);
+	}
+	Indices = std::move(LoadedIndices);
+	std::vector<uint32_t>().swap(FaceSources);
+
+	UpdateFaceRecords();
+}
+
+uint64_t OMesh::ComputeGeometryHash() const
+{
+	uint64_t Hash = BVHCache::HASH_SEED;
+	for (const uint32_t Index : Indices)
+	{
+		const Vector3& Position = Positions[Index];
+		const double Coordinates[3] = { Position.X, Position.Y, Position.Z };
+		Hash = BVHCache::HashBytes(Hash, Coordinates, sizeof(Coordinates));
+	}
+	return Hash;
+}
+
+AABB OMesh::GetInstanceBoundingBox(const RTransform& InstanceTransform) const
+{
+	return ToWorldBoundingBox(InstanceTransform, BBox);
+}
+
+void OMesh::GetInstanceHitSurface(const RTransform& InstanceTransform, const RPrimitiveHit& Hit, RHit& OutHit) const
+{
+	RHit LocalHit;
+	GetFaceSurface(Hit, LocalHit);
+	OutHit.Position = InstanceTransform.TransformPosition(LocalHit.Position);
+	OutHit.Normal = InstanceTransform.TransformVectorNoScale(LocalHit.Normal / InstanceTransform.GetScale()).Normalized();
+}
+
+/* Faces of a mesh whose BVH leaves own whole groups of them, see ScenePrimitiveList and StoreFacesInLeafOrder */
+struct MeshFaceList
+{
+	const OMesh& Mesh;
+
+	bool IntersectsLeaf(const uint32_t First, const uint32_t Count, RRay& ClippedRay, RPrimitiveHit& OutHit) const
+	{
+		return Mesh.IntersectsFaces(First, Count, ClippedRay, OutHit);
+	}
+
+	bool OccludesLeaf(const uint32_t First, const uint32_t Count, const RRay& Ray, const double MaxDistance) const
+	{
+		return Mesh.OccludesFaces(First, Count, Ray, MaxDistance);
+	}
+
+	uint32_t IntersectsPacket(const uint32_t Reference, const RRay* Rays, uint32_t Mask, RPrimitiveHit* OutHits) const
+	{
+		uint32_t HitMask = 0;
+		for (; Mask; Mask &= Mask - 1)
+		{
+			const uint32_t i = std::countr_zero(Mask);
+			RPrimitiveHit TempHit;
+			if (Mesh.IntersectsFace(Reference, Rays[i], TempHit) && TempHit.Depth < Rays[i].TMax)
+			{
+				OutHits[i] = TempHit;
+				HitMask |= 1u << i;
+			}
+		}
+		return HitMask;
+	}
+};
+
+bool OMesh::IntersectsInstance(const RTransform& InstanceTransform, const RRay& Ray, RPrimitiveHit& OutHit) const
+{
+	const RRay LocalRay = ToObjectSpace(InstanceTransform, Ray);
+
+	RPrimitiveHit LocalHit;
+	bool bHit = false;
+	if (MeshQuantizedBVH)
+	{
+		bHit = QuantizedBVHTraverse(*MeshQuantizedBVH, MeshFaceList{ *this }, LocalRay, LocalHit);
+	}
+	else if (MeshBVH)
+	{
+		bHit = BVHTraverse(*MeshBVH, MeshFaceList{ *this }, LocalRay, LocalHit);
+	}
+	else
+	{
+		RRay ClippedRay = LocalRay;
+		bHit = IntersectsFaces(0, static_cast<uint32_t>(CountStoredFaces()), ClippedRay, LocalHit);
+	}
+	if (!bHit) return false;
+
+	OutHit = LocalHit;
+	OutHit.Object = this;
+	OutHit.Depth = ToWorldDepth(InstanceTransform, Ray, LocalRay, LocalHit.Depth);
+	return true;
+}
+
+/* 
+ * Trace the object space rays as one packet, their hits go to OutLocalHits at the index of the world space ray.
+ * Returns false without tracing if the rays aren't coherent in object space.
+ */
+template<uint32_t Size>
+static bool TraceMeshPacket(const LinearBVH& BVH, const MeshFaceList& Faces, const RRay* LocalRays, const uint32_t* RayIndices, const uint32_t Count, RPrimitiveHit* OutLocalHits, uint32_t& OutHitMask)
+{
+	RayPacket<Size> Packet(LocalRays, Count);
+	if (!Packet.bCoherent) return false;
+
+	RPrimitiveHit LocalHits[Size];
+	OutHitMask = 0;
+	for (uint32_t Mask = BVHTraversePacket(BVH, Faces, Packet, LocalHits); Mask; Mask &= Mask - 1)
+	{
+		const uint32_t k = std::countr_zero(Mask);
+		OutLocalHits[RayIndices[k]] = LocalHits[k];
+		OutHitMask |= 1u << RayIndices[k];
+	}
+	return true;
+}
+
+uint32_t OMesh::IntersectsInstancePacket(const RTransform& InstanceTransform, const RRay* Rays, const uint32_t Mask, RPrimitiveHit* OutHits) const
+{
+	auto TraceRays = [&]()
+	{
+		uint32_t HitMask = 0;
+		for (uint32_t RayMask = Mask; RayMask; RayMask &= RayMask - 1)
+		{
+			const uint32_t i = std::countr_zero(RayMask);
+			RPrimitiveHit TempHit;
+			if (IntersectsInstance(InstanceTransform, Rays[i], TempHit) && TempHit.Depth < Rays[i].TMax)
+			{
+				OutHits[i] = TempHit;
+				HitMask |= 1u << i;
+			}
+		}
+		return HitMask;
+	};
+
+	// Quantized nodes are only traversed ray by ray
+	const bool bPacket = MeshBVH && !MeshQuantizedBVH && Mask < (static_cast<uint64_t>(1) << RAY_PACKET_MAX_SIZE)
+		&& static_cast<uint32_t>(std::popcount(Mask)) >= RAY_PACKET_MIN_ACTIVE_RAYS;
+	if (!bPacket) return TraceRays();
+
+	RRay LocalRays[RAY_PACKET_MAX_SIZE];
+	uint32_t RayIndices[RAY_PACKET_MAX_SIZE];
+	uint32_t Count = 0;
+	for (uint32_t RayMask = Mask; RayMask; RayMask &= RayMask - 1)
+	{
+		RayIndices[Count] = std::countr_zero(RayMask);
+		LocalRays[Count] = ToObjectSpace(InstanceTransform, Rays[RayIndices[Count]]);
+		Count++;
+	}
+
+	const MeshFaceList Faces{ *this };
+	RPrimitiveHit LocalHits[RAY_PACKET_MAX_SIZE];
+	uint32_t LocalMask = 0;
+	bool bTraced;
+	if (Count <= 4) bTraced = TraceMeshPacket<4>(*MeshBVH, Faces, LocalRays, RayIndices, Count, LocalHits, LocalMask);
+	else if (Count <= 8) bTraced = TraceMeshPacket<8>(*MeshBVH, Faces, LocalRays, RayIndices, Count, LocalHits, LocalMask);
+	else bTraced = TraceMeshPacket<RAY_PACKET_MAX_SIZE>(*MeshBVH, Faces, LocalRays, RayIndices, Count, LocalHits, LocalMask);
+
+	// The instance transform can make a packet diverge, it is then traced ray by ray
+	if (!bTraced) return TraceRays();
+
+	uint32_t HitMask = 0;
+	for (uint32_t k = 0; k < Count; k++)
+	{
+		const uint32_t i = RayIndices[k];
+		if (!(LocalMask & (1u << i))) continue;
+
+		const double Depth = ToWorldDepth(InstanceTransform, Rays[i], LocalRays[k], LocalHits[i].Depth);
+		if (Depth < Rays[i].TMax)
+		{
+			OutHits[i] = LocalHits[i];
+			OutHits[i].Object = this;
+			OutHits[i].Depth = Depth;
+			HitMask |= 1u << i;
+		}
+	}
+	return HitMask;
+}
+
+bool OMesh::OccludesInstance(const RTransform& InstanceTransform, const RRay& Ray, const double MaxDistance) const
+{
+	const Vector3 LocalDirection = InstanceTransform.InverseTransformVector(Ray.Direction);
+
+	/* Distances along the ray scale uniformly between the spaces */
+	const double LocalScale = LocalDirection.Length() / Ray.Direction.Length();
+	const double LocalMaxDistance = std::min(MaxDistance, Ray.TMax) * LocalScale;
+	const RRay LocalRay(InstanceTransform.InverseTransformPosition(Ray.Origin), LocalDirection.Normalized(), Ray.TMin * LocalScale, LocalMaxDistance);
+
+	if (MeshQuantizedBVH) return QuantizedBVHOccluded(*MeshQuantizedBVH, MeshFaceList{ *this }, LocalRay, LocalMaxDistance);
+	if (MeshBVH) return BVHOccluded(*MeshBVH, MeshFaceList{ *this }, LocalRay, LocalMaxDistance);
+
+	return OccludesFaces(0, static_cast<uint32_t>(CountStoredFaces()), LocalRay, LocalMaxDistance);
+}
+
+bool OMesh::FindHit(const RRay& Ray, RPrimitiveHit& OutHit) const
+{
+	return IntersectsInstance(Transform, Ray, OutHit);
+}
+
+bool OMeshFace::FindHit(const RRay& Ray, RPrimitiveHit& OutHit) const
+{
+	if (!Mesh.IntersectsFace(Face, Ray, OutHit)) return false;
+
+	OutHit.Object = this;
+	return true;
+}
+
+/* The mesh reports itself as the object hit, the instance takes its place so GetHit uses its transform and material */
+bool OMeshInstance::FindHit(const RRay& Ray, RPrimitiveHit& OutHit) const
+{
+	if (!Mesh->IntersectsInstance(Transform, Ray, OutHit)) return false;
+
+	OutHit.Object = this;
+	return true;
+}
+
+
+OSphereCloud::~OSphereCloud() = default;
+
+void OSphereCloud::Reserve(const uint32_t Count)
+{
+	SphereGroups.reserve((Count + SPHERE_GROUP_SIZE - 1) / SPHERE_GROUP_SIZE);
+	MaterialIndices.reserve(Count);
+}
+
+uint32_t OSphereCloud::AddSphere(const Vector3& Center, const double Radius, const uint16_t MaterialIndex)
+{
+	if (CloudBVH)
+	{
+		LOG("SphereCloud", LogType::ERROR, "Spheres can't be added after the BVH was built");
+		return UINT32_MAX;
+	}
+
+	// Until the BVH is built the spheres are stored in the order they are added
+	const uint32_t Sphere = CountStoredSpheres();
+	if (Sphere % SPHERE_GROUP_SIZE == 0) SphereGroups.emplace_back();
+	SphereGroups.back().SetSphere(Sphere % SPHERE_GROUP_SIZE, Center, Radius);
+	MaterialIndices.push_back(MaterialIndex);
+
+	BBox.Expand(GetSphereBoundingBox(Sphere));
+	SphereCount++;
+	return Sphere;
+}
+
+uint16_t OSphereCloud::AddMaterial(const SharedPtr<RMaterial>& Material)
+{
+	Materials.push_back(Material);
+	return static_cast<uint16_t>(Materials.size() - 1);
+}
+
+size_t OSphereCloud::GetGeometryBytes() const
+{
+	return SphereGroups.capacity() * sizeof(SphereRecordGroup)
+		+ MaterialIndices.capacity() * sizeof(uint16_t)
+		+ SphereSources.capacity() * sizeof(uint32_t);
+}
+
+/* Bounds of the stored sphere, its float center and radius */
+AABB OSphereCloud::GetSphereBoundingBox(const uint32_t Sphere) const
+{
+	const Vector3 Center = GetSphereCenter(Sphere);
+	const double Radius = GetSphereRadius(Sphere);
+	return AABB(Center - Vector3(Radius), Center + Vector3(Radius));
+}
+
+bool OSphereCloud::IntersectsSphere(const uint32_t Sphere, const RRay& Ray, RPrimitiveHit& OutHit) const
+{
+	double Distance;
+	bool bInside;
+	if (!GetSphereDistance(Ray.Origin - GetSphereCenter(Sphere), Ray.Direction, GetSphereRadius(Sphere), Distance, bInside) || !Ray.InRange(Distance)) return false;
+
+	OutHit.Part = bInside ? Sphere | INSIDE_PART_BIT : Sphere;
+	OutHit.Depth = Distance;
+	return true;
+}
+
+Vector3 OSphereCloud::GetSphereNormal(const uint32_t Part, const Vector3& LocalPosition) const
+{
+	const Vector3 Normal = (LocalPosition - GetSphereCenter(Part & ~INSIDE_PART_BIT)).Normalized();
+	return Part & INSIDE_PART_BIT ? -Normal : Normal;
+}
+
+bool OSphereCloud::IntersectsSpheres(const uint32_t First, const uint32_t Count, RRay& ClippedRay, RPrimitiveHit& OutHit) const
+{
+	bool bHit = false;
+	const uint32_t EndGroup = (First + Count + SPHERE_GROUP_SIZE - 1) / SPHERE_GROUP_SIZE;
+	for (uint32_t Group = First / SPHERE_GROUP_SIZE; Group < EndGroup; Group++)
+	{
+		SphereGroupHits Hits;
+		for (uint32_t Mask = SphereGroup::Intersect(SphereGroups[Group], ClippedRay, Hits); Mask; Mask &= Mask - 1)
+		{
+			// Lanes are visited in sphere order, like one sphere at a time
+			const uint32_t Lane = std::countr_zero(Mask);
+			if (Hits.Distance[Lane] >= ClippedRay.TMax) continue;
+
+			const uint32_t Sphere = Group * SPHERE_GROUP_SIZE + Lane;
+			OutHit.Part = Hits.InsideMask & (1u << Lane) ? Sphere | INSIDE_PART_BIT : Sphere;
+			OutHit.Depth = Hits.Distance[Lane];
+			ClippedRay.TMax = Hits.Distance[Lane];
 			bHit = true;
-			Distance = TempHit.Depth;
-			OutHit = TempHit;
 		}
 	}
+	return bHit;
+}
+
+bool OSphereCloud::OccludesSpheres(const uint32_t First, const uint32_t Count, const RRay& Ray, const double MaxDistance) const
+{
+	RRay ClippedRay = Ray;
+	ClippedRay.TMax = std::min(Ray.TMax, MaxDistance);
+
+	const uint32_t EndGroup = (First + Count + SPHERE_GROUP_SIZE - 1) / SPHERE_GROUP_SIZE;
+	for (uint32_t Group = First / SPHERE_GROUP_SIZE; Group < EndGroup; Group++)
+	{
+		SphereGroupHits Hits;
+		if (SphereGroup::Intersect(SphereGroups[Group], ClippedRay, Hits)) return true;
+	}
+	return false;
+}
+
+void OSphereCloud::BuildBVH(const BVHBuilder Builder)
+{
+	if (HasBVH(Builder)) return;
+
+	// Same as for meshes, the new BVH starts from the spheres as they were added
+	RestoreAddedSpheres();
+	CloudBVH = nullptr;
+	CloudBVHBuilder = Builder;
+
+	/* The builders work on primitives, so every sphere is wrapped in one until the BVH is done */
+	const int32_t Count = static_cast<int32_t>(SphereCount);
+	std::vector<SharedPtr<RPrimitive>> Spheres(Count);
+	#pragma omp parallel for
+	for (int32_t Sphere = 0; Sphere < Count; Sphere++)
+	{
+		Spheres[Sphere] = MakeShared<OCloudSphere>(*this, Sphere);
+	}
+
+	const auto StartTime = std::chrono::high_resolution_clock::now();
+	CloudBVH = CreateBVH(Spheres, Builder);
+	const auto EndTime = std::chrono::high_resolution_clock::now();
+
+	std::vector<SharedPtr<RPrimitive>>().swap(CloudBVH->Primitives);
+
+	const std::chrono::duration<double> DeltaTime = EndTime - StartTime;
+	LOG("SphereCloud", LogType::LOG, "BVH was built in {:.2f} seconds, {} Nodes, {} References to {} Spheres, SAH cost {:.2f}",
+		DeltaTime.count(),
+		CloudBVH->Nodes.size(),
+		CloudBVH->PrimitiveIndices.size(),
+		SphereCount,
+		CloudBVH->BuildCost);
+
+	StoreSpheresInLeafOrder();
+}
+
+void OSphereCloud::StoreSpheresInLeafOrder()
+{
+	CollapseBVHLeaves(*CloudBVH, SPHERE_GROUP_SIZE);
+
+	const uint32_t ReferencedSpheres = static_cast<uint32_t>(CloudBVH->PrimitiveIndices.size());
+
+	std::vector<SphereRecordGroup> StoredGroups;
+	std::vector<uint16_t> StoredMaterialIndices;
+	StoredGroups.reserve(SphereGroups.size() + CountLeaves(*CloudBVH));
+	StoredMaterialIndices.reserve(MaterialIndices.size() + SPHERE_GROUP_SIZE * CountLeaves(*CloudBVH));
+	SphereSources.reserve(StoredMaterialIndices.capacity());
+
+	auto Store = [&](const uint32_t Sphere)
+	{
+		SphereSources.push_back(Sphere);
+		const uint32_t Stored = static_cast<uint32_t>(StoredMaterialIndices.size());
+		if (Stored % SPHERE_GROUP_SIZE == 0) StoredGroups.emplace_back();
+		StoredGroups.back().SetSphere(Stored % SPHERE_GROUP_SIZE, GetSphereCenter(Sphere), GetSphereRadius(Sphere));
+		StoredMaterialIndices.push_back(MaterialIndices[Sphere]);
+	};
+
+	/* Spatial splits can reference a sphere from several leaves, each of them gets a copy */
+	for (LinearBVHNode& Node : CloudBVH->Nodes)
+	{
+		if (!Node.IsLeaf()) continue;
+
+		const uint32_t* LeafSpheres = &CloudBVH->PrimitiveIndices[Node.Offset];
+		Node.Offset = static_cast<uint32_t>(StoredMaterialIndices.size());
+		for (uint32_t i = 0; i < Node.PrimitiveCount; i++)
+		{
+			Store(LeafSpheres[i]);
+		}
+
+		// The padding lanes hit exactly where the last sphere does, so they never change the result
+		for (uint32_t i = Node.PrimitiveCount; i % SPHERE_GROUP_SIZE != 0; i++)
+		{
+			Store(LeafSpheres[Node.PrimitiveCount - 1]);
+		}
+	}
+	SphereGroups = std::move(StoredGroups);
+	MaterialIndices = std::move(StoredMaterialIndices);
+	std::vector<uint32_t>().swap(CloudBVH->PrimitiveIndices);
+
+	const uint32_t StoredSpheres = CountStoredSpheres();
+	LOG("SphereCloud", LogType::LOG, "{} Spheres stored as {} in {} groups of {}, {:.1f}% of the lanes used, {:.2f} MB, {} kernel",
+		SphereCount,
+		StoredSpheres,
+		SphereGroups.size(),
+		SPHERE_GROUP_SIZE,
+		StoredSpheres > 0 ? 100.0 * ReferencedSpheres / StoredSpheres : 0.0,
+		GetGeometryBytes() / 1048576.0,
+		SphereGroup::GetKernelName());
+}
+
+void OSphereCloud::RestoreAddedSpheres()
+{
+	if (SphereSources.empty()) return;
+
+	std::vector<SphereRecordGroup> AddedGroups((SphereCount + SPHERE_GROUP_SIZE - 1) / SPHERE_GROUP_SIZE);
+	std::vector<uint16_t> AddedMaterialIndices(SphereCount);
+	for (uint32_t Stored = 0; Stored < SphereSources.size(); Stored++)
+	{
+		const uint32_t Sphere = SphereSources[Stored];
+		AddedGroups[Sphere / SPHERE_GROUP_SIZE].SetSphere(Sphere % SPHERE_GROUP_SIZE, GetSphereCenter(Stored), GetSphereRadius(Stored));
+		AddedMaterialIndices[Sphere] = MaterialIndices[Stored];
+	}
+	SphereGroups = std::move(AddedGroups);
+	MaterialIndices = std::move(AddedMaterialIndices);
+	std::vector<uint32_t>().swap(SphereSources);
+}
+
+/* Spheres of a cloud whose BVH leaves own whole groups of them, see ScenePrimitiveList and StoreSpheresInLeafOrder */
+struct CloudSphereList
+{
+	const OSphereCloud& Cloud;
+
+	bool IntersectsLeaf(const uint32_t First, const uint32_t Count, RRay& ClippedRay, RPrimitiveHit& OutHit) const
+	{
+		return Cloud.IntersectsSpheres(First, Count, ClippedRay, OutHit);
+	}
+
+	bool OccludesLeaf(const uint32_t First, const uint32_t Count, const RRay& Ray, const double MaxDistance) const
+	{
+		return Cloud.OccludesSpheres(First, Count, Ray, MaxDistance);
+	}
+};
+
+bool OSphereCloud::FindHit(const RRay& Ray, RPrimitiveHit& OutHit) const
+{
+	const RRay LocalRay = ToObjectSpace(Transform, Ray);
+
+	RPrimitiveHit LocalHit;
+	bool bHit = false;
+	if (CloudBVH)
+	{
+		bHit = BVHTraverse(*CloudBVH, CloudSphereList{ *this }, LocalRay, LocalHit);
+	}
+	else
+	{
+		RRay ClippedRay = LocalRay;
+		bHit = IntersectsSpheres(0, CountStoredSpheres(), ClippedRay, LocalHit);
+	}
+	if (!bHit) return false;
+
+	OutHit = LocalHit;
+	OutHit.Object = this;
+	OutHit.Depth = ToWorldDepth(Transform, Ray, LocalRay, LocalHit.Depth);
+	return true;
+}
+
+bool OSphereCloud::Occludes(const RRay& Ray, const double MaxDistance) const
+{
+	// MaxDistance becomes the end of the ray, which ToObjectSpace carries over
+	RRay ClippedRay = Ray;
+	ClippedRay.TMax = std::min(MaxDistance, Ray.TMax);
+	const RRay LocalRay = ToObjectSpace(Transform, ClippedRay);
+
+	if (CloudBVH) return BVHOccluded(*CloudBVH, CloudSphereList{ *this }, LocalRay, LocalRay.TMax);
 
-	return bHit;	
-}
\ No newline at end of file
+	return OccludesSpheres(0, CountStoredSpheres(), LocalRay, LocalRay.TMax);
+}
+
+void OSphereCloud::GetHitSurface(const RRay& Ray, const RPrimitiveHit& Hit, RHit& OutHit) const
+{
+	OutHit.Position = Ray.Origin + Ray.Direction * Hit.Depth;
+
+	const Vector3 LocalNormal = GetSphereNormal(Hit.Part, Transform.InverseTransformPosition(OutHit.Position));
+	OutHit.Normal = Transform.TransformVectorNoScale(LocalNormal / Transform.GetScale()).Normalized();
+
+	const uint16_t MaterialIndex = MaterialIndices[Hit.Part & ~INSIDE_PART_BIT];
+	if (MaterialIndex < Materials.size()) OutHit.Mat = Materials[MaterialIndex].get();
+}
+
+bool OCloudSphere::FindHit(const RRay& Ray, RPrimitiveHit& OutHit) const
+{
+	if (!Cloud.IntersectsSphere(Sphere, Ray, OutHit)) return false;
+
+	OutHit.Object = this;
+	return true;
+}
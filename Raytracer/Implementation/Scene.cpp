@@ -5,7 +5,18 @@
 #include "../Headers/Shader.h"
 #include "../Headers/Light.h"
 #include "../Headers/BVH.h"
+#include "../Headers/BVHBuilders.h"
+#include "../Headers/BVHStats.h"
+#include "../Headers/BVHNodeOrder.h"
+#include "../Headers/WideBVH.h"
+#include "../Headers/QuantizedBVH.h"
+#include "../Headers/RayPacket.h"
+#include "../Headers/ScenePrimitives.h"
+#include "../Headers/AllocationCounter.h"
+#include <cassert>
 #include <chrono>
+#include <unordered_map>
+#include <unordered_set>
 
 
 
@@ -19,6 +30,12 @@ RScene::RScene(const uint16_t InHeight, const uint16_t InWidth)
 	bSSAA = false;
 	SamplesSSAA = 4;
 	FOV = DegToRad(90.0);
+	Layout = BVHLayout::Binary;
+	Builder = BVHBuilder::BinnedSAH;
+	BVHCacheDirectory = "BVHCache";
+	NodeOrder = BVHNodeOrder::DepthFirst;
+	BVHStatisticsFile = "";
+	PacketSize = 16;
 }
 
 RScene::~RScene() = default;
@@ -26,26 +43,23 @@ RScene::~RScene() = default;
 
 void RScene::AddObject(SharedPtr<RPrimitive> Object)
 {
-	/* If object is a mesh, we want to add each its triangle as an individual object,
-	 * so before that we need to copy mesh transform and material to all triangles 
-	 * Probably not the best solution, should be reworked
+	/* Meshes are added as instances, so the same mesh added several times shares its triangles and BVH.
+	 * The instance takes the mesh transform and material at the moment it is added
 	 */
 	auto Mesh = std::dynamic_pointer_cast<OMesh>(Object);
 	if (Mesh)
 	{
-		std::transform(Mesh->Triangles.begin(), Mesh->Triangles.end(), Mesh->Triangles.begin(),
-			[Mesh](SharedPtr<Triangle> Tri)
-			{
-				Tri->Transform = Mesh->Transform;
-				Tri->SetMaterial(Mesh->Mat);
-				return Tri;
-			});
-		SceneObjects.insert(SceneObjects.end(), Mesh->Triangles.begin(), Mesh->Triangles.end());
+		SceneObjects.push_back(MakeShared<OMeshInstance>(Mesh));
 	}
 	else
 	{
 		SceneObjects.push_back(Object);
 	}
+
+#if USE_BVH
+	/* The BVH can only be refit while the set of primitives stays the same */
+	SceneBVH = nullptr;
+#endif
 }
 
 
@@ -78,38 +92,334 @@ void RScene::BuildBVH()
 	LOG("Scene", LogType::LOG, "Start BVH building...");
 
 	const auto StartTime = std::chrono::high_resolution_clock::now();
-	BVHRoot = CreateBVH(this);
+
+	/* Bottom level BVHs first, every mesh is built once no matter how many instances it has and again when Builder changed */
+	uint32_t MeshCount = 0;
+	for (const auto& Object : SceneObjects)
+	{
+		const auto Instance = std::dynamic_pointer_cast<OMeshInstance>(Object);
+		if (Instance && !Instance->GetMesh()->HasBVH(Builder))
+		{
+			Instance->GetMesh()->BuildBVH(Builder, BVHCacheDirectory);
+			MeshCount++;
+		}
+
+		const auto Cloud = std::dynamic_pointer_cast<OSphereCloud>(Object);
+		if (Cloud) Cloud->BuildBVH(Builder);
+	}
+
+	/* Unbounded primitives would overlap every node, only the bounded ones go into the BVH */
+	std::vector<SharedPtr<RPrimitive>> BoundedObjects;
+	UnboundedObjects.clear();
+	for (const auto& Object : SceneObjects)
+	{
+		(Object->IsBounded() ? BoundedObjects : UnboundedObjects).push_back(Object);
+	}
+
+	SceneBVH = CreateBVH(BoundedObjects, Builder);
 	const auto EndTime = std::chrono::high_resolution_clock::now();
 
 	std::chrono::duration<double, std::milli> DeltaTime = EndTime - StartTime;
 	const double Time = DeltaTime.count() / 1000.0;
 	LOG("Scene", LogType::LOG, "BVH was built in {:.2f} seconds", Time);
-	LOG("Scene", LogType::LOG, "BVH has {} Primitives in {} Leaves", 
-		CountPrimitives(BVHRoot), 
-		CountLeaves(BVHRoot));
+	LOG("Scene", LogType::LOG, "BVH has {} Primitives in {} Leaves, SAH cost {:.2f}, {} Mesh BVHs were built, {} Unbounded primitives are outside", 
+		CountPrimitives(*SceneBVH), 
+		CountLeaves(*SceneBVH),
+		SceneBVH->BuildCost,
+		MeshCount,
+		UnboundedObjects.size());
+
+	ReorderSceneBVHNodes(NodeOrder);
+	BuiltBuilder = Builder;
+	BuiltNodeOrder = NodeOrder;
+	BVHStats::Print(MakeBVHReport());
+
+	CollapseSceneBVH();
+	CompileScenePrimitives();
+}
+
+void RScene::CompileScenePrimitives()
+{
+	if (!BVHPrimitives) BVHPrimitives = MakeUnique<ScenePrimitives>();
+	if (!UnboundedPrimitives) UnboundedPrimitives = MakeUnique<ScenePrimitives>();
+
+	BVHPrimitives->Compile(SceneBVH->Primitives);
+	UnboundedPrimitives->Compile(UnboundedObjects);
+}
+
+void RScene::ReorderSceneBVHNodes(const BVHNodeOrder Order)
+{
+	std::unordered_set<OMesh*> Meshes;
+	for (const auto& Object : SceneObjects)
+	{
+		const auto Instance = std::dynamic_pointer_cast<OMeshInstance>(Object);
+		OMesh* Mesh = Instance ? Instance->GetMesh() : nullptr;
+		if (Mesh && Mesh->HasBVH() && Meshes.insert(Mesh).second)
+		{
+			// Compressed nodes are restored for the reorder and compressed again in the new order
+			const bool bCompressed = Mesh->IsBVHCompressed();
+			Mesh->DecompressBVH();
+			ReorderBVHNodes(*Mesh->MeshBVH, Order);
+			if (bCompressed) Mesh->CompressBVH();
+		}
+	}
+
+	ReorderBVHNodes(*SceneBVH, Order);
+}
+
+BVHReport RScene::MakeBVHReport() const
+{
+	BVHReport Report;
+	Report.Scene = BVHStats::Compute(*SceneBVH);
+	Report.Traversal = BVHStats::GetTotalCounters();
+
+	std::unordered_map<const OMesh*, size_t> MeshIndices;
+	for (const auto& Object : SceneObjects)
+	{
+		const auto Instance = std::dynamic_pointer_cast<OMeshInstance>(Object);
+		if (!Instance || !Instance->GetMesh()->HasBVH()) continue;
+
+		const auto [It, bInserted] = MeshIndices.try_emplace(Instance->GetMesh(), Report.Meshes.size());
+		if (bInserted)
+		{
+			const OMesh* Mesh = Instance->GetMesh();
+			if (Mesh->IsBVHCompressed())
+			{
+				// Statistics of the tree the quantized nodes encode, its nodes are only kept while the report is made
+				LinearBVH Restored;
+				Restored.Nodes = Mesh->RestoreBVHNodes();
+				Report.Meshes.push_back(BVHStats::Compute(Restored));
+			}
+			else
+			{
+				Report.Meshes.push_back(BVHStats::Compute(*Mesh->GetBVH()));
+			}
+			Report.MeshInstances.push_back(0);
+		}
+		Report.MeshInstances[It->second]++;
+	}
+
+	return Report;
+}
+
+void RScene::CollapseSceneBVH()
+{
+	SceneBVH4 = nullptr;
+	SceneBVH8 = nullptr;
+	SceneQuantizedBVH = nullptr;
+	BuiltLayout = Layout;
+
+	/* 
+	 * Almost all nodes are in the mesh BVHs, with the quantized layout they are compressed and their full precision nodes released.
+	 * Other layouts traverse full precision nodes, restored in depth-first order, so the node order is applied to them again.
+	 */
+	for (const auto& Object : SceneObjects)
+	{
+		const auto Instance = std::dynamic_pointer_cast<OMeshInstance>(Object);
+		if (!Instance) continue;
+
+		OMesh* Mesh = Instance->GetMesh();
+		if (Layout == BVHLayout::Quantized)
+		{
+			Mesh->CompressBVH();
+		}
+		else if (Mesh->IsBVHCompressed())
+		{
+			Mesh->DecompressBVH();
+			ReorderBVHNodes(*Mesh->MeshBVH, BuiltNodeOrder);
+		}
+	}
+	if (Layout == BVHLayout::Binary) return;
+
+	if (Layout == BVHLayout::Quantized)
+	{
+		SceneQuantizedBVH = QuantizeBVH(*SceneBVH);
+		LOG("Scene", LogType::LOG, "BVH was quantized to {} Nodes, {:.2f} KB",
+			SceneQuantizedBVH->Nodes.size(),
+			SceneQuantizedBVH->Nodes.size() * sizeof(QuantizedBVHNode) / 1024.0);
+		return;
+	}
+
+	const auto StartTime = std::chrono::high_resolution_clock::now();
+	size_t WideNodes;
+	if (Layout == BVHLayout::Wide4)
+	{
+		SceneBVH4 = CollapseBVH<4>(*SceneBVH);
+		WideNodes = SceneBVH4->Nodes.size();
+	}
+	else
+	{
+		SceneBVH8 = CollapseBVH<8>(*SceneBVH);
+		WideNodes = SceneBVH8->Nodes.size();
+	}
+	const auto EndTime = std::chrono::high_resolution_clock::now();
+
+	const std::chrono::duration<double, std::milli> DeltaTime = EndTime - StartTime;
+	LOG("Scene", LogType::LOG, "BVH was collapsed to BVH{} with {} Nodes in {:.2f} seconds", 
+		Layout == BVHLayout::Wide4 ? 4 : 8, 
+		WideNodes, 
+		DeltaTime.count() / 1000.0);
+}
+
+void RScene::UpdateBVH()
+{
+	if (!SceneBVH || Builder != BuiltBuilder || NodeOrder != BuiltNodeOrder)
+	{
+		BuildBVH();
+		return;
+	}
+
+	/* Only transforms changed since the last frame, mesh BVHs are in object space and stay valid */
+	const auto StartTime = std::chrono::high_resolution_clock::now();
+	const uint32_t ChangedLeaves = RefitBVH(*SceneBVH);
+	const double Cost = ComputeSAHCost(*SceneBVH);
+	CompileScenePrimitives();
+	const auto EndTime = std::chrono::high_resolution_clock::now();
+
+	const std::chrono::duration<double, std::milli> DeltaTime = EndTime - StartTime;
+	LOG("Scene", LogType::LOG, "BVH was refit in {:.2f} ms, {} of {} Leaves changed, SAH cost {:.2f} (built {:.2f})",
+		DeltaTime.count(),
+		ChangedLeaves,
+		CountLeaves(*SceneBVH),
+		Cost,
+		SceneBVH->BuildCost);
+
+	if (Cost > SceneBVH->BuildCost * BVH_REFIT_MAX_DEGRADATION)
+	{
+		LOG("Scene", LogType::LOG, "BVH quality degraded too much, rebuilding");
+		BuildBVH();
+		return;
+	}
+
+	if (ChangedLeaves > 0 || Layout != BuiltLayout) CollapseSceneBVH();
 }
 #endif
 
 bool RScene::QueryScene(const RRay& Ray, RHit& OutHit) const
 {
 	TotalRaysShooted++;
+#if BVH_TRAVERSAL_STATS
+	BVHStats::GetThreadCounters().Rays++;
+#endif
 #if USE_BVH
-	return BVHTraverse(BVHRoot, Ray, OutHit);
+	/* Unbounded objects go first, their closest hit clips the ray before the BVH is traversed */
+	RRay ClippedRay = Ray;
+	RPrimitiveHit Hit;
+	const ScenePrimitiveList Unbounded{ *UnboundedPrimitives };
+	bool bHit = Unbounded.IntersectsLeaf(0, UnboundedPrimitives->Count(), ClippedRay, Hit);
+
+	// Traversals only write Hit when they find a hit, which is then closer than the unbounded one
+	const ScenePrimitiveList Primitives{ *BVHPrimitives };
+	// Until the next UpdateBVH the tree of a newly selected layout may not exist, the binary one always does
+	if (Layout == BVHLayout::Wide4 && SceneBVH4) bHit |= WideBVHTraverse(*SceneBVH4, Primitives, ClippedRay, Hit);
+	else if (Layout == BVHLayout::Wide8 && SceneBVH8) bHit |= WideBVHTraverse(*SceneBVH8, Primitives, ClippedRay, Hit);
+	else if (Layout == BVHLayout::Quantized && SceneQuantizedBVH) bHit |= QuantizedBVHTraverse(*SceneQuantizedBVH, Primitives, ClippedRay, Hit);
+	else bHit |= BVHTraverse(*SceneBVH, Primitives, ClippedRay, Hit);
 #else
-	double MinDist = INFINITY;
+	RPrimitiveHit Hit;
 	bool bHit = false;
 
 	for (auto Object : SceneObjects)
 	{
-		RHit TempHit;
-		if (Object->Intersects(Ray, TempHit) && TempHit.Depth < MinDist)
+		RPrimitiveHit TempHit;
+		if (Object->FindHit(Ray, TempHit) && TempHit.Depth < Hit.Depth)
 		{
 			bHit = true;
-			MinDist = TempHit.Depth;
-			OutHit = TempHit;
+			Hit = TempHit;
+		}
+	}
+#endif
+	if (!bHit) return false;
+
+	// The surface is only computed for the closest hit
+	Hit.Object->GetHit(Ray, Hit, OutHit);
+	return true;
 }
+
+#if USE_BVH
+/* Clips the rays to the closest unbounded hit and traces them as one packet through BVH */
+template<uint32_t Size>
+static uint32_t TraceScenePacket(const LinearBVH& BVH, const ScenePrimitiveList& Primitives, const ScenePrimitiveList& Unbounded, const RRay* Rays, const uint32_t Count, RPrimitiveHit* OutHits)
+{
+	RRay ClippedRays[Size];
+	uint32_t HitMask = 0;
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		ClippedRays[i] = Rays[i];
+		if (Unbounded.IntersectsLeaf(0, Unbounded.Primitives.Count(), ClippedRays[i], OutHits[i])) HitMask |= 1u << i;
 	}
-	return bHit;
+
+	RayPacket<Size> Packet(ClippedRays, Count);
+	if (Packet.bCoherent) return HitMask | BVHTraversePacket(BVH, Primitives, Packet, OutHits);
+
+	// Rays going different ways share too few nodes to be worth tracing together
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		if (BVHTraverse(BVH, Primitives, ClippedRays[i], OutHits[i])) HitMask |= 1u << i;
+	}
+	return HitMask;
+}
+#endif
+
+uint32_t RScene::QueryScenePacket(const RRay* Rays, const uint32_t Count, RHit* OutHits) const
+{
+	assert(Count <= RAY_PACKET_MAX_SIZE && "Larger packets have to be split by the caller");
+	const uint32_t PacketSize = std::min(Count, RAY_PACKET_MAX_SIZE);
+
+#if USE_BVH
+	if (PacketSize > 1 && Layout == BVHLayout::Binary)
+	{
+		TotalRaysShooted += PacketSize;
+#if BVH_TRAVERSAL_STATS
+		BVHStats::GetThreadCounters().Rays += PacketSize;
+#endif
+		const ScenePrimitiveList Primitives{ *BVHPrimitives };
+		const ScenePrimitiveList Unbounded{ *UnboundedPrimitives };
+		RPrimitiveHit Hits[RAY_PACKET_MAX_SIZE];
+		uint32_t HitMask;
+		if (PacketSize <= 4) HitMask = TraceScenePacket<4>(*SceneBVH, Primitives, Unbounded, Rays, PacketSize, Hits);
+		else if (PacketSize <= 8) HitMask = TraceScenePacket<8>(*SceneBVH, Primitives, Unbounded, Rays, PacketSize, Hits);
+		else HitMask = TraceScenePacket<RAY_PACKET_MAX_SIZE>(*SceneBVH, Primitives, Unbounded, Rays, PacketSize, Hits);
+
+		for (uint32_t Mask = HitMask; Mask; Mask &= Mask - 1)
+		{
+			const uint32_t i = std::countr_zero(Mask);
+			Hits[i].Object->GetHit(Rays[i], Hits[i], OutHits[i]);
+		}
+		return HitMask;
+	}
+#endif
+
+	uint32_t HitMask = 0;
+	for (uint32_t i = 0; i < PacketSize; i++)
+	{
+		if (QueryScene(Rays[i], OutHits[i])) HitMask |= 1u << i;
+	}
+	return HitMask;
+}
+
+bool RScene::QueryOcclusion(const RRay& Ray, const double MaxDistance, const RPrimitive* IgnoredObject) const
+{
+	TotalRaysShooted++;
+#if BVH_TRAVERSAL_STATS
+	BVHStats::GetThreadCounters().Rays++;
+#endif
+#if USE_BVH
+	const ScenePrimitiveList Unbounded{ *UnboundedPrimitives, IgnoredObject };
+	if (Unbounded.OccludesLeaf(0, UnboundedPrimitives->Count(), Ray, MaxDistance)) return true;
+
+	const ScenePrimitiveList Primitives{ *BVHPrimitives, IgnoredObject };
+	// Same fallback to the binary BVH as in QueryScene
+	if (Layout == BVHLayout::Wide4 && SceneBVH4) return WideBVHOccluded(*SceneBVH4, Primitives, Ray, MaxDistance);
+	if (Layout == BVHLayout::Wide8 && SceneBVH8) return WideBVHOccluded(*SceneBVH8, Primitives, Ray, MaxDistance);
+	if (Layout == BVHLayout::Quantized && SceneQuantizedBVH) return QuantizedBVHOccluded(*SceneQuantizedBVH, Primitives, Ray, MaxDistance);
+	return BVHOccluded(*SceneBVH, Primitives, Ray, MaxDistance);
+#else
+	for (auto Object : SceneObjects)
+	{
+		if (Object.get() != IgnoredObject && Object->Occludes(Ray, MaxDistance)) return true;
+	}
+	return false;
 #endif
 }
 
@@ -118,15 +428,14 @@ void RScene::Render()
 	ExtractLightSources();
 
 #if USE_BVH
-	BuildBVH();
+	UpdateBVH();
+	BVHStats::ResetCounters();
 #endif
 
 	const auto StartTime = std::chrono::high_resolution_clock::now();
 	
-	const auto Height = RenderTexture->GetHeight();
-	const auto Width = RenderTexture->GetWidth();
-	
-	const double AspectRatio = static_cast<double>(Width) / Height;
+	const int32_t Height = RenderTexture->GetHeight();
+	const int32_t Width = RenderTexture->GetWidth();
 
 	double JitterMatrix[4 * 2] = {
 		-1.0 / 4.0,  3.0 / 4.0,
@@ -135,66 +444,55 @@ void RScene::Render()
 		1.0 / 4.0, -3.0 / 4.0
 	};
 
-	const Vector3 CameraPosition(0.0, 0.0, 0.0);
-	//Vector3 CameraDirection(1.0, 0.0, 0.0);
-
 	int32_t CurrentPixel = 0;
+
+	/* Pixels are rendered in tiles, the rays of one sample of every pixel in a tile are traced as a packet */
+	const uint32_t TileSize = std::clamp<uint32_t>(std::bit_floor(static_cast<uint32_t>(PacketSize)), 1, RAY_PACKET_MAX_SIZE);
+	const int32_t TileWidth = GetRayPacketTileWidth(TileSize);
+	const int32_t TileHeight = TileSize / TileWidth;
+	const int32_t Samples = bSSAA ? SamplesSSAA : 1;
 	
 	#pragma omp parallel for
-	for (int32_t i = 0; i < Height; i++)
+	for (int32_t i = 0; i < Height; i += TileHeight)
 	{
-		for (int32_t j = 0; j < Width; j++)
+		for (int32_t j = 0; j < Width; j += TileWidth)
 		{
-			CurrentPixel++;
-			RColor Pixel;
-			if (bSSAA)
-			{				
-				for (int32_t k = 0; k < SamplesSSAA; k++)
-				{
-					/* Generate random numbers to shift ray inside a pixel */
-					const double EpsilonX = Random::RDouble();
-					const double EpsilonY = Random::RDouble();
-
-					/* Screen-Space coords of a pixel [-1.0; 1.0] */
-					double SSX = 2.0 * (j + EpsilonX) / static_cast<double>(Width) - 1.0;
-					double SSY = 2.0 * (i + EpsilonY) / static_cast<double>(Height) - 1.0;
-					SSX *= AspectRatio;
+			const int32_t TileW = std::min(TileWidth, Width - j);
+			const int32_t TileH = std::min(TileHeight, Height - i);
 
-					const double PixelCameraX = SSX * tan(FOV / 2.0);
-					const double PixelCameraY = SSY * tan(FOV / 2.0);
-
-					RRay Ray;
-					Ray.Origin = CameraPosition;
-					Ray.Direction = Vector3(1.0, PixelCameraX, -PixelCameraY).Normalized();
-
-					Pixel += RenderPixel(Ray);
+			RColor Pixels[RAY_PACKET_MAX_SIZE];
+			for (int32_t k = 0; k < Samples; k++)
+			{
+				RRay Rays[RAY_PACKET_MAX_SIZE];
+				for (int32_t y = 0; y < TileH; y++)
+				{
+					for (int32_t x = 0; x < TileW; x++)
+					{
+						/* Generate random numbers to shift ray inside a pixel */
+						const double EpsilonX = bSSAA ? Random::RDouble() : 0.5;
+						const double EpsilonY = bSSAA ? Random::RDouble() : 0.5;
+
+						Rays[y * TileW + x] = GetPrimaryRay(j + x + EpsilonX, i + y + EpsilonY);
+					}
 				}
-				Pixel = Pixel / SamplesSSAA;
+				RenderPacket(Rays, TileW * TileH, Pixels);
 			}
-			else
-			{
-				/* Screen-Space coords of a pixel [-1.0; 1.0] */
-				double SSX = 2.0 * (j + 0.5) / (double)Width - 1;
-				double SSY = 2.0 * (i + 0.5) / (double)Height - 1;
-				SSX *= AspectRatio;
 
-				const double PixelCameraX = SSX * tan(FOV / 2.0);
-				const double PixelCameraY = SSY * tan(FOV / 2.0);
-
-				RRay Ray;
-				Ray.Origin = CameraPosition;
-				Ray.Direction = Vector3(1.0, PixelCameraX, -PixelCameraY).Normalized();
-
-				Pixel = RenderPixel(Ray);
+			for (int32_t y = 0; y < TileH; y++)
+			{
+				for (int32_t x = 0; x < TileW; x++)
+				{
+					RenderTexture->Write(Pixels[y * TileW + x] / Samples, j + x, i + y);
+				}
 			}
-
-			RenderTexture->Write(Pixel, j, i);
 			
 			#pragma omp critical
 			{
-				DrawPercent("Scene", "Rendering", CurrentPixel, Height * Width, 5);
+				for (int32_t p = 0; p < TileW * TileH; p++)
+				{
+					DrawPercent("Scene", "Rendering", ++CurrentPixel, Height * Width, 5);
+				}
 			}
-
 		}
 	}
 
@@ -203,6 +501,96 @@ void RScene::Render()
 	std::chrono::duration<double, std::milli> DeltaTime = EndTime - StartTime;
 	const double Time = DeltaTime.count() / 1000.0;
 	LOG("Scene", LogType::LOG, "Rendering Time: {:.2f} seconds, total rays shooted: {}", Time, TotalRaysShooted);
+
+#if USE_BVH
+	const BVHReport Report = MakeBVHReport();
+	const BVHTraversalCounters& Traversal = Report.Traversal;
+	if (Traversal.Rays > 0)
+	{
+		LOG("Scene", LogType::LOG, "{:.2f} BVH Node visits and {:.2f} Primitive tests per ray",
+			static_cast<double>(Traversal.NodeVisits) / Traversal.Rays,
+			static_cast<double>(Traversal.PrimitiveTests) / Traversal.Rays);
+	}
+	if (!BVHStatisticsFile.empty() && BVHStats::ExportJSON(BVHStatisticsFile, Report))
+	{
+		LOG("Scene", LogType::LOG, "BVH statistics were written to {}", BVHStatisticsFile);
+	}
+#endif
+}
+
+#if USE_BVH
+void RScene::BenchmarkNodeOrders(const uint32_t Repetitions)
+{
+	ExtractLightSources();
+	UpdateBVH();
+
+	const int32_t Height = RenderTexture->GetHeight();
+	const int32_t Width = RenderTexture->GetWidth();
+	const BVHNodeOrder Orders[] = { BVHNodeOrder::DepthFirst, BVHNodeOrder::VanEmdeBoas, BVHNodeOrder::Treelets };
+	const char* OrderNames[] = { "Depth-first", "van Emde Boas", "Treelets" };
+
+	for (uint8_t i = 0; i < std::size(Orders); i++)
+	{
+		ReorderSceneBVHNodes(Orders[i]);
+		CollapseSceneBVH();
+
+		double BestTime = DBL_MAX;
+		int32_t Hits = 0;
+		uint64_t Allocations = 0;
+		for (uint32_t Repetition = 0; Repetition < Repetitions; Repetition++)
+		{
+			const auto StartTime = std::chrono::high_resolution_clock::now();
+			Hits = 0;
+			Allocations = 0;
+
+			#pragma omp parallel for reduction(+ : Hits, Allocations) schedule(dynamic, 1)
+			for (int32_t y = 0; y < Height; y++)
+			{
+#if BVH_TRAVERSAL_STATS
+				/* A thread's first query registers its counters, which must not be measured */
+				BVHStats::GetThreadCounters();
+#endif
+				const AllocationScope Scope;
+				for (int32_t x = 0; x < Width; x++)
+				{
+					RHit Hit;
+					if (QueryScene(GetPrimaryRay(x + 0.5, y + 0.5), Hit)) Hits++;
+				}
+				Allocations += Scope.GetAllocations();
+			}
+
+			const std::chrono::duration<double> DeltaTime = std::chrono::high_resolution_clock::now() - StartTime;
+			BestTime = std::min(BestTime, DeltaTime.count());
+		}
+
+		LOG("Scene", LogType::LOG, "{} node order: {:.3f} Mrays/s, {} of {} primary rays hit, {} heap allocations while tracing",
+			OrderNames[i],
+			Height * Width / BestTime / 1e6,
+			Hits,
+			Height * Width,
+			COUNT_HEAP_ALLOCATIONS ? std::to_string(Allocations) : "uncounted");
+	}
+
+	ReorderSceneBVHNodes(NodeOrder);
+	CollapseSceneBVH();
+}
+#endif
+
+RRay RScene::GetPrimaryRay(const double X, const double Y) const
+{
+	const uint16_t Height = RenderTexture->GetHeight();
+	const uint16_t Width = RenderTexture->GetWidth();
+	const double AspectRatio = static_cast<double>(Width) / Height;
+
+	/* Screen-Space coords of a pixel [-1.0; 1.0] */
+	double SSX = 2.0 * X / static_cast<double>(Width) - 1.0;
+	double SSY = 2.0 * Y / static_cast<double>(Height) - 1.0;
+	SSX *= AspectRatio;
+
+	const double PixelCameraX = SSX * tan(FOV / 2.0);
+	const double PixelCameraY = SSY * tan(FOV / 2.0);
+
+	return RRay(Vector3(0.0, 0.0, 0.0), Vector3(1.0, PixelCameraX, -PixelCameraY).Normalized());
 }
 
 void RScene::SetEnvironmentTexture(SharedPtr<RTexture>& Texture)
@@ -210,9 +598,14 @@ void RScene::SetEnvironmentTexture(SharedPtr<RTexture>& Texture)
 	EnvironmentTexture = Texture;
 }
 
-RColor RScene::RenderPixel(const RRay& Ray) const
-{	
-	return Shader->Light(this, Ray);
+void RScene::RenderPacket(const RRay* Rays, const uint32_t Count, RColor* OutColors) const
+{
+	RHit Hits[RAY_PACKET_MAX_SIZE];
+	const uint32_t HitMask = QueryScenePacket(Rays, Count, Hits);
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		OutColors[i] += Shader->Light(this, Rays[i], HitMask & (1u << i) ? &Hits[i] : nullptr);
+	}
 }
 
 void RScene::SetShader(UniquePtr<RShader> InShader)
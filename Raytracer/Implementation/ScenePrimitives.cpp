@@ -0,0 +1,53 @@
+#include "../Headers/ScenePrimitives.h"
+#include "../Headers/Light.h"
+#include <typeinfo>
+
+
+void ScenePrimitives::Compile(const std::vector<SharedPtr<RPrimitive>>& Primitives)
+{
+	References.clear();
+	Spheres.Clear();
+	SphereLights.Clear();
+	Planes.Clear();
+	MeshInstances.clear();
+	Others.clear();
+
+	References.reserve(Primitives.size());
+	for (const auto& Primitive : Primitives)
+	{
+		/* Only exact types have their kernel, a subclass may test rays differently */
+		const RPrimitive* Object = Primitive.get();
+		const std::type_info& Type = typeid(*Object);
+
+		/* Scaled spheres are ellipsoids in world space, they keep their object space test */
+		const bool bWorldSphere = IsUnscaled(Object->Transform);
+
+		if (Type == typeid(OSphere) && bWorldSphere)
+		{
+			References.push_back({ ScenePrimitiveType::Sphere, static_cast<uint32_t>(Spheres.Objects.size()) });
+			Spheres.Add(Object->Transform.GetPosition(), static_cast<const OSphere*>(Object)->Radius, Object);
+		}
+		else if (Type == typeid(RSphereLight) && bWorldSphere)
+		{
+			References.push_back({ ScenePrimitiveType::SphereLight, static_cast<uint32_t>(SphereLights.Objects.size()) });
+			SphereLights.Add(Object->Transform.GetPosition(), static_cast<const RSphereLight*>(Object)->GetRadius(), Object);
+		}
+		else if (Type == typeid(OPlane))
+		{
+			References.push_back({ ScenePrimitiveType::Plane, static_cast<uint32_t>(Planes.Objects.size()) });
+			Planes.Add(Object->Transform.GetPosition(), static_cast<const OPlane*>(Object)->Normal, Object);
+		}
+		else if (Type == typeid(OMeshInstance) || Type == typeid(OMesh))
+		{
+			// A mesh placed directly is an instance of itself
+			const OMesh* Mesh = Type == typeid(OMesh) ? static_cast<const OMesh*>(Object) : static_cast<const OMeshInstance*>(Object)->GetMesh();
+			References.push_back({ ScenePrimitiveType::MeshInstance, static_cast<uint32_t>(MeshInstances.size()) });
+			MeshInstances.push_back({ Object->Transform, Mesh, Object });
+		}
+		else
+		{
+			References.push_back({ ScenePrimitiveType::Other, static_cast<uint32_t>(Others.size()) });
+			Others.push_back(Object);
+		}
+	}
+}
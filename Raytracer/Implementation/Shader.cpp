@@ -39,11 +39,8 @@ Vector3 RShader::DirectLighting(const RScene* const Scene, const RRay& Ray, cons
 				if (bShadows)
 				{
 					/* If the point is in shadow, skip direct lighting for this Light */
-					RRay ShadowRay;
-					ShadowRay.Origin = Hit.Position + Hit.Normal * 1e-6;
-					ShadowRay.Direction = LightDir;
-					RHit ShadowHit;
-					if (Scene->QueryScene(ShadowRay, ShadowHit) && ShadowHit.Depth < LightHit.Depth && ShadowHit.Object != Light) continue;
+					const RRay ShadowRay(Hit.Position + Hit.Normal * 1e-6, LightDir);
+					if (Scene->QueryOcclusion(ShadowRay, LightHit.Depth, Light.get())) continue;
 				}
 
 				const double NdotL = std::max(LightDir | Hit.Normal, 0.0);
@@ -67,11 +64,8 @@ Vector3 RShader::DirectLighting(const RScene* const Scene, const RRay& Ray, cons
 			if (bShadows)
 			{
 				/* If the point is in shadow, skip direct lighting for this Light */
-				RRay ShadowRay;
-				ShadowRay.Origin = Hit.Position + Hit.Normal * 1e-6;
-				ShadowRay.Direction = LightDir;
-				RHit ShadowHit;
-				if (Scene->QueryScene(ShadowRay, ShadowHit) && ShadowHit.Depth < LightDist && ShadowHit.Object != Light) continue;
+				const RRay ShadowRay(Hit.Position + Hit.Normal * 1e-6, LightDir);
+				if (Scene->QueryOcclusion(ShadowRay, LightDist, Light.get())) continue;
 			}
 
 			const double NdotL = std::max(LightDir | Hit.Normal, 0.0);
@@ -93,14 +87,25 @@ Vector3 RShader::Light(const RScene* const Scene, const RRay& Ray) const
 	return LightInternal(Scene, Ray);
 }
 
-Vector3 RShader::LightInternal(const RScene* const Scene, const RRay& Ray) const
+Vector3 RShader::Light(const RScene* const Scene, const RRay& Ray, const RHit* const Hit) const
 {
-	Vector3 FinalColor(0.0);
+	if (!Hit) return Scene->SampleEnvMap(Ray.Direction);
+	return ShadeHit(Scene, Ray, *Hit);
+}
 
+Vector3 RShader::LightInternal(const RScene* const Scene, const RRay& Ray) const
+{
 	RHit Hit;
 	// Return color from environment map if we didn't hit anything
 	if (!Scene->QueryScene(Ray, Hit)) return Scene->SampleEnvMap(Ray.Direction);
 
+	return ShadeHit(Scene, Ray, Hit);
+}
+
+Vector3 RShader::ShadeHit(const RScene* const Scene, const RRay& Ray, const RHit& Hit) const
+{
+	Vector3 FinalColor(0.0);
+
 	// We don't want to collect light for the light source, so we'll return just the light's emissive color
 	if (Hit.Mat->GetMaterialType() == MaterialType::Light)
 	{
@@ -126,9 +131,7 @@ Vector3 RShader::LightInternal(const RScene* const Scene, const RRay& Ray) const
 			const Vector3 Micronormal = Scene->ModelBRDF->Sample(LightInfo);
 
 			// Create a new ray from generated micronormal
-			RRay NewRay;
-			NewRay.Direction = Ray.Direction.MirrorByVector(Micronormal);
-			NewRay.Origin = Hit.Position + Hit.Normal * 1e-6;
+			const RRay NewRay(Hit.Position + Hit.Normal * 1e-6, Ray.Direction.MirrorByVector(Micronormal));
 
 			const double NdotL = std::max(0.0, (Micronormal | NewRay.Direction));
 
@@ -166,9 +169,7 @@ Vector3 RShader::RayRecurse(const RScene* const Scene, const RRay& Ray, const ui
 	const Vector3 Micronormal = Scene->ModelBRDF->Sample(LightInfo);
 
 	// Create a new ray from generated micronormal
-	RRay NewRay;
-	NewRay.Direction = Ray.Direction.MirrorByVector(Micronormal);
-	NewRay.Origin = Hit.Position + Hit.Normal * 1e-6;
+	const RRay NewRay(Hit.Position + Hit.Normal * 1e-6, Ray.Direction.MirrorByVector(Micronormal));
 
 	const double NdotL = std::max(0.0, (Micronormal | NewRay.Direction));
 	
@@ -0,0 +1,180 @@
+#include "../Headers/SphereGroup.h"
+#include "../Headers/CoreUtilities.h"
+#include "../Headers/SIMD.h"
+#include <algorithm>
+#include <limits>
+
+
+SphereRecordGroup::SphereRecordGroup()
+{
+	std::fill(X, X + SPHERE_GROUP_SIZE, std::numeric_limits<float>::quiet_NaN());
+	std::fill(Y, Y + SPHERE_GROUP_SIZE, std::numeric_limits<float>::quiet_NaN());
+	std::fill(Z, Z + SPHERE_GROUP_SIZE, std::numeric_limits<float>::quiet_NaN());
+	std::fill(Radius, Radius + SPHERE_GROUP_SIZE, 0.0f);
+}
+
+void SphereRecordGroup::SetSphere(const uint32_t Lane, const Vector3& Center, const double InRadius)
+{
+	X[Lane] = static_cast<float>(Center.X);
+	Y[Lane] = static_cast<float>(Center.Y);
+	Z[Lane] = static_cast<float>(Center.Z);
+	Radius[Lane] = static_cast<float>(InRadius);
+}
+
+
+/*
+ * All kernels evaluate the same expressions in the same order as GetSphereDistance,
+ * so they find exactly the hits of the single sphere test.
+ */
+static uint32_t IntersectScalar(const SphereRecordGroup& Group, const RRay& Ray, SphereGroupHits& OutHits)
+{
+	uint32_t Mask = 0;
+	OutHits.InsideMask = 0;
+	for (uint32_t Lane = 0; Lane < SPHERE_GROUP_SIZE; Lane++)
+	{
+		double Distance;
+		bool bInside;
+		if (!GetSphereDistance(Ray.Origin - Group.GetCenter(Lane), Ray.Direction, Group.Radius[Lane], Distance, bInside)) continue;
+		if (!(Distance >= Ray.TMin && Distance < Ray.TMax)) continue;
+
+		OutHits.Distance[Lane] = Distance;
+		OutHits.InsideMask |= static_cast<uint32_t>(bInside) << Lane;
+		Mask |= 1u << Lane;
+	}
+	return Mask;
+}
+
+#if SIMD_X86
+/* Two lanes per instruction */
+static uint32_t IntersectSSE2(const SphereRecordGroup& Group, const RRay& Ray, SphereGroupHits& OutHits)
+{
+	const __m128d OriginX = _mm_set1_pd(Ray.Origin.X);
+	const __m128d OriginY = _mm_set1_pd(Ray.Origin.Y);
+	const __m128d OriginZ = _mm_set1_pd(Ray.Origin.Z);
+	const __m128d DirectionX = _mm_set1_pd(Ray.Direction.X);
+	const __m128d DirectionY = _mm_set1_pd(Ray.Direction.Y);
+	const __m128d DirectionZ = _mm_set1_pd(Ray.Direction.Z);
+	const __m128d MinDistance = _mm_set1_pd(Ray.TMin);
+	const __m128d MaxDistance = _mm_set1_pd(Ray.TMax);
+	const __m128d Zero = _mm_setzero_pd();
+
+	uint32_t Mask = 0;
+	OutHits.InsideMask = 0;
+	for (uint32_t i = 0; i < SPHERE_GROUP_SIZE; i += 2)
+	{
+		// Lanes i and i + 1 widened to doubles
+		auto Load = [i](const float* Values)
+		{
+			const __m128 All = _mm_load_ps(Values);
+			return _mm_cvtps_pd(i == 0 ? All : _mm_movehl_ps(All, All));
+		};
+
+		// Vector from the ray origin to the centers
+		const __m128d LX = _mm_sub_pd(Load(Group.X), OriginX);
+		const __m128d LY = _mm_sub_pd(Load(Group.Y), OriginY);
+		const __m128d LZ = _mm_sub_pd(Load(Group.Z), OriginZ);
+		const __m128d Radius = Load(Group.Radius);
+
+		const __m128d tca = _mm_add_pd(_mm_add_pd(_mm_mul_pd(LX, DirectionX), _mm_mul_pd(LY, DirectionY)), _mm_mul_pd(LZ, DirectionZ));
+		const __m128d LengthSquared = _mm_add_pd(_mm_add_pd(_mm_mul_pd(LX, LX), _mm_mul_pd(LY, LY)), _mm_mul_pd(LZ, LZ));
+		const __m128d d2 = _mm_sub_pd(LengthSquared, _mm_mul_pd(tca, tca));
+		const __m128d RadiusSquared = _mm_mul_pd(Radius, Radius);
+
+		// Ordered compares are false for NaN, so the empty lanes drop out here
+		__m128d Hit = _mm_and_pd(_mm_cmpge_pd(tca, Zero), _mm_cmple_pd(d2, RadiusSquared));
+		if (_mm_movemask_pd(Hit) == 0) continue;
+
+		const __m128d HalfInner = _mm_sqrt_pd(_mm_sub_pd(RadiusSquared, d2));
+		const __m128d t0 = _mm_sub_pd(tca, HalfInner);
+		const __m128d t1 = _mm_add_pd(tca, HalfInner);
+		const __m128d Inside = _mm_cmplt_pd(t0, Zero);
+		const __m128d Distance = _mm_or_pd(_mm_and_pd(Inside, t1), _mm_andnot_pd(Inside, t0));
+		Hit = _mm_and_pd(Hit, _mm_and_pd(_mm_cmpge_pd(Distance, MinDistance), _mm_cmplt_pd(Distance, MaxDistance)));
+
+		_mm_store_pd(OutHits.Distance + i, Distance);
+		OutHits.InsideMask |= static_cast<uint32_t>(_mm_movemask_pd(Inside)) << i;
+		Mask |= static_cast<uint32_t>(_mm_movemask_pd(Hit)) << i;
+	}
+	return Mask;
+}
+
+/* The whole group in one instruction */
+SIMD_TARGET_AVX static uint32_t IntersectAVX(const SphereRecordGroup& Group, const RRay& Ray, SphereGroupHits& OutHits)
+{
+	static_assert(SPHERE_GROUP_SIZE == 4, "One AVX register holds four doubles");
+
+	// Vector from the ray origin to the centers
+	const __m256d LX = _mm256_sub_pd(_mm256_cvtps_pd(_mm_load_ps(Group.X)), _mm256_set1_pd(Ray.Origin.X));
+	const __m256d LY = _mm256_sub_pd(_mm256_cvtps_pd(_mm_load_ps(Group.Y)), _mm256_set1_pd(Ray.Origin.Y));
+	const __m256d LZ = _mm256_sub_pd(_mm256_cvtps_pd(_mm_load_ps(Group.Z)), _mm256_set1_pd(Ray.Origin.Z));
+	const __m256d Radius = _mm256_cvtps_pd(_mm_load_ps(Group.Radius));
+
+	const __m256d tca = _mm256_add_pd(_mm256_add_pd(
+		_mm256_mul_pd(LX, _mm256_set1_pd(Ray.Direction.X)),
+		_mm256_mul_pd(LY, _mm256_set1_pd(Ray.Direction.Y))),
+		_mm256_mul_pd(LZ, _mm256_set1_pd(Ray.Direction.Z)));
+	const __m256d LengthSquared = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(LX, LX), _mm256_mul_pd(LY, LY)), _mm256_mul_pd(LZ, LZ));
+	const __m256d d2 = _mm256_sub_pd(LengthSquared, _mm256_mul_pd(tca, tca));
+	const __m256d RadiusSquared = _mm256_mul_pd(Radius, Radius);
+	const __m256d Zero = _mm256_setzero_pd();
+
+	// Ordered compares are false for NaN, so the empty lanes drop out here
+	__m256d Hit = _mm256_and_pd(_mm256_cmp_pd(tca, Zero, _CMP_GE_OQ), _mm256_cmp_pd(d2, RadiusSquared, _CMP_LE_OQ));
+	if (_mm256_movemask_pd(Hit) == 0) return 0;
+
+	const __m256d HalfInner = _mm256_sqrt_pd(_mm256_sub_pd(RadiusSquared, d2));
+	const __m256d t0 = _mm256_sub_pd(tca, HalfInner);
+	const __m256d t1 = _mm256_add_pd(tca, HalfInner);
+	const __m256d Inside = _mm256_cmp_pd(t0, Zero, _CMP_LT_OQ);
+	const __m256d Distance = _mm256_blendv_pd(t0, t1, Inside);
+	Hit = _mm256_and_pd(Hit, _mm256_and_pd(
+		_mm256_cmp_pd(Distance, _mm256_set1_pd(Ray.TMin), _CMP_GE_OQ),
+		_mm256_cmp_pd(Distance, _mm256_set1_pd(Ray.TMax), _CMP_LT_OQ)));
+
+	_mm256_store_pd(OutHits.Distance, Distance);
+	OutHits.InsideMask = static_cast<uint32_t>(_mm256_movemask_pd(Inside));
+	return static_cast<uint32_t>(_mm256_movemask_pd(Hit));
+}
+#endif // SIMD_X86
+
+
+using SphereGroupKernel = uint32_t (*)(const SphereRecordGroup&, const RRay&, SphereGroupHits&);
+
+struct SphereGroupDispatch
+{
+	SphereGroupKernel Kernel = IntersectScalar;
+	const char* Name = "Scalar";
+
+	SphereGroupDispatch()
+	{
+#if SIMD_X86
+		if (SupportsAVX())
+		{
+			Kernel = IntersectAVX;
+			Name = "AVX";
+		}
+		else
+		{
+			Kernel = IntersectSSE2;
+			Name = "SSE2";
+		}
+#endif
+	}
+};
+
+static const SphereGroupDispatch& GetDispatch()
+{
+	static const SphereGroupDispatch Dispatch;
+	return Dispatch;
+}
+
+
+uint32_t SphereGroup::Intersect(const SphereRecordGroup& Group, const RRay& Ray, SphereGroupHits& OutHits)
+{
+	return GetDispatch().Kernel(Group, Ray, OutHits);
+}
+
+const char* SphereGroup::GetKernelName()
+{
+	return GetDispatch().Name;
+}
@@ -0,0 +1,245 @@
+#include "../Headers/TriangleGroup.h"
+#include "../Headers/CoreUtilities.h"
+#include "../Headers/SIMD.h"
+#include <algorithm>
+
+/* Baldwin and Weber, "Fast Ray-Triangle Intersections by Coordinate Transformation", JCGT 2016 */
+TriangleRecord::TriangleRecord(const Vector3& A, const Vector3& B, const Vector3& C)
+{
+	const Vector3 Edge1 = B - A;
+	const Vector3 Edge2 = C - A;
+	const Vector3 Normal = Edge1 ^ Edge2;
+	const Vector3 CA = C ^ A;
+	const Vector3 BA = B ^ A;
+	const double Distance = Normal | A;
+
+	std::fill(&Rows[0][0], &Rows[0][0] + 12, 0.0);
+
+	const Vector3 AbsNormal = Normal.Abs();
+	if (AbsNormal.GetMax() < SMALL_NUMBER * SMALL_NUMBER) return;
+
+	// Divide by the largest normal component to keep the transform well conditioned
+	if (AbsNormal.X >= AbsNormal.Y && AbsNormal.X >= AbsNormal.Z)
+	{
+		const double InvNormal = 1.0 / Normal.X;
+		const double Row0[4] = { 0.0, Edge2.Z * InvNormal, -Edge2.Y * InvNormal, CA.X * InvNormal };
+		const double Row1[4] = { 0.0, -Edge1.Z * InvNormal, Edge1.Y * InvNormal, -BA.X * InvNormal };
+		const double Row2[4] = { 1.0, Normal.Y * InvNormal, Normal.Z * InvNormal, -Distance * InvNormal };
+		std::copy(Row0, Row0 + 4, Rows[0]);
+		std::copy(Row1, Row1 + 4, Rows[1]);
+		std::copy(Row2, Row2 + 4, Rows[2]);
+	}
+	else if (AbsNormal.Y >= AbsNormal.Z)
+	{
+		const double InvNormal = 1.0 / Normal.Y;
+		const double Row0[4] = { -Edge2.Z * InvNormal, 0.0, Edge2.X * InvNormal, CA.Y * InvNormal };
+		const double Row1[4] = { Edge1.Z * InvNormal, 0.0, -Edge1.X * InvNormal, -BA.Y * InvNormal };
+		const double Row2[4] = { Normal.X * InvNormal, 1.0, Normal.Z * InvNormal, -Distance * InvNormal };
+		std::copy(Row0, Row0 + 4, Rows[0]);
+		std::copy(Row1, Row1 + 4, Rows[1]);
+		std::copy(Row2, Row2 + 4, Rows[2]);
+	}
+	else
+	{
+		const double InvNormal = 1.0 / Normal.Z;
+		const double Row0[4] = { Edge2.Y * InvNormal, -Edge2.X * InvNormal, 0.0, CA.Z * InvNormal };
+		const double Row1[4] = { -Edge1.Y * InvNormal, Edge1.X * InvNormal, 0.0, -BA.Z * InvNormal };
+		const double Row2[4] = { Normal.X * InvNormal, Normal.Y * InvNormal, 1.0, -Distance * InvNormal };
+		std::copy(Row0, Row0 + 4, Rows[0]);
+		std::copy(Row1, Row1 + 4, Rows[1]);
+		std::copy(Row2, Row2 + 4, Rows[2]);
+	}
+}
+
+TriangleRecordGroup::TriangleRecordGroup()
+{
+	std::fill(&Rows[0][0][0], &Rows[0][0][0] + 12 * TRIANGLE_GROUP_SIZE, 0.0);
+}
+
+void TriangleRecordGroup::SetRecord(const uint32_t Lane, const TriangleRecord& Record)
+{
+	for (uint8_t Row = 0; Row < 3; Row++)
+	{
+		for (uint8_t Column = 0; Column < 4; Column++)
+		{
+			Rows[Row][Column][Lane] = Record.Rows[Row][Column];
+		}
+	}
+}
+
+TriangleRecord TriangleRecordGroup::GetRecord(const uint32_t Lane) const
+{
+	TriangleRecord Record;
+	for (uint8_t Row = 0; Row < 3; Row++)
+	{
+		for (uint8_t Column = 0; Column < 4; Column++)
+		{
+			Record.Rows[Row][Column] = Rows[Row][Column][Lane];
+		}
+	}
+	return Record;
+}
+
+
+/*
+ * All kernels evaluate the same expressions in the same order as TriangleRecord,
+ * so they find exactly the hits of the scalar record test.
+ */
+static uint32_t IntersectScalar(const TriangleRecordGroup& Group, const RRay& Ray, TriangleGroupHits& OutHits)
+{
+	const double MinDistance = std::max(Ray.TMin, SMALL_NUMBER);
+
+	uint32_t Mask = 0;
+	for (uint32_t Lane = 0; Lane < TRIANGLE_GROUP_SIZE; Lane++)
+	{
+		const TriangleRecord Record = Group.GetRecord(Lane);
+		const double Distance = Record.GetPlaneDistance(Ray);
+		if (!(Distance >= MinDistance && Distance < Ray.TMax)) continue;
+
+		double U, V;
+		if (!Record.GetBarycentrics(Ray.Origin + Ray.Direction * Distance, U, V)) continue;
+
+		OutHits.Distance[Lane] = Distance;
+		OutHits.U[Lane] = U;
+		OutHits.V[Lane] = V;
+		Mask |= 1u << Lane;
+	}
+	return Mask;
+}
+
+#if SIMD_X86
+/* Two lanes per instruction */
+static uint32_t IntersectSSE2(const TriangleRecordGroup& Group, const RRay& Ray, TriangleGroupHits& OutHits)
+{
+	const __m128d OriginX = _mm_set1_pd(Ray.Origin.X);
+	const __m128d OriginY = _mm_set1_pd(Ray.Origin.Y);
+	const __m128d OriginZ = _mm_set1_pd(Ray.Origin.Z);
+	const __m128d DirectionX = _mm_set1_pd(Ray.Direction.X);
+	const __m128d DirectionY = _mm_set1_pd(Ray.Direction.Y);
+	const __m128d DirectionZ = _mm_set1_pd(Ray.Direction.Z);
+	const __m128d MinDistance = _mm_set1_pd(std::max(Ray.TMin, SMALL_NUMBER));
+	const __m128d MaxDistance = _mm_set1_pd(Ray.TMax);
+	const __m128d SignBit = _mm_set1_pd(-0.0);
+	const __m128d Zero = _mm_setzero_pd();
+	const __m128d One = _mm_set1_pd(1.0);
+
+	uint32_t Mask = 0;
+	for (uint32_t i = 0; i < TRIANGLE_GROUP_SIZE; i += 2)
+	{
+		auto Load = [&Group, i](const uint8_t Row, const uint8_t Column) { return _mm_load_pd(&Group.Rows[Row][Column][i]); };
+		auto Transform = [&Load](const uint8_t Row, const __m128d X, const __m128d Y, const __m128d Z)
+		{
+			return _mm_add_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(Load(Row, 0), X), _mm_mul_pd(Load(Row, 1), Y)), _mm_mul_pd(Load(Row, 2), Z)), Load(Row, 3));
+		};
+
+		const __m128d OriginDistance = Transform(2, OriginX, OriginY, OriginZ);
+		const __m128d Slope = _mm_add_pd(_mm_add_pd(_mm_mul_pd(Load(2, 0), DirectionX), _mm_mul_pd(Load(2, 1), DirectionY)), _mm_mul_pd(Load(2, 2), DirectionZ));
+		const __m128d Distance = _mm_div_pd(_mm_xor_pd(OriginDistance, SignBit), Slope);
+
+		// Ordered compares are false for NaN, so parallel rays and zero records drop out here
+		__m128d Hit = _mm_and_pd(_mm_cmpge_pd(Distance, MinDistance), _mm_cmplt_pd(Distance, MaxDistance));
+		if (_mm_movemask_pd(Hit) == 0) continue;
+
+		const __m128d PointX = _mm_add_pd(OriginX, _mm_mul_pd(DirectionX, Distance));
+		const __m128d PointY = _mm_add_pd(OriginY, _mm_mul_pd(DirectionY, Distance));
+		const __m128d PointZ = _mm_add_pd(OriginZ, _mm_mul_pd(DirectionZ, Distance));
+		const __m128d U = Transform(0, PointX, PointY, PointZ);
+		const __m128d V = Transform(1, PointX, PointY, PointZ);
+		Hit = _mm_and_pd(Hit, _mm_and_pd(_mm_cmpge_pd(U, Zero), _mm_cmpge_pd(V, Zero)));
+		Hit = _mm_and_pd(Hit, _mm_cmple_pd(_mm_add_pd(U, V), One));
+
+		_mm_store_pd(OutHits.Distance + i, Distance);
+		_mm_store_pd(OutHits.U + i, U);
+		_mm_store_pd(OutHits.V + i, V);
+		Mask |= static_cast<uint32_t>(_mm_movemask_pd(Hit)) << i;
+	}
+	return Mask;
+}
+
+/* Row of the group records applied to a point, or to a direction with bOffset false */
+SIMD_TARGET_AVX static inline __m256d TransformAVX(const TriangleRecordGroup& Group, const uint8_t Row, const __m256d X, const __m256d Y, const __m256d Z, const bool bOffset)
+{
+	const double (&Columns)[4][TRIANGLE_GROUP_SIZE] = Group.Rows[Row];
+	const __m256d Result = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_load_pd(Columns[0]), X), _mm256_mul_pd(_mm256_load_pd(Columns[1]), Y)), _mm256_mul_pd(_mm256_load_pd(Columns[2]), Z));
+	return bOffset ? _mm256_add_pd(Result, _mm256_load_pd(Columns[3])) : Result;
+}
+
+/* The whole group in one instruction */
+SIMD_TARGET_AVX static uint32_t IntersectAVX(const TriangleRecordGroup& Group, const RRay& Ray, TriangleGroupHits& OutHits)
+{
+	static_assert(TRIANGLE_GROUP_SIZE == 4, "One AVX register holds four doubles");
+
+	const __m256d OriginX = _mm256_set1_pd(Ray.Origin.X);
+	const __m256d OriginY = _mm256_set1_pd(Ray.Origin.Y);
+	const __m256d OriginZ = _mm256_set1_pd(Ray.Origin.Z);
+	const __m256d DirectionX = _mm256_set1_pd(Ray.Direction.X);
+	const __m256d DirectionY = _mm256_set1_pd(Ray.Direction.Y);
+	const __m256d DirectionZ = _mm256_set1_pd(Ray.Direction.Z);
+
+	const __m256d OriginDistance = TransformAVX(Group, 2, OriginX, OriginY, OriginZ, true);
+	const __m256d Slope = TransformAVX(Group, 2, DirectionX, DirectionY, DirectionZ, false);
+	const __m256d Distance = _mm256_div_pd(_mm256_xor_pd(OriginDistance, _mm256_set1_pd(-0.0)), Slope);
+
+	// Ordered compares are false for NaN, so parallel rays and zero records drop out here
+	__m256d Hit = _mm256_and_pd(
+		_mm256_cmp_pd(Distance, _mm256_set1_pd(std::max(Ray.TMin, SMALL_NUMBER)), _CMP_GE_OQ),
+		_mm256_cmp_pd(Distance, _mm256_set1_pd(Ray.TMax), _CMP_LT_OQ));
+	if (_mm256_movemask_pd(Hit) == 0) return 0;
+
+	const __m256d PointX = _mm256_add_pd(OriginX, _mm256_mul_pd(DirectionX, Distance));
+	const __m256d PointY = _mm256_add_pd(OriginY, _mm256_mul_pd(DirectionY, Distance));
+	const __m256d PointZ = _mm256_add_pd(OriginZ, _mm256_mul_pd(DirectionZ, Distance));
+	const __m256d U = TransformAVX(Group, 0, PointX, PointY, PointZ, true);
+	const __m256d V = TransformAVX(Group, 1, PointX, PointY, PointZ, true);
+	const __m256d Zero = _mm256_setzero_pd();
+	Hit = _mm256_and_pd(Hit, _mm256_and_pd(_mm256_cmp_pd(U, Zero, _CMP_GE_OQ), _mm256_cmp_pd(V, Zero, _CMP_GE_OQ)));
+	Hit = _mm256_and_pd(Hit, _mm256_cmp_pd(_mm256_add_pd(U, V), _mm256_set1_pd(1.0), _CMP_LE_OQ));
+
+	_mm256_store_pd(OutHits.Distance, Distance);
+	_mm256_store_pd(OutHits.U, U);
+	_mm256_store_pd(OutHits.V, V);
+	return static_cast<uint32_t>(_mm256_movemask_pd(Hit));
+}
+#endif // SIMD_X86
+
+
+using TriangleGroupKernel = uint32_t (*)(const TriangleRecordGroup&, const RRay&, TriangleGroupHits&);
+
+struct TriangleGroupDispatch
+{
+	TriangleGroupKernel Kernel = IntersectScalar;
+	const char* Name = "Scalar";
+
+	TriangleGroupDispatch()
+	{
+#if SIMD_X86
+		if (SupportsAVX())
+		{
+			Kernel = IntersectAVX;
+			Name = "AVX";
+		}
+		else
+		{
+			Kernel = IntersectSSE2;
+			Name = "SSE2";
+		}
+#endif
+	}
+};
+
+static const TriangleGroupDispatch& GetDispatch()
+{
+	static const TriangleGroupDispatch Dispatch;
+	return Dispatch;
+}
+
+
+uint32_t TriangleGroup::Intersect(const TriangleRecordGroup& Group, const RRay& Ray, TriangleGroupHits& OutHits)
+{
+	return GetDispatch().Kernel(Group, Ray, OutHits);
+}
+
+const char* TriangleGroup::GetKernelName()
+{
+	return GetDispatch().Name;
+}